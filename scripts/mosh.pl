@@ -323,12 +323,13 @@ $ENV{ 'MOSH_CLIENT_PID' } = $$; # We don't support this, but it's useful for tes
 # If we are using a locally-resolved address, we have to get it before we fork,
 # so both parent and child get it.
 my $ip;
+my @candidate_ips;
 if ( $use_remote_ip eq 'local' ) {
   # "parse" the host from what the user gave us
   my ($user, $host) = $userhost =~ /^((?:.*@)?)(.*)$/;
   # get list of addresses
   my @res = resolvename( $host, 22, $family );
-  # Use only the first address as the Mosh IP
+  # Use the first address as the Mosh IP
   my $hostaddr = $res[0];
   if ( !defined $hostaddr ) {
     die( "could not find address for $host" );
@@ -339,6 +340,12 @@ if ( $use_remote_ip eq 'local' ) {
   }
   $ip = $addr_string;
   $userhost = "$user$ip";
+  # and let the client race the rest against it
+  for my $ai ( @res[ 1 .. $#res ] ) {
+    my ( $err, $candidate ) = getnameinfo( $ai->{addr}, NI_NUMERICHOST );
+    next if $err or $candidate eq $ip or grep { $_ eq $candidate } @candidate_ips;
+    push @candidate_ips, $candidate;
+  }
 }
 
 my $pid = open(my $pipe, "-|");
@@ -453,7 +460,7 @@ if ( $pid == 0 ) { # child
   $ENV{ 'MOSH_KEY' } = $key;
   $ENV{ 'MOSH_PREDICTION_DISPLAY' } = $predict;
   $ENV{ 'MOSH_NO_TERM_INIT' } = '1' if !$term_init;
-  exec {$client} ("$client", "-# @cmdline |", $ip, $port);
+  exec {$client} ("$client", "-# @cmdline |", join( ',', $ip, @candidate_ips ), $port);
 }
 
 sub shell_quote { join ' ', map {(my $a = $_) =~ s/'/'\\''/g; "'$a'"} @_ }
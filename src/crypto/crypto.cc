@@ -200,14 +200,34 @@ Nonce::Nonce( const char *s_bytes, size_t len )
 
 const string Session::encrypt( const Message & plaintext )
 {
-  const size_t pt_len = plaintext.text.size();
+  struct iovec piece;
+  piece.iov_base = const_cast<char *>( plaintext.text.data() );
+  piece.iov_len = plaintext.text.size();
+
+  size_t ciphertext_len = encrypt( plaintext.nonce, &piece, 1, ciphertext_buffer.data() );
+
+  return plaintext.nonce.cc_str() + string( ciphertext_buffer.data(), ciphertext_len );
+}
+
+size_t Session::encrypt( const Nonce & nonce, const struct iovec *pieces, int count, char *ciphertext )
+{
+  size_t pt_len = 0;
+  for ( int i = 0; i < count; i++ ) {
+    pt_len += pieces[ i ].iov_len;
+  }
   const int ciphertext_len = pt_len + 16;
 
-  assert( (size_t)ciphertext_len <= ciphertext_buffer.len() );
+  assert( (size_t)ciphertext_len <= size_t( RECEIVE_MTU ) );
+  assert( !( (uintptr_t)ciphertext & 0xF ) );
   assert( pt_len <= plaintext_buffer.len() );
 
-  memcpy( plaintext_buffer.data(), plaintext.text.data(), pt_len );
-  memcpy( nonce_buffer.data(), plaintext.nonce.data(), Nonce::NONCE_LEN );
+  /* the one copy of the payload, gathered into the cipher's aligned input */
+  char *pt = plaintext_buffer.data();
+  for ( int i = 0; i < count; i++ ) {
+    memcpy( pt, pieces[ i ].iov_base, pieces[ i ].iov_len );
+    pt += pieces[ i ].iov_len;
+  }
+  memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
   if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
 				     nonce_buffer.data(),                     /* nonce */
@@ -215,7 +235,7 @@ const string Session::encrypt( const Message & plaintext )
 				     pt_len,                                  /* pt_len */
 				     NULL,                                    /* ad */
 				     0,                                       /* ad_len */
-				     ciphertext_buffer.data(),                /* ct */
+				     ciphertext,                              /* ct */
 				     NULL,                                    /* tag */
 				     AE_FINALIZE ) ) {                        /* final */
     throw CryptoException( "ae_encrypt() returned error." );
@@ -243,9 +263,7 @@ const string Session::encrypt( const Message & plaintext )
     throw CryptoException( "Encrypted 2^47 blocks.", true );
   }
 
-  string text( ciphertext_buffer.data(), ciphertext_len );
-
-  return plaintext.nonce.cc_str() + text;
+  return ciphertext_len;
 }
 
 const Message Session::decrypt( const char *str, size_t len )
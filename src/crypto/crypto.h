@@ -38,6 +38,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 #include <exception>
 
 using std::string;
@@ -111,7 +112,10 @@ namespace Crypto {
     Nonce( uint64_t val );
     Nonce( const char *s_bytes, size_t len );
     
-    string cc_str( void ) const { return string( bytes + 4, 8 ); }
+    static const int CC_LEN = 8; /* bytes of the nonce sent on the wire */
+
+    string cc_str( void ) const { return string( cc_data(), CC_LEN ); }
+    const char *cc_data( void ) const { return bytes + 4; }
     const char *data( void ) const { return bytes; }
     uint64_t val( void ) const;
   };
@@ -143,7 +147,7 @@ namespace Crypto {
     AlignedBuffer nonce_buffer;
     
   public:
-    static const int RECEIVE_MTU = 2048;
+    static const int RECEIVE_MTU = 9216; /* room for a jumbo frame, in 16-byte blocks */
     /* Overhead (not counting the nonce, which is handled by network transport) */
     static const int ADDED_BYTES = 16 /* final OCB block */;
 
@@ -151,6 +155,10 @@ namespace Crypto {
     ~Session();
     
     const string encrypt( const Message & plaintext );
+    /* Encrypt the concatenation of the pieces without building it as a
+       string, into 16-byte aligned space for RECEIVE_MTU bytes of
+       ciphertext and tag. Returns the length written. */
+    size_t encrypt( const Nonce & nonce, const struct iovec *pieces, int count, char *ciphertext );
     const Message decrypt( const char *str, size_t len );
     const Message decrypt( const string & ciphertext ) {
       return decrypt( ciphertext.data(), ciphertext.size() );
@@ -0,0 +1,211 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Compression benchmark over a recorded terminal session: replays the
+   recording through a Terminal::Complete, wraps each diff in an
+   Instruction as TransportSender would, and reports the size and CPU
+   time of every codec and level this build supports, including
+   compression against the previous state.
+
+   Record a session with script(1) and pass the typescript; without
+   one, a synthetic full-screen redraw is used. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "completeterminal.h"
+#include "compressor.h"
+#include "transportinstruction.pb.h"
+#include "locale_utils.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+using TransportBuffers::Instruction;
+
+static void usage( const char *argv0 )
+{
+  fprintf( stderr, "Usage: %s [-g WIDTHxHEIGHT] [-c chunk-bytes] [recording]\n", argv0 );
+  exit( 1 );
+}
+
+/* a status display redrawn in place, in the style of top(1), then
+   paging back and forth through a listing, in the style of less(1) */
+static std::string synthetic_recording( int width, int height )
+{
+  std::string out;
+  char tmp[ 128 ];
+  unsigned int x = 1;
+  for ( int frame = 0; frame < 100; frame++ ) {
+    int top = ( frame % 10 < 5 ? frame % 5 : 5 - frame % 5 ) * ( height / 3 );
+    out += "\033[H\033[2J";
+    for ( int row = 0; row < height - 1; row++ ) {
+      snprintf( tmp, sizeof( tmp ), "\033[0;34m%5d\033[0m  drwxr-xr-x  mosh  %8d  file-%d.cc\r\n",
+		top + row, ( top + row ) * 7919 % 100000, top + row );
+      out += tmp;
+    }
+    out += "\033[7m:\033[0m";
+  }
+  for ( int frame = 0; frame < 200; frame++ ) {
+    out += "\033[H\033[0;1;37;44m load average";
+    out += std::string( width - 13, ' ' );
+    for ( int row = 2; row < height; row++ ) {
+      x = x * 1103515245 + 12345;
+      snprintf( tmp, sizeof( tmp ), "\033[%d;1H\033[0;3%dm\xe2\x94\x82%6u %-8s %5.1f %5.1f\033[0m\033[K",
+		row, row % 8, ( x >> 8 ) % 65536, "mosh", ( x >> 4 ) % 1000 / 10.0, row * 0.7 );
+      out += tmp;
+    }
+  }
+  return out;
+}
+
+struct Setting {
+  Codec codec;
+  int level;
+};
+
+int main( int argc, char *argv[] )
+{
+  int width = 80, height = 24;
+  size_t chunk = 4096;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "g:c:" )) != -1 ) {
+    switch ( opt ) {
+    case 'g':
+      if ( sscanf( optarg, "%dx%d", &width, &height ) != 2 || width < 20 || height < 2 ) {
+	usage( argv[ 0 ] );
+      }
+      break;
+    case 'c': chunk = atoi( optarg ); break;
+    default: usage( argv[ 0 ] );
+    }
+  }
+  if ( chunk < 1 || argc > optind + 1 ) {
+    usage( argv[ 0 ] );
+  }
+
+  set_native_locale();
+  fatal_assert( is_utf8_locale() );
+
+  std::string recording;
+  if ( optind < argc ) {
+    FILE *f = fopen( argv[ optind ], "rb" );
+    if ( !f ) {
+      perror( argv[ optind ] );
+      return 1;
+    }
+    char buf[ 65536 ];
+    size_t n;
+    while ( (n = fread( buf, 1, sizeof( buf ), f )) > 0 ) {
+      recording.append( buf, n );
+    }
+    fclose( f );
+  } else {
+    recording = synthetic_recording( width, height );
+  }
+
+  /* the diff stream, one per chunk as the server would read it, and
+     the rendering of each diff's reference state */
+  std::vector<std::string> instructions;
+  std::vector<std::string> dictionaries;
+  Terminal::Complete previous( width, height ), current( width, height );
+  for ( size_t offset = 0; offset < recording.size(); offset += chunk ) {
+    current.act( recording.substr( offset, chunk ) );
+    Instruction inst;
+    inst.set_protocol_version( 2 );
+    inst.set_old_num( instructions.size() );
+    inst.set_new_num( instructions.size() + 1 );
+    inst.set_ack_num( instructions.size() );
+    inst.set_throwaway_num( 0 );
+    inst.set_diff( current.diff_from( previous ) );
+    inst.set_codecs( Compressor::supported_codecs() );
+    instructions.push_back( inst.SerializeAsString() );
+    dictionaries.push_back( previous.compression_dictionary() );
+    previous = current;
+  }
+
+  std::vector<Setting> settings;
+  for ( int c = CODEC_DEFLATE; c <= CODEC_ZLIB; c++ ) {
+    Codec codec = Codec( c );
+    if ( codec != CODEC_ZLIB && !( Compressor::supported_codecs() & ( 1 << codec ) ) ) {
+      continue;
+    }
+    if ( codec == CODEC_STATE ) {
+      Setting setting = { codec, Compressor::default_level( codec ) };
+      settings.push_back( setting );
+      continue;
+    }
+    int levels[] = { 1, Compressor::default_level( codec ), Compressor::max_level( codec ) };
+    for ( int i = 0; i < 3; i++ ) {
+      if ( i > 0 && levels[ i ] == levels[ i - 1 ] ) {
+	continue;
+      }
+      Setting setting = { codec, levels[ i ] };
+      settings.push_back( setting );
+    }
+  }
+
+  size_t input_bytes = 0;
+  for ( size_t i = 0; i < instructions.size(); i++ ) {
+    input_bytes += instructions[ i ].size();
+  }
+  printf( "%d instructions, %lu bytes serialized\n", int( instructions.size() ), (unsigned long)input_bytes );
+
+  Compressor &compressor = get_compressor();
+  for ( size_t s = 0; s < settings.size(); s++ ) {
+    size_t output_bytes = 0;
+    clock_t start = clock();
+    for ( size_t i = 0; i < instructions.size(); i++ ) {
+      size_t len;
+      if ( settings[ s ].codec == CODEC_STATE ) {
+	compressor.compress_with_state( instructions[ i ], &len, i, dictionaries[ i ] );
+      } else {
+	compressor.compress( instructions[ i ], &len, settings[ s ].codec, settings[ s ].level );
+      }
+      output_bytes += len;
+    }
+    double us = 1e6 * double( clock() - start ) / CLOCKS_PER_SEC;
+
+    printf( "codec %d level %2d: %8lu bytes (%5.1f%%), %7.1f us per instruction\n",
+	    settings[ s ].codec, settings[ s ].level, (unsigned long)output_bytes,
+	    100.0 * output_bytes / input_bytes, us / instructions.size() );
+  }
+
+  return 0;
+}
@@ -0,0 +1,232 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Keystroke-to-echo latency benchmark: a client transport sends one
+   keystroke at a time to a server transport over loopback, the server
+   answers each, after a short delay as a pty would, by setting its
+   terminal's title to the count so far, and the client times how long
+   that took to come back. With -c the server draws each answer in
+   several writes, like an application redrawing a screen, and the
+   client also counts the frames that showed it half drawn. With -b the
+   transports batch as they do outside latency mode. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "user.h"
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "networktransport-impl.h"
+#include "outputburst.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+typedef Transport<Terminal::Complete, UserStream> ServerTransport;
+typedef Transport<UserStream, Terminal::Complete> ClientTransport;
+
+static void usage( const char *argv0 )
+{
+  fprintf( stderr, "Usage: %s [-b] [-n keystrokes] [-g gap-ms] [-p pty-delay-ms] [-c writes] [-w write-gap-ms]\n", argv0 );
+  exit( 1 );
+}
+
+static size_t title_count( const Terminal::Complete &terminal )
+{
+  const Terminal::Framebuffer::title_type &title = terminal.get_fb().get_window_title();
+  return strtoul( std::string( title.begin(), title.end() ).c_str(), NULL, 10 );
+}
+
+static void add_fds( std::vector<struct pollfd> &pollfds, const std::vector<int> &fds )
+{
+  for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    struct pollfd pfd;
+    pfd.fd = *i;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pollfds.push_back( pfd );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  bool interactive = true;
+  unsigned int keystrokes = 100;
+  unsigned int gap = 150;
+  unsigned int pty_delay = 1;
+  unsigned int writes = 1;
+  unsigned int write_gap = 3;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "bn:g:p:c:w:" )) != -1 ) {
+    switch ( opt ) {
+    case 'b': interactive = false; break;
+    case 'n': keystrokes = atoi( optarg ); break;
+    case 'g': gap = atoi( optarg ); break;
+    case 'p': pty_delay = atoi( optarg ); break;
+    case 'c': writes = atoi( optarg ); break;
+    case 'w': write_gap = atoi( optarg ); break;
+    default: usage( argv[ 0 ] );
+    }
+  }
+  if ( keystrokes < 1 || writes < 1 ) {
+    usage( argv[ 0 ] );
+  }
+
+  try {
+    Terminal::Complete terminal( 80, 24 );
+    UserStream blank;
+    ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+    ClientTransport client( blank, terminal, server.get_key().c_str(),
+			    "127.0.0.1", server.port().c_str() );
+    client.set_send_delay( 1 ); /* as mosh-client does */
+    client.set_interactive( interactive );
+    server.set_interactive( interactive );
+
+    freeze_timestamp();
+    uint64_t next_keystroke = timestamp() + 500; /* let the handshake settle */
+    Network::OutputBurst output_burst;
+    uint64_t echo_due = uint64_t( -1 );
+    unsigned int writes_left = 0;
+    size_t typed = 0, heard = 0;
+    uint64_t frames_seen = 0, torn = 0;
+    Terminal::Framebuffer last_frame( terminal.get_fb() );
+    uint64_t typed_at_us = 0;
+    std::vector<double> latencies;
+
+    while ( latencies.size() < keystrokes ) {
+      /* the client types */
+      if ( timestamp() >= next_keystroke && typed == latencies.size() ) {
+	client.get_current_state().push_back( Parser::UserByte( 'a' + typed % 26 ) );
+	typed++;
+	typed_at_us = timestamp_us();
+      }
+
+      /* the server's pty echoes what arrived */
+      if ( server.get_latest_remote_state().state.size() > heard ) {
+	heard = server.get_latest_remote_state().state.size();
+	echo_due = timestamp() + pty_delay;
+	writes_left = writes;
+      }
+      if ( timestamp() >= echo_due ) {
+	char output[ 32 ];
+	if ( --writes_left ) { /* part of the drawing */
+	  snprintf( output, sizeof( output ), "\r%u/%u", writes - writes_left, writes );
+	  echo_due = timestamp() + write_gap;
+	} else { /* and the answer, last */
+	  snprintf( output, sizeof( output ), "\033]0;%u\007", unsigned( heard ) );
+	  echo_due = uint64_t( -1 );
+	}
+	terminal.act( output );
+	output_burst.read( timestamp_us(), strlen( output ), 16384 );
+	server.set_output_cadence( output_burst.still_writing(), output_burst.quiet() );
+	server.set_current_state( terminal );
+      }
+
+      /* and sees it come back */
+      if ( !( client.get_latest_remote_state().state.get_fb() == last_frame ) ) {
+	last_frame = client.get_latest_remote_state().state.get_fb();
+	frames_seen++;
+      }
+      if ( title_count( client.get_latest_remote_state().state ) >= typed && typed > latencies.size() ) {
+	latencies.push_back( ( timestamp_us() - typed_at_us ) / 1000.0 );
+	next_keystroke = timestamp() + gap;
+	torn += frames_seen - 1;
+	frames_seen = 0;
+      }
+
+      client.tick();
+      server.tick();
+
+      int wait = std::min( client.wait_time(), server.wait_time() );
+      if ( typed == latencies.size() ) {
+	wait = std::min( wait, int( std::max( next_keystroke, timestamp() ) - timestamp() ) );
+      }
+      if ( echo_due != uint64_t( -1 ) ) {
+	wait = std::min( wait, int( std::max( echo_due, timestamp() ) - timestamp() ) );
+      }
+
+      std::vector<struct pollfd> pollfds;
+      add_fds( pollfds, server.fds() );
+      const size_t server_fds = pollfds.size();
+      add_fds( pollfds, client.fds() );
+
+      if ( poll( &pollfds[ 0 ], pollfds.size(), wait ) < 0 ) {
+	perror( "poll" );
+	return 1;
+      }
+      freeze_timestamp();
+
+      bool server_ready = false, client_ready = false;
+      for ( size_t i = 0; i < pollfds.size(); i++ ) {
+	if ( pollfds[ i ].revents & POLLIN ) {
+	  if ( i < server_fds ) {
+	    server_ready = true;
+	  } else {
+	    client_ready = true;
+	  }
+	}
+      }
+      if ( server_ready ) {
+	server.recv();
+      }
+      if ( client_ready ) {
+	client.recv();
+      }
+    }
+
+    std::sort( latencies.begin(), latencies.end() );
+    double sum = 0;
+    for ( size_t i = 0; i < latencies.size(); i++ ) {
+      sum += latencies[ i ];
+    }
+    printf( "%s: %u keystrokes %u ms apart, pty delay %u ms, %u writes %u ms apart: "
+	    "echo latency mean %.1f ms, median %.1f ms, p95 %.1f ms, max %.1f ms; %.2f torn frames per echo\n",
+	    interactive ? "latency mode" : "batched", keystrokes, gap, pty_delay, writes, write_gap,
+	    sum / latencies.size(), latencies[ latencies.size() / 2 ],
+	    latencies[ latencies.size() * 95 / 100 ], latencies.back(), double( torn ) / latencies.size() );
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,435 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Impairment harness: runs a mosh server and client over loopback
+   through an emulated bottleneck link and reports how long each
+   server frame takes to reach the client.
+
+   The server repaints a full screen of randomly colored text at a
+   fixed interval, with the repaint's creation time on the top row, and
+   the client reports the distribution of latency of the repaints it
+   displays.  The link has a serialization rate and a tail-drop queue,
+   so a large queue emulates bufferbloat and a small one a shallow
+   cellular buffer. Each repaint leaves the cursor on the tagged row,
+   so with partial frames the latency is that of the cursor's rows. */
+
+#include "config.h"
+
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <string>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "user.h"
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "networktransport-impl.h"
+#include "select.h"
+#include "timestamp.h"
+#include "prng.h"
+
+using namespace Network;
+
+typedef Transport<Terminal::Complete, UserStream> ServerTransport;
+typedef Transport<UserStream, Terminal::Complete> ClientTransport;
+
+struct LinkParams {
+  double rate; /* bytes per ms, 0 for unlimited */
+  unsigned int delay; /* one-way ms */
+  size_t queue; /* bytes */
+  double loss; /* probability */
+};
+
+class Link {
+private:
+  class Datagram {
+  public:
+    uint64_t deliver_at;
+    uint64_t depart_at;
+    std::string payload;
+    Datagram( uint64_t s_deliver_at, uint64_t s_depart_at, const std::string &s_payload )
+      : deliver_at( s_deliver_at ), depart_at( s_depart_at ), payload( s_payload ) {}
+  };
+
+  LinkParams params;
+  std::deque< Datagram > queue;
+  double last_departure;
+  PRNG prng;
+
+public:
+  unsigned int dropped;
+
+  Link( const LinkParams &s_params )
+    : params( s_params ), queue(), last_departure( 0 ), prng(), dropped( 0 ) {}
+
+  void push( const std::string &payload, uint64_t now )
+  {
+    if ( params.loss > 0 && prng.uint32() < params.loss * 4294967295.0 ) {
+      dropped++;
+      return;
+    }
+
+    size_t queued = 0;
+    for ( std::deque< Datagram >::const_iterator i = queue.begin(); i != queue.end(); i++ ) {
+      if ( i->depart_at > now ) {
+	queued += i->payload.size();
+      }
+    }
+    if ( params.queue && queued + payload.size() > params.queue ) {
+      dropped++;
+      return;
+    }
+
+    double depart = now;
+    if ( params.rate > 0 ) {
+      depart = std::max( last_departure, double( now ) ) + payload.size() / params.rate;
+    }
+    last_departure = depart;
+    queue.push_back( Datagram( uint64_t( depart ) + params.delay, uint64_t( depart ), payload ) );
+  }
+
+  bool ready( uint64_t now ) const { return !queue.empty() && queue.front().deliver_at <= now; }
+  int wait_time( uint64_t now ) const
+  {
+    if ( queue.empty() ) {
+      return INT_MAX;
+    }
+    return queue.front().deliver_at > now ? queue.front().deliver_at - now : 0;
+  }
+  std::string pop( void )
+  {
+    std::string ret = queue.front().payload;
+    queue.pop_front();
+    return ret;
+  }
+};
+
+static void usage( const char *argv0 )
+{
+  fprintf( stderr, "Usage: %s [-r kbit/s] [-d one-way-delay-ms] [-q queue-bytes] [-l loss-percent]\n"
+	   "\t[-g WIDTHxHEIGHT] [-i frame-interval-ms] [-t seconds] [-P (disable pacing)] [-F (disable FEC)]\n"
+	   "\t[-S (disable compression against the acknowledged state)]\n"
+	   "\t[-C (send the cursor's rows of a repaint first)] [-v]\n", argv0 );
+  exit( 1 );
+}
+
+static int bound_socket( struct sockaddr_in &addr )
+{
+  int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+  fatal_assert( fd >= 0 );
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  fatal_assert( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 );
+  socklen_t len = sizeof( addr );
+  fatal_assert( getsockname( fd, (struct sockaddr *)&addr, &len ) == 0 );
+  return fd;
+}
+
+/* Forward datagrams between client and server through the emulated link. */
+static void run_proxy( int fd, const struct sockaddr_in &server_addr, const LinkParams &down, const LinkParams &up )
+{
+  Link downlink( down ), uplink( up );
+  struct sockaddr_in client_addr;
+  bool have_client = false;
+  Select &sel = Select::get_instance();
+
+  while ( true ) {
+    uint64_t now = frozen_timestamp();
+    sel.clear_fds();
+    sel.add_fd( fd );
+    if ( sel.select( std::min( downlink.wait_time( now ), uplink.wait_time( now ) ) ) < 0 ) {
+      perror( "select" );
+      exit( 1 );
+    }
+    now = frozen_timestamp();
+
+    if ( sel.read( fd ) ) {
+      char buf[ 65536 ];
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof( from );
+      ssize_t len = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr *)&from, &fromlen );
+      if ( len >= 0 ) {
+	if ( from.sin_port == server_addr.sin_port ) {
+	  downlink.push( std::string( buf, len ), now );
+	} else {
+	  client_addr = from;
+	  have_client = true;
+	  uplink.push( std::string( buf, len ), now );
+	}
+      }
+    }
+
+    while ( downlink.ready( now ) ) {
+      std::string p = downlink.pop();
+      if ( have_client ) {
+	sendto( fd, p.data(), p.size(), 0, (struct sockaddr *)&client_addr, sizeof( client_addr ) );
+      }
+    }
+    while ( uplink.ready( now ) ) {
+      std::string p = uplink.pop();
+      sendto( fd, p.data(), p.size(), 0, (const struct sockaddr *)&server_addr, sizeof( server_addr ) );
+    }
+  }
+}
+
+/* Repaint the whole screen, tagged with the repaint's creation time, every interval. */
+static void run_server( ServerTransport *server, Terminal::Complete &terminal, unsigned int frame_interval )
+{
+  Select &sel = Select::get_instance();
+  PRNG prng;
+  uint64_t next_frame = 0;
+  const int width = terminal.get_fb().ds.get_width();
+  const int height = terminal.get_fb().ds.get_height();
+
+  while ( true ) {
+    uint64_t now = frozen_timestamp();
+    if ( server->get_remote_state_num() && now >= next_frame ) {
+      char tag[ 64 ];
+      snprintf( tag, sizeof( tag ), "\033[H\033[0m<%llu>", (unsigned long long)now );
+      std::string frame( tag );
+      for ( int y = 0; y < height; y++ ) {
+	char move[ 32 ];
+	snprintf( move, sizeof( move ), "\033[%d;1H", y + 2 );
+	frame += move;
+	for ( int x = 0; x < width; x++ ) {
+	  if ( prng.uint8() % 8 == 0 ) {
+	    char color[ 32 ];
+	    snprintf( color, sizeof( color ), "\033[%dm", 31 + prng.uint8() % 7 );
+	    frame += color;
+	  }
+	  frame.push_back( 'a' + prng.uint8() % 26 );
+	}
+      }
+      frame += "\033[H";
+      terminal.act( frame );
+      server->set_current_state( terminal );
+      next_frame = now + frame_interval;
+    }
+
+    sel.clear_fds();
+    std::vector< int > fd_list( server->fds() );
+    sel.add_fd( fd_list.back() );
+    int timeout = server->wait_time();
+    if ( server->get_remote_state_num() ) {
+      timeout = std::min( timeout, int( next_frame > now ? next_frame - now : 0 ) );
+    }
+    if ( sel.select( timeout ) < 0 ) {
+      perror( "select" );
+      exit( 1 );
+    }
+
+    try {
+      if ( sel.read( fd_list.back() ) ) {
+	server->recv();
+      }
+      server->tick();
+    } catch ( const std::exception &e ) {
+      fprintf( stderr, "Server error: %s\n", e.what() );
+    }
+  }
+}
+
+/* Creation time of the repaint shown by the client, or 0 */
+static uint64_t frame_created( const Terminal::Complete &terminal )
+{
+  std::string top;
+  const Terminal::Framebuffer &fb = terminal.get_fb();
+  for ( int x = 0; x < fb.ds.get_width(); x++ ) {
+    fb.get_cell( 0, x )->print_grapheme( top );
+  }
+  unsigned long long created;
+  if ( sscanf( top.c_str(), "<%llu>", &created ) == 1 ) {
+    return created;
+  }
+  return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+  LinkParams down = { 0, 10, 0, 0 };
+  int width = 200, height = 60;
+  unsigned int frame_interval = 200;
+  unsigned int duration = 10;
+  bool pacing = true;
+  bool fec = true;
+  bool state_dictionary = true;
+  bool partial_frames = false;
+  unsigned int verbose = 0;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "r:d:q:l:g:i:t:PFSCv" )) != -1 ) {
+    switch ( opt ) {
+    case 'r': down.rate = atof( optarg ) / 8.0; break; /* kbit/s to bytes/ms */
+    case 'd': down.delay = atoi( optarg ); break;
+    case 'q': down.queue = atoi( optarg ); break;
+    case 'l': down.loss = atof( optarg ) / 100.0; break;
+    case 'g':
+      if ( sscanf( optarg, "%dx%d", &width, &height ) != 2 || width < 20 || height < 2 ) {
+	usage( argv[ 0 ] );
+      }
+      break;
+    case 'i': frame_interval = atoi( optarg ); break;
+    case 't': duration = atoi( optarg ); break;
+    case 'P': pacing = false; break;
+    case 'F': fec = false; break;
+    case 'S': state_dictionary = false; break;
+    case 'C': partial_frames = true; break;
+    case 'v': verbose++; break;
+    default: usage( argv[ 0 ] );
+    }
+  }
+
+  /* the uplink only carries acks, so just give it the same delay and loss */
+  LinkParams up = down;
+  up.rate = 0;
+  up.queue = 0;
+
+  UserStream blank;
+  Terminal::Complete terminal( width, height + 1 );
+  ServerTransport *server = new ServerTransport( terminal, blank, "127.0.0.1", "0" );
+  server->set_pacing( pacing );
+  server->set_fec( fec );
+  server->set_state_dictionary( state_dictionary );
+  server->set_partial_frames( partial_frames );
+  server->set_verbose( verbose );
+
+  struct sockaddr_in server_addr;
+  memset( &server_addr, 0, sizeof( server_addr ) );
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  server_addr.sin_port = htons( atoi( server->port().c_str() ) );
+  std::string key = server->get_key();
+
+  pid_t server_pid = fork();
+  fatal_assert( server_pid >= 0 );
+  if ( server_pid == 0 ) {
+    run_server( server, terminal, frame_interval );
+    _exit( 0 );
+  }
+  delete server;
+
+  struct sockaddr_in proxy_addr;
+  int proxy_fd = bound_socket( proxy_addr );
+  pid_t proxy_pid = fork();
+  fatal_assert( proxy_pid >= 0 );
+  if ( proxy_pid == 0 ) {
+    run_proxy( proxy_fd, server_addr, down, up );
+    _exit( 0 );
+  }
+  close( proxy_fd );
+
+  char proxy_port[ 16 ];
+  snprintf( proxy_port, sizeof( proxy_port ), "%d", ntohs( proxy_addr.sin_port ) );
+  Terminal::Complete remote_terminal( width, height + 1 );
+  ClientTransport client( blank, remote_terminal, key.c_str(), "127.0.0.1", proxy_port );
+  client.set_verbose( verbose );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  std::vector< uint64_t > latencies;
+  Select &sel = Select::get_instance();
+  uint64_t start = frozen_timestamp();
+  uint64_t last_created = 0;
+
+  while ( frozen_timestamp() - start < duration * 1000 ) {
+    sel.clear_fds();
+    std::vector< int > fd_list( client.fds() );
+    for ( std::vector< int >::const_iterator it = fd_list.begin(); it != fd_list.end(); it++ ) {
+      sel.add_fd( *it );
+    }
+    if ( sel.select( std::min( client.wait_time(), 100 ) ) < 0 ) {
+      perror( "select" );
+      break;
+    }
+
+    try {
+      bool network_ready_to_read = false;
+      for ( std::vector< int >::const_iterator it = fd_list.begin(); it != fd_list.end(); it++ ) {
+	if ( sel.read( *it ) ) {
+	  network_ready_to_read = true;
+	}
+      }
+      if ( network_ready_to_read ) {
+	client.recv();
+      }
+      client.tick();
+    } catch ( const std::exception &e ) {
+      fprintf( stderr, "Client error: %s\n", e.what() );
+    }
+
+    uint64_t created = frame_created( client.get_latest_remote_state().state );
+    if ( created != last_created ) {
+      last_created = created;
+      latencies.push_back( frozen_timestamp() - created );
+    }
+  }
+
+  kill( server_pid, SIGKILL );
+  kill( proxy_pid, SIGKILL );
+  waitpid( server_pid, NULL, 0 );
+  waitpid( proxy_pid, NULL, 0 );
+
+  if ( latencies.empty() ) {
+    printf( "no frames delivered\n" );
+    return 1;
+  }
+
+  std::sort( latencies.begin(), latencies.end() );
+  double total = 0;
+  for ( size_t i = 0; i < latencies.size(); i++ ) {
+    total += latencies[ i ];
+  }
+  printf( "pacing %s, FEC %s, partial frames %s: %d frames, latency mean %.0f ms, median %d ms, p95 %d ms, max %d ms\n",
+	  pacing ? "on" : "off", fec ? "on" : "off", partial_frames ? "on" : "off", int( latencies.size() ), total / latencies.size(),
+	  int( latencies[ latencies.size() / 2 ] ),
+	  int( latencies[ latencies.size() * 95 / 100 ] ),
+	  int( latencies.back() ) );
+  printf( "client RTT: smoothed %.1f ms, network %.1f ms, min %.1f ms, host delay %.2f ms\n",
+	  client.get_SRTT(), client.get_network_SRTT(), client.get_min_RTT(), client.get_host_delay() );
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Datagram throughput benchmark: a client Connection sends fixed-size
+   datagrams to a server Connection over loopback, in batches of a
+   given size, and reports how many datagrams per second made it
+   through encryption, the socket, and decryption. A batch size of 1
+   is the one-datagram-per-syscall path. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+
+#include "network.h"
+#include "crypto.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static void usage( const char *argv0 )
+{
+  fprintf( stderr, "Usage: %s [-b batch] [-s datagram-bytes] [-t seconds]\n", argv0 );
+  exit( 1 );
+}
+
+int main( int argc, char *argv[] )
+{
+  unsigned int batch_size = 16;
+  unsigned int payload_size = 1000;
+  unsigned int duration = 5;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "b:s:t:" )) != -1 ) {
+    switch ( opt ) {
+    case 'b': batch_size = atoi( optarg ); break;
+    case 's': payload_size = atoi( optarg ); break;
+    case 't': duration = atoi( optarg ); break;
+    default: usage( argv[ 0 ] );
+    }
+  }
+  if ( batch_size < 1 || payload_size > 1200 ) {
+    usage( argv[ 0 ] );
+  }
+
+  try {
+    Connection server( "127.0.0.1", "0" );
+    Connection client( server.get_key().c_str(), "127.0.0.1", server.port().c_str() );
+
+    const std::string payload( payload_size, 'x' );
+    std::vector<Datagram> datagrams( batch_size, Datagram( std::string(), payload ) );
+
+    uint64_t start = timestamp();
+    uint64_t end = start + duration * 1000;
+    uint64_t sent = 0, received = 0;
+
+    while ( true ) {
+      freeze_timestamp();
+      if ( timestamp() >= end ) {
+	break;
+      }
+
+      client.send( datagrams );
+      sent += batch_size;
+
+      /* drain what arrived; loopback may still drop on a full buffer */
+      uint64_t outstanding = batch_size;
+      while ( outstanding ) {
+	struct pollfd pfd;
+	pfd.fd = server.fds().back();
+	pfd.events = POLLIN;
+	if ( poll( &pfd, 1, 100 ) <= 0 ) {
+	  break;
+	}
+	size_t n = server.recv().size();
+	received += n;
+	outstanding -= std::min( outstanding, uint64_t( n ) );
+      }
+    }
+
+    freeze_timestamp();
+    double seconds = ( timestamp() - start ) / 1000.0;
+    printf( "batch %u, %u-byte datagrams: %.0f sent/s, %.0f received/s (%.2f%% lost)\n",
+	    batch_size, payload_size, sent / seconds, received / seconds,
+	    sent ? 100.0 * ( sent - received ) / sent : 0.0 );
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,260 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Wire overhead benchmark: a client transport sends one keystroke at
+   a time, through a relay that counts the bytes, to a server transport
+   over loopback, which answers each by setting its terminal's title to
+   the count so far. What the client sends before the answer arrives is
+   the keystroke, and after, its ack. Sizes are of UDP payloads, after
+   a few keystrokes to let the ends learn about each other. With -f the
+   transports keep to the full headers, and with -c they send no chaff. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <string>
+
+#include "user.h"
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "networktransport-impl.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+typedef Transport<Terminal::Complete, UserStream> ServerTransport;
+typedef Transport<UserStream, Terminal::Complete> ClientTransport;
+
+static const unsigned int WARMUP = 10; /* keystrokes before counting */
+
+static void usage( const char *argv0 )
+{
+  fprintf( stderr, "Usage: %s [-f] [-c] [-n keystrokes] [-g gap-ms]\n", argv0 );
+  exit( 1 );
+}
+
+static size_t title_count( const Terminal::Complete &terminal )
+{
+  const Terminal::Framebuffer::title_type &title = terminal.get_fb().get_window_title();
+  return strtoul( std::string( title.begin(), title.end() ).c_str(), NULL, 10 );
+}
+
+static void add_fds( std::vector<struct pollfd> &pollfds, const std::vector<int> &fds )
+{
+  for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    struct pollfd pfd;
+    pfd.fd = *i;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pollfds.push_back( pfd );
+  }
+}
+
+/* datagrams and bytes of one kind */
+class Tally {
+public:
+  uint64_t datagrams, bytes;
+
+  Tally() : datagrams( 0 ), bytes( 0 ) {}
+
+  void add( size_t len ) { datagrams++; bytes += len; }
+  double mean( void ) const { return datagrams ? double( bytes ) / datagrams : 0; }
+};
+
+int main( int argc, char *argv[] )
+{
+  bool compact_header = true;
+  bool chaff = true;
+  unsigned int keystrokes = 100;
+  unsigned int gap = 300;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "fcn:g:" )) != -1 ) {
+    switch ( opt ) {
+    case 'f': compact_header = false; break;
+    case 'c': chaff = false; break;
+    case 'n': keystrokes = atoi( optarg ); break;
+    case 'g': gap = atoi( optarg ); break;
+    default: usage( argv[ 0 ] );
+    }
+  }
+  if ( keystrokes < 1 ) {
+    usage( argv[ 0 ] );
+  }
+
+  try {
+    Terminal::Complete terminal( 80, 24 );
+    UserStream blank;
+    ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+
+    /* the relay, which the client takes for the server */
+    int relay = socket( AF_INET, SOCK_DGRAM, 0 );
+    struct sockaddr_in relay_addr, server_addr, client_addr;
+    memset( &relay_addr, 0, sizeof( relay_addr ) );
+    relay_addr.sin_family = AF_INET;
+    relay_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t relay_len = sizeof( relay_addr );
+    if ( relay < 0 || bind( relay, (struct sockaddr *)&relay_addr, sizeof( relay_addr ) ) < 0
+	 || getsockname( relay, (struct sockaddr *)&relay_addr, &relay_len ) < 0 ) {
+      perror( "relay" );
+      return 1;
+    }
+    server_addr = relay_addr;
+    server_addr.sin_port = htons( atoi( server.port().c_str() ) );
+    memset( &client_addr, 0, sizeof( client_addr ) );
+    char relay_port[ 16 ];
+    snprintf( relay_port, sizeof( relay_port ), "%d", ntohs( relay_addr.sin_port ) );
+
+    ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay_port );
+    client.set_send_delay( 1 ); /* as mosh-client does */
+    client.set_interactive( true );
+    server.set_interactive( true );
+    client.set_compact_header( compact_header );
+    server.set_compact_header( compact_header );
+    client.set_chaff( chaff );
+    server.set_chaff( chaff );
+
+    freeze_timestamp();
+    uint64_t next_keystroke = timestamp() + 500; /* let the handshake settle */
+    size_t typed = 0, heard = 0, echoed = 0;
+    Tally keystroke_tally, ack_tally, echo_tally;
+
+    while ( echoed < keystrokes + WARMUP ) {
+      /* the client types */
+      if ( timestamp() >= next_keystroke && typed == echoed ) {
+	client.get_current_state().push_back( Parser::UserByte( 'a' + typed % 26 ) );
+	typed++;
+      }
+
+      /* the server's pty echoes what arrived */
+      if ( server.get_latest_remote_state().state.size() > heard ) {
+	heard = server.get_latest_remote_state().state.size();
+	char output[ 32 ];
+	snprintf( output, sizeof( output ), "\033]0;%u\007", unsigned( heard ) );
+	terminal.act( output );
+	server.set_current_state( terminal );
+      }
+
+      /* and sees it come back */
+      if ( title_count( client.get_latest_remote_state().state ) >= typed && typed > echoed ) {
+	echoed++;
+	next_keystroke = timestamp() + gap;
+      }
+
+      client.tick();
+      server.tick();
+
+      int wait = std::min( client.wait_time(), server.wait_time() );
+      if ( typed == echoed ) {
+	wait = std::min( wait, int( std::max( next_keystroke, timestamp() ) - timestamp() ) );
+      }
+
+      std::vector<struct pollfd> pollfds;
+      add_fds( pollfds, server.fds() );
+      const size_t server_fds = pollfds.size();
+      add_fds( pollfds, client.fds() );
+      const size_t client_fds = pollfds.size();
+      add_fds( pollfds, std::vector<int>( 1, relay ) );
+
+      if ( poll( &pollfds[ 0 ], pollfds.size(), wait ) < 0 ) {
+	perror( "poll" );
+	return 1;
+      }
+      freeze_timestamp();
+
+      bool server_ready = false, client_ready = false;
+      for ( size_t i = 0; i < client_fds; i++ ) {
+	if ( pollfds[ i ].revents & POLLIN ) {
+	  if ( i < server_fds ) {
+	    server_ready = true;
+	  } else {
+	    client_ready = true;
+	  }
+	}
+      }
+
+      if ( pollfds.back().revents & POLLIN ) {
+	char buf[ 65536 ];
+	struct sockaddr_in from;
+	socklen_t from_len = sizeof( from );
+	ssize_t len = recvfrom( relay, buf, sizeof( buf ), 0, (struct sockaddr *)&from, &from_len );
+	if ( len < 0 ) {
+	  perror( "recvfrom" );
+	  return 1;
+	}
+
+	const bool counting = echoed >= WARMUP;
+	if ( from.sin_port == server_addr.sin_port ) {
+	  if ( counting ) {
+	    echo_tally.add( len );
+	  }
+	  sendto( relay, buf, len, 0, (struct sockaddr *)&client_addr, sizeof( client_addr ) );
+	} else {
+	  client_addr = from;
+	  if ( counting ) {
+	    ( typed > echoed ? keystroke_tally : ack_tally ).add( len );
+	  }
+	  sendto( relay, buf, len, 0, (struct sockaddr *)&server_addr, sizeof( server_addr ) );
+	}
+      }
+
+      if ( server_ready ) {
+	server.recv();
+      }
+      if ( client_ready ) {
+	client.recv();
+      }
+    }
+
+    printf( "%s headers, %s: %u keystrokes %u ms apart: "
+	    "keystroke %.1f bytes, echo %.1f bytes, ack %.1f bytes; %.1f bytes per keystroke in all\n",
+	    compact_header ? "compact" : "full", chaff ? "chaff" : "no chaff", keystrokes, gap,
+	    keystroke_tally.mean(), echo_tally.mean(), ack_tally.mean(),
+	    double( keystroke_tally.bytes + ack_tally.bytes + echo_tally.bytes ) / keystrokes );
+
+    close( relay );
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
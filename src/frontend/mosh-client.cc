@@ -81,7 +81,7 @@ static void print_usage( FILE *file, const char *argv0 )
 {
   print_version( file );
   fprintf( file, "\n" );
-  fprintf( file, "Usage: %s [-# 'ARGS'] IP PORT\n       %s -c\n", argv0, argv0 );
+  fprintf( file, "Usage: %s [-# 'ARGS'] IP[,IP...] PORT\n       %s -c\n", argv0, argv0 );
 }
 
 static void print_colorcount( void )
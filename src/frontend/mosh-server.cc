@@ -91,6 +91,7 @@
 #endif
 
 #include "networktransport-impl.h"
+#include "outputburst.h"
 
 typedef Network::Transport< Terminal::Complete, Network::UserStream > ServerConnection;
 
@@ -395,6 +396,29 @@ static int run_server( const char *desired_ip, const char *desired_port,
       network_signaled_timeout = 0;
     }
   }
+  /* get budget for the screen states kept for the client */
+  long state_budget = 0;
+  char *budget_envar = getenv( "MOSH_SERVER_STATE_BUDGET" );
+  if ( budget_envar && *budget_envar ) {
+    errno = 0;
+    char *endptr;
+    state_budget = strtol( budget_envar, &endptr, 10 );
+    if ( *endptr != '\0' || ( state_budget == 0 && errno == EINVAL ) ) {
+      fprintf( stderr, "MOSH_SERVER_STATE_BUDGET not a valid integer, ignoring\n" );
+      state_budget = 0;
+    } else if ( state_budget <= 0 ) {
+      fprintf( stderr, "MOSH_SERVER_STATE_BUDGET is not positive, ignoring\n" );
+      state_budget = 0;
+    }
+  }
+  /* get DSCPs to mark interactive and bulk traffic with */
+  int interactive_dscp = -1, bulk_dscp = -1;
+  char *dscp_envar = getenv( "MOSH_DSCP" );
+  if ( dscp_envar && *dscp_envar
+       && !Network::Connection::parse_traffic_classes( dscp_envar, interactive_dscp, bulk_dscp ) ) {
+    fprintf( stderr, "MOSH_DSCP not valid, ignoring\n" );
+    interactive_dscp = bulk_dscp = -1;
+  }
   /* get initial window size */
   struct winsize window_size;
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ||
@@ -415,6 +439,15 @@ static int run_server( const char *desired_ip, const char *desired_port,
   ServerConnection *network = new ServerConnection( terminal, blank, desired_ip, desired_port );
 
   network->set_verbose( verbose );
+  network->set_interactive( true ); /* echo a lone keystroke as soon as the pty is quiet */
+  network->set_partial_frames( true ); /* on a slow link, the cursor's rows before the rest */
+  if ( state_budget ) {
+    network->set_state_budget( state_budget * 1024 );
+  }
+  if ( interactive_dscp >= 0 ) {
+    network->set_traffic_class( Network::TRAFFIC_INTERACTIVE, interactive_dscp );
+    network->set_traffic_class( Network::TRAFFIC_BULK, bulk_dscp );
+  }
   Select::set_verbose( verbose );
 
   /*
@@ -650,6 +683,9 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 
   bool child_released = false;
 
+  /* when the application has probably finished drawing */
+  Network::OutputBurst output_burst;
+
   while ( 1 ) {
     try {
       static const uint64_t timeout_if_no_client = 60000;
@@ -662,12 +698,15 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	   || network.shutdown_in_progress() ) {
         timeout = min( timeout, 5000 );
       }
+      /* an idle client's heartbeats are stretched, so allow for them */
+      const uint64_t keepalive = network.get_keepalive_interval();
+
       /*
        * The server goes completely asleep if it has no remote peer.
        * We may want to wake up sooner.
        */
       if ( network_timeout_ms ) {
-	int64_t network_sleep = network_timeout_ms -
+	int64_t network_sleep = network_timeout_ms + keepalive -
 	  ( now - network.get_latest_remote_state().timestamp );
 	if ( network_sleep < 0 ) {
 	  network_sleep = 0;
@@ -799,6 +838,8 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	  terminal_to_host += terminal.act( string( buf, bytes_read ) );
 	
 	  /* update client with new state of terminal */
+	  output_burst.read( timestamp_us(), bytes_read, buf_size );
+	  network.set_output_cadence( output_burst.still_writing(), output_burst.quiet() );
 	  network.set_current_state( terminal );
 	}
       }
@@ -810,13 +851,13 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 
       bool idle_shutdown = false;
       if ( network_timeout_ms &&
-	   network_timeout_ms <= time_since_remote_state ) {
+	   network_timeout_ms + keepalive <= time_since_remote_state ) {
 	idle_shutdown = true;
 	fprintf( stderr, "Network idle for %llu seconds.\n", 
 		 static_cast<unsigned long long>( time_since_remote_state / 1000 ) );
       }
       if ( sel.signal( SIGUSR1 ) ) {
-	if ( !network_signaled_timeout_ms || network_signaled_timeout_ms <= time_since_remote_state ) {
+	if ( !network_signaled_timeout_ms || network_signaled_timeout_ms + keepalive <= time_since_remote_state ) {
 	  idle_shutdown = true;
 	  fprintf( stderr, "Network idle for %llu seconds when SIGUSR1 received\n",
 		   static_cast<unsigned long long>( time_since_remote_state / 1000 ) );
@@ -850,7 +891,7 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
       #ifdef HAVE_UTEMPTER
       /* update utmp if has been more than 30 seconds since heard from client */
       if ( connected_utmp ) {
-	if ( time_since_remote_state > 30000 ) {
+	if ( time_since_remote_state > 30000 + keepalive ) {
 	  utempter_remove_record( host_fd );
 
 	  char tmp[ 64 ];
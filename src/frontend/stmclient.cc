@@ -248,10 +248,58 @@ void STMClient::main_init( void )
   /* open network */
   Network::UserStream blank;
   Terminal::Complete local_terminal( window_size.ws_col, window_size.ws_row );
+  /* the server may have several addresses; the first leads, and the
+     rest are raced against it until one of them answers */
+  const char *separators = " ,";
+  std::vector< string > server_ips;
+  string::size_type ip_start = ip.find_first_not_of( separators );
+  while ( ip_start != string::npos ) {
+    string::size_type ip_end = ip.find_first_of( separators, ip_start );
+    server_ips.push_back( ip.substr( ip_start, ip_end == string::npos ? string::npos : ip_end - ip_start ) );
+    ip_start = ip.find_first_not_of( separators, ip_end );
+  }
+  if ( server_ips.empty() ) {
+    server_ips.push_back( ip );
+  }
+
   network = new Network::Transport< Network::UserStream, Terminal::Complete >( blank, local_terminal,
-									       key.c_str(), ip.c_str(), port.c_str() );
+									       key.c_str(), server_ips.front().c_str(), port.c_str() );
+  for ( size_t i = 1; i < server_ips.size(); i++ ) {
+    network->add_candidate( server_ips[ i ].c_str(), port.c_str() );
+  }
 
   network->set_send_delay( 1 ); /* minimal delay on outgoing keystrokes */
+  network->set_interactive( true ); /* and none for a lone one */
+  network->set_keepalive_probing( true ); /* stretch heartbeats while idle, as far as our NAT allows */
+
+  /* reach the server from other local addresses too */
+  const char *multipath_env = getenv( "MOSH_MULTIPATH" );
+  if ( multipath_env != NULL ) {
+    const string addresses( multipath_env );
+    string::size_type start = addresses.find_first_not_of( separators );
+    while ( start != string::npos ) {
+      string::size_type end = addresses.find_first_of( separators, start );
+      const string local_ip = addresses.substr( start, end == string::npos ? string::npos : end - start );
+      try {
+	network->add_path( local_ip.c_str() );
+      } catch ( const Network::NetworkException &e ) {
+	fprintf( stderr, "MOSH_MULTIPATH: %s: %s\n", local_ip.c_str(), e.what() );
+      }
+      start = addresses.find_first_not_of( separators, end );
+    }
+  }
+
+  /* how to mark our traffic for the network's quality of service */
+  const char *dscp_env = getenv( "MOSH_DSCP" );
+  if ( dscp_env != NULL && *dscp_env ) {
+    int interactive_dscp, bulk_dscp;
+    if ( Network::Connection::parse_traffic_classes( dscp_env, interactive_dscp, bulk_dscp ) ) {
+      network->set_traffic_class( Network::TRAFFIC_INTERACTIVE, interactive_dscp );
+      network->set_traffic_class( Network::TRAFFIC_BULK, bulk_dscp );
+    } else {
+      fprintf( stderr, "MOSH_DSCP not valid, ignoring\n" );
+    }
+  }
 
   /* tell server the size of the terminal */
   network->get_current_state().push_back( Parser::Resize( window_size.ws_col, window_size.ws_row ) );
@@ -445,6 +493,9 @@ bool STMClient::main( void )
 	sel.add_fd( *it );
       }
       sel.add_fd( STDIN_FILENO );
+      if ( network_monitor.fd() >= 0 ) {
+	sel.add_fd( network_monitor.fd() );
+      }
 
       int active_fds = sel.select( wait_time );
       if ( active_fds < 0 ) {
@@ -452,6 +503,12 @@ bool STMClient::main( void )
 	break;
       }
 
+      if ( network_monitor.fd() >= 0 && sel.read( network_monitor.fd() )
+	   && network_monitor.changed() ) {
+	/* don't wait for the silence to tell us */
+	network->local_network_changed();
+      }
+
       bool network_ready_to_read = false;
 
       for ( std::vector< int >::const_iterator it = fd_list.begin();
@@ -538,6 +595,7 @@ bool STMClient::main( void )
       }
 
       network->tick();
+      overlays.get_notification_engine().set_keepalive_interval( network->get_keepalive_interval() );
 
       string & send_error = network->get_send_error();
       if ( !send_error.empty() ) {
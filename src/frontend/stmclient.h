@@ -39,6 +39,7 @@
 
 #include "completeterminal.h"
 #include "networktransport.h"
+#include "netmonitor.h"
 #include "user.h"
 #include "terminaloverlay.h"
 
@@ -61,6 +62,7 @@ private:
   Terminal::Framebuffer local_framebuffer, new_state;
   Overlay::OverlayManager overlays;
   Network::Transport< Network::UserStream, Terminal::Complete > *network;
+  Network::NetworkMonitor network_monitor; /* for a handover to another network */
   Terminal::Display display;
 
   std::wstring connecting_notification;
@@ -95,6 +97,7 @@ public:
       new_state( 1, 1 ),
       overlays(),
       network( NULL ),
+      network_monitor(),
       display( true ), /* use TERM environment var to initialize display */
       connecting_notification(),
       repaint_requested( false ),
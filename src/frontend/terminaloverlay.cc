@@ -166,6 +166,7 @@ void ConditionalCursorMove::apply( Framebuffer &fb, uint64_t confirmed_epoch ) c
 NotificationEngine::NotificationEngine()
   : last_word_from_server( timestamp() ),
     last_acked_state( timestamp() ),
+    keepalive_interval( 0 ),
     escape_key_string(),
     message(),
     message_is_network_error( false ),
@@ -144,14 +144,15 @@ namespace Overlay {
   private:
     uint64_t last_word_from_server;
     uint64_t last_acked_state;
+    uint64_t keepalive_interval; /* how far apart the server's heartbeats are stretched while idle */
     string escape_key_string;
     wstring message;
     bool message_is_network_error;
     uint64_t message_expiration;
     bool show_quit_keystroke;
 
-    bool server_late( uint64_t ts ) const { return (ts - last_word_from_server) > 6500; }
-    bool reply_late( uint64_t ts ) const { return (ts - last_acked_state) > 10000; }
+    bool server_late( uint64_t ts ) const { return (ts - last_word_from_server) > 6500 + keepalive_interval; }
+    bool reply_late( uint64_t ts ) const { return (ts - last_acked_state) > 10000 + 2 * keepalive_interval; }
     bool need_countup( uint64_t ts ) const { return server_late( ts ) || reply_late( ts ); }
 
   public:
@@ -160,6 +161,7 @@ namespace Overlay {
     const wstring &get_notification_string( void ) const { return message; }
     void server_heard( uint64_t s_last_word ) { last_word_from_server = s_last_word; }
     void server_acked( uint64_t s_last_acked ) { last_acked_state = s_last_acked; }
+    void set_keepalive_interval( uint64_t s_interval ) { keepalive_interval = s_interval; }
     int wait_time( void ) const;
 
     void set_notification_string( const wstring &s_message, bool permanent = false, bool s_show_quit_keystroke = true )
@@ -30,33 +30,585 @@
     also delete it here.
 */
 
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
 #include <zlib.h>
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
 
+#include "byteorder.h"
 #include "compressor.h"
 #include "dos_assert.h"
+#include "fatal_assert.h"
 
 using namespace Network;
 using namespace std;
 
-string Compressor::compress_str( const string &input )
+/* Preset dictionary for the tagged codecs, built from what
+   Terminal::Display writes into a diff: cursor moves, SGR renditions,
+   erases, mode switches, line-drawing characters and runs of blanks.
+   The compressors favor the end, so the commonest strings go last.
+
+   Both ends must hold the same bytes. Changing it changes the
+   protocol; give the result a new codec number instead. */
+static const char dictionary[] =
+  "\033]0;\007\033]2;\007\033[?1h\033[?1l\033[?5h\033[?5l\033[r\033[?1004h\033[?1004l"
+  "\033[?1000h\033[?1002h\033[?1003h\033[?1006h\033[?1000l\033[?1002l\033[?1003l\033[?1006l"
+  "\033[?2004h\033[?2004l\033[0m\033[H\033[2J\033[J"
+  "\xe2\x95\x94\xe2\x95\x90\xe2\x95\x90\xe2\x95\x97\xe2\x95\x91\xe2\x95\x9a\xe2\x95\x90\xe2\x95\x9d"
+  "\xe2\x94\x8c\xe2\x94\x80\xe2\x94\x80\xe2\x94\x90\xe2\x94\x82\xe2\x94\x94\xe2\x94\x80\xe2\x94\x98"
+  "\xe2\x94\x9c\xe2\x94\x80\xe2\x94\xa4\xe2\x94\xac\xe2\x94\x80\xe2\x94\xb4\xe2\x94\xbc\xe2\x94\x80"
+  "\xe2\x96\x88\xe2\x96\x88\xe2\x96\x91\xe2\x96\x92\xe2\x96\x93\xe2\x96\x80\xe2\x96\x84"
+  "\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80"
+  "\033[38;5;231m\033[48;5;16m\033[38;5;244m\033[48;5;236m\033[38;5;208m\033[48;5;234m"
+  "\033[0;1;37;44m\033[0;30;47m\033[0;37;40m\033[0;1;33m\033[0;1;34m\033[0;1;36m\033[0;1;32m\033[0;1;31m"
+  "\033[0;4m\033[0;1;7m\033[0;36m\033[0;35m\033[0;34m\033[0;33m\033[0;32m\033[0;31m\033[0;7m\033[0;1m"
+  "\033[10;1H\033[11;1H\033[12;1H\033[13;1H\033[14;1H\033[15;1H\033[16;1H\033[17;1H\033[18;1H"
+  "\033[19;1H\033[20;1H\033[21;1H\033[22;1H\033[23;1H\033[24;1H\033[1;1H\033[2;1H\033[3;1H"
+  "\033[4;1H\033[5;1H\033[6;1H\033[7;1H\033[8;1H\033[9;1H\r\n\r\n\033[1X\033[2X\033[3X\033[4X"
+  "                                                                "
+  "\033[?25l\033[?25h\033[K\033[0m\033[0m ";
+static const size_t dictionary_len = sizeof( dictionary ) - 1;
+
+/* CODEC_STATE: the tag, then the state number */
+static const size_t STATE_HEADER_LEN = 1 + sizeof( uint64_t );
+
+Compressor::Compressor()
+  : buffer( NULL ), deflater(), deflater_level( default_level( CODEC_DEFLATE ) ), inflater(),
+    state_deflater(), state_inflater(),
+    zstd_compressor( NULL ), zstd_decompressor( NULL ), zstd_dictionary( NULL )
 {
-  long unsigned int len = BUFFER_SIZE;
-  dos_assert( Z_OK == compress( buffer, &len,
-				reinterpret_cast<const unsigned char *>( input.data() ),
-				input.size() ) );
-  return string( reinterpret_cast<char *>( buffer ), len );
+  buffer = new unsigned char[ BUFFER_SIZE ];
+
+  /* raw streams: the codec tag stands in for the zlib header */
+  fatal_assert( Z_OK == deflateInit2( &deflater, deflater_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) );
+  fatal_assert( Z_OK == inflateInit2( &inflater, -15 ) );
+
+  /* zlib streams, whose header names the dictionary by checksum */
+  fatal_assert( Z_OK == deflateInit( &state_deflater, default_level( CODEC_STATE ) ) );
+  fatal_assert( Z_OK == inflateInit( &state_inflater ) );
+
+#if HAVE_ZSTD
+  zstd_compressor = ZSTD_createCCtx();
+  zstd_decompressor = ZSTD_createDCtx();
+  zstd_dictionary = ZSTD_createDDict( dictionary, dictionary_len );
+  fatal_assert( zstd_compressor && zstd_decompressor && zstd_dictionary );
+#endif
+}
+
+Compressor::~Compressor()
+{
+#if HAVE_ZSTD
+  ZSTD_freeDDict( zstd_dictionary );
+  ZSTD_freeDCtx( zstd_decompressor );
+  ZSTD_freeCCtx( zstd_compressor );
+#endif
+  inflateEnd( &state_inflater );
+  deflateEnd( &state_deflater );
+  inflateEnd( &inflater );
+  deflateEnd( &deflater );
+  delete[] buffer;
+}
+
+unsigned int Compressor::supported_codecs( void )
+{
+  unsigned int codecs = ( 1 << CODEC_NONE ) | ( 1 << CODEC_DEFLATE ) | ( 1 << CODEC_STATE );
+#if HAVE_ZSTD
+  codecs |= 1 << CODEC_ZSTD;
+#endif
+  return codecs;
+}
+
+int Compressor::default_level( Codec codec )
+{
+  switch ( codec ) {
+  case CODEC_ZLIB:
+  case CODEC_DEFLATE:
+  case CODEC_STATE: return 6;
+  case CODEC_ZSTD: return 3;
+  default: return 0;
+  }
+}
+
+int Compressor::max_level( Codec codec )
+{
+  switch ( codec ) {
+  case CODEC_ZLIB:
+  case CODEC_DEFLATE:
+  case CODEC_STATE: return 9;
+  case CODEC_ZSTD: return 19;
+  default: return 0;
+  }
+}
+
+string Compressor::compress_str( const string &input, Codec codec, int level )
+{
+  size_t len;
+  const char *output = compress( input, &len, codec, level );
+  return string( output, len );
+}
+
+size_t Compressor::compress_deflate( const string &input, int level, unsigned char *output, size_t output_len )
+{
+  fatal_assert( Z_OK == deflateReset( &deflater ) );
+  if ( level != deflater_level ) {
+    fatal_assert( Z_OK == deflateParams( &deflater, level, Z_DEFAULT_STRATEGY ) );
+    deflater_level = level;
+  }
+  fatal_assert( Z_OK == deflateSetDictionary( &deflater, reinterpret_cast<const Bytef *>( dictionary ),
+					       dictionary_len ) );
+
+  deflater.next_in = reinterpret_cast<Bytef *>( const_cast<char *>( input.data() ) );
+  deflater.avail_in = input.size();
+  deflater.next_out = output;
+  deflater.avail_out = output_len;
+  if ( deflate( &deflater, Z_FINISH ) != Z_STREAM_END ) {
+    return 0; /* didn't fit; store instead */
+  }
+  return deflater.total_out;
+}
+
+const char *Compressor::compress( const string &input, size_t *len, Codec codec, int level )
+{
+  if ( codec == CODEC_ZLIB ) {
+    long unsigned int output_len = BUFFER_SIZE;
+    dos_assert( Z_OK == ::compress2( buffer, &output_len,
+				     reinterpret_cast<const unsigned char *>( input.data() ),
+				     input.size(), level ) );
+    *len = output_len;
+    return reinterpret_cast<char *>( buffer );
+  }
+
+  assert( codec != CODEC_STATE && ( supported_codecs() & ( 1 << codec ) ) );
+  fatal_assert( input.size() < size_t( BUFFER_SIZE ) );
+
+  unsigned char *output = buffer + 1;
+  size_t capacity = BUFFER_SIZE - 1;
+  size_t output_len = 0;
+
+  /* keystroke acks and the like only grow under compression */
+  if ( input.size() >= MIN_COMPRESS_SIZE ) {
+    switch ( codec ) {
+    case CODEC_DEFLATE:
+      output_len = compress_deflate( input, level, output, capacity );
+      break;
+#if HAVE_ZSTD
+    case CODEC_ZSTD: {
+      size_t ret = ZSTD_compress_usingDict( zstd_compressor, output, capacity,
+					    input.data(), input.size(),
+					    dictionary, dictionary_len, level );
+      output_len = ZSTD_isError( ret ) ? 0 : ret;
+      break;
+    }
+#endif
+    default:
+      break;
+    }
+  }
+
+  if ( output_len == 0 || output_len >= input.size() ) {
+    codec = CODEC_NONE;
+    memcpy( output, input.data(), input.size() );
+    output_len = input.size();
+  }
+
+  buffer[ 0 ] = codec;
+  *len = output_len + 1;
+  return reinterpret_cast<char *>( buffer );
+}
+
+/* The state's rendering goes after the preset dictionary, nearer the
+   data, so what is new to the screen still finds the common sequences. */
+string Compressor::state_dictionary( const string &rendering )
+{
+  string primed( dictionary, dictionary_len );
+  primed += rendering;
+  return primed;
+}
+
+const char *Compressor::compress_with_state( const string &input, size_t *len,
+					     uint64_t reference_num, const string &dictionary )
+{
+  fatal_assert( input.size() < size_t( BUFFER_SIZE ) - STATE_HEADER_LEN );
+
+  buffer[ 0 ] = CODEC_STATE;
+  uint64_t net_num = htobe64( reference_num );
+  memcpy( buffer + 1, &net_num, sizeof( net_num ) );
+
+  const string primed = state_dictionary( dictionary );
+  fatal_assert( Z_OK == deflateReset( &state_deflater ) );
+  fatal_assert( Z_OK == deflateSetDictionary( &state_deflater, reinterpret_cast<const Bytef *>( primed.data() ),
+					       primed.size() ) );
+  state_deflater.next_in = reinterpret_cast<Bytef *>( const_cast<char *>( input.data() ) );
+  state_deflater.avail_in = input.size();
+  state_deflater.next_out = buffer + STATE_HEADER_LEN;
+  state_deflater.avail_out = BUFFER_SIZE - STATE_HEADER_LEN;
+  fatal_assert( deflate( &state_deflater, Z_FINISH ) == Z_STREAM_END );
+
+  *len = STATE_HEADER_LEN + state_deflater.total_out;
+  return reinterpret_cast<char *>( buffer );
+}
+
+uint64_t Compressor::reference_state( const string &input )
+{
+  if ( input.size() < STATE_HEADER_LEN || (unsigned char)input[ 0 ] != CODEC_STATE ) {
+    return uint64_t( -1 );
+  }
+
+  uint64_t net_num;
+  memcpy( &net_num, input.data() + 1, sizeof( net_num ) );
+  return be64toh( net_num );
+}
+
+bool Compressor::dictionary_matches( const string &input, const string &dictionary )
+{
+  /* zlib header: CMF, FLG with FDICT set, then the dictionary's Adler-32 */
+  const size_t dictid_offset = STATE_HEADER_LEN + 2;
+  if ( input.size() < dictid_offset + 4
+       || !( input[ STATE_HEADER_LEN + 1 ] & 0x20 ) ) {
+    return false;
+  }
+
+  const unsigned char *dictid = reinterpret_cast<const unsigned char *>( input.data() ) + dictid_offset;
+  uLong expected = ( uLong( dictid[ 0 ] ) << 24 ) | ( uLong( dictid[ 1 ] ) << 16 )
+    | ( uLong( dictid[ 2 ] ) << 8 ) | uLong( dictid[ 3 ] );
+  const string primed = state_dictionary( dictionary );
+  return expected == adler32( adler32( 0, NULL, 0 ),
+			      reinterpret_cast<const Bytef *>( primed.data() ), primed.size() );
+}
+
+size_t Compressor::uncompress_deflate( const unsigned char *input, size_t input_len )
+{
+  fatal_assert( Z_OK == inflateReset( &inflater ) );
+  fatal_assert( Z_OK == inflateSetDictionary( &inflater, reinterpret_cast<const Bytef *>( dictionary ),
+					       dictionary_len ) );
+
+  inflater.next_in = const_cast<Bytef *>( input );
+  inflater.avail_in = input_len;
+  inflater.next_out = buffer;
+  inflater.avail_out = BUFFER_SIZE;
+  dos_assert( inflate( &inflater, Z_FINISH ) == Z_STREAM_END );
+  return inflater.total_out;
+}
+
+size_t Compressor::uncompress_state( const unsigned char *input, size_t input_len, const string &dictionary )
+{
+  fatal_assert( Z_OK == inflateReset( &state_inflater ) );
+
+  state_inflater.next_in = const_cast<Bytef *>( input );
+  state_inflater.avail_in = input_len;
+  state_inflater.next_out = buffer;
+  state_inflater.avail_out = BUFFER_SIZE;
+  const string primed = state_dictionary( dictionary );
+  dos_assert( inflate( &state_inflater, Z_FINISH ) == Z_NEED_DICT );
+  dos_assert( Z_OK == inflateSetDictionary( &state_inflater, reinterpret_cast<const Bytef *>( primed.data() ),
+					    primed.size() ) );
+  dos_assert( inflate( &state_inflater, Z_FINISH ) == Z_STREAM_END );
+  return state_inflater.total_out;
 }
 
-string Compressor::uncompress_str( const string &input )
+string Compressor::uncompress_str( const string &input, const string &dictionary )
 {
-  long unsigned int len = BUFFER_SIZE;
-  dos_assert( Z_OK == uncompress( buffer, &len,
-				  reinterpret_cast<const unsigned char *>( input.data() ),
-				  input.size() ) );
+  dos_assert( !input.empty() );
+  const unsigned char *data = reinterpret_cast<const unsigned char *>( input.data() );
+
+  if ( ( data[ 0 ] & 0x0f ) == CODEC_ZLIB ) {
+    long unsigned int len = BUFFER_SIZE;
+    dos_assert( Z_OK == uncompress( buffer, &len, data, input.size() ) );
+    return string( reinterpret_cast<char *>( buffer ), len );
+  }
+
+  const unsigned char *payload = data + 1;
+  const size_t payload_len = input.size() - 1;
+  size_t len = 0;
+
+  dos_assert( data[ 0 ] < 8 && ( supported_codecs() & ( 1 << data[ 0 ] ) ) );
+  switch ( data[ 0 ] ) {
+  case CODEC_NONE:
+    return string( reinterpret_cast<const char *>( payload ), payload_len );
+  case CODEC_DEFLATE:
+    len = uncompress_deflate( payload, payload_len );
+    break;
+  case CODEC_STATE:
+    dos_assert( input.size() >= STATE_HEADER_LEN );
+    len = uncompress_state( data + STATE_HEADER_LEN, input.size() - STATE_HEADER_LEN, dictionary );
+    break;
+#if HAVE_ZSTD
+  case CODEC_ZSTD: {
+    size_t ret = ZSTD_decompress_usingDDict( zstd_decompressor, buffer, BUFFER_SIZE,
+					     payload, payload_len, zstd_dictionary );
+    dos_assert( !ZSTD_isError( ret ) );
+    len = ret;
+    break;
+  }
+#endif
+  default:
+    assert( false );
+  }
+
   return string( reinterpret_cast<char *>( buffer ), len );
 }
 
-/* construct on first use */
+Decompressor::Decompressor()
+  : codec( -1 ), header_left( 0 ), streaming( false ), finished( false ), dictionary( NULL ),
+    stream(), zstd( NULL ), output(), produced( 0 )
+{}
+
+Decompressor::Decompressor( const Decompressor &other )
+  : codec( -1 ), header_left( 0 ), streaming( false ), finished( false ), dictionary( NULL ),
+    stream(), zstd( NULL ), output(), produced( 0 )
+{
+  fatal_assert( other.codec == -1 );
+}
+
+Decompressor::~Decompressor()
+{
+  clear();
+}
+
+void Decompressor::clear( void )
+{
+  if ( streaming ) {
+    inflateEnd( &stream );
+    streaming = false;
+  }
+#if HAVE_ZSTD
+  ZSTD_freeDCtx( zstd );
+#endif
+  zstd = NULL;
+  string().swap( output );
+  produced = 0;
+  dictionary = NULL;
+}
+
+void Decompressor::start( const string &piece )
+{
+  const unsigned char tag = piece[ 0 ];
+
+  if ( ( tag & 0x0f ) == CODEC_ZLIB ) {
+    codec = CODEC_ZLIB;
+    fatal_assert( Z_OK == inflateInit( &stream ) );
+    streaming = true;
+    return;
+  }
+
+  dos_assert( tag < 8 && ( Compressor::supported_codecs() & ( 1 << tag ) ) );
+  codec = tag;
+  header_left = ( codec == CODEC_STATE ) ? STATE_HEADER_LEN : 1;
+
+  if ( codec == CODEC_DEFLATE ) {
+    fatal_assert( Z_OK == inflateInit2( &stream, -15 ) );
+    streaming = true;
+    fatal_assert( Z_OK == inflateSetDictionary( &stream, reinterpret_cast<const Bytef *>( ::dictionary ),
+						dictionary_len ) );
+  } else if ( codec == CODEC_STATE ) {
+    fatal_assert( Z_OK == inflateInit( &stream ) );
+    streaming = true;
+  }
+#if HAVE_ZSTD
+  else if ( codec == CODEC_ZSTD ) {
+    zstd = ZSTD_createDCtx();
+    fatal_assert( zstd );
+    fatal_assert( !ZSTD_isError( ZSTD_DCtx_refDDict( zstd, get_compressor().zstd_dictionary ) ) );
+    /* no payload exceeds the Compressor's buffer, so neither may a window */
+    fatal_assert( !ZSTD_isError( ZSTD_DCtx_setParameter( zstd, ZSTD_d_windowLogMax, MAX_WINDOW_LOG ) ) );
+  }
+#endif
+}
+
+bool Decompressor::feed( const string &piece, size_t max_output )
+{
+  if ( piece.empty() ) {
+    return true;
+  }
+
+  const unsigned char *data = reinterpret_cast<const unsigned char *>( piece.data() );
+  size_t len = piece.size();
+
+  if ( codec == -1 ) {
+    if ( data[ 0 ] == CODEC_STATE && !dictionary ) {
+      return false;
+    }
+    start( piece );
+  }
+
+  if ( codec != CODEC_ZLIB ) {
+    size_t skip = std::min( header_left, len );
+    data += skip;
+    len -= skip;
+    header_left -= skip;
+  }
+
+  switch ( codec ) {
+  case CODEC_NONE:
+    dos_assert( produced + len <= max_output );
+    output.resize( produced );
+    output.append( reinterpret_cast<const char *>( data ), len );
+    produced += len;
+    break;
+  case CODEC_ZSTD:
+    if ( len ) {
+      zstd_piece( data, len, max_output );
+    }
+    break;
+  default:
+    if ( len ) {
+      inflate_piece( data, len, max_output );
+    }
+    break;
+  }
+
+  return true;
+}
+
+void Decompressor::grow_output( size_t max_output )
+{
+  dos_assert( output.size() < max_output );
+  output.resize( std::min( std::max( 2 * output.size(), INITIAL_OUTPUT ), max_output ) );
+}
+
+/* with len zero, drains what the stream still holds */
+void Decompressor::inflate_piece( const unsigned char *data, size_t len, size_t max_output )
+{
+  assert( streaming );
+  dos_assert( !finished || len == 0 );
+
+  stream.next_in = const_cast<Bytef *>( data );
+  stream.avail_in = len;
+
+  while ( !finished && ( stream.avail_in > 0 || len == 0 ) ) {
+    if ( produced == output.size() ) {
+      grow_output( max_output );
+    }
+
+    stream.next_out = reinterpret_cast<Bytef *>( &output[ produced ] );
+    stream.avail_out = output.size() - produced;
+    int ret = inflate( &stream, len ? Z_NO_FLUSH : Z_FINISH );
+    produced = output.size() - stream.avail_out;
+
+    if ( ret == Z_NEED_DICT ) {
+      dos_assert( codec == CODEC_STATE && dictionary );
+      const string primed = Compressor::state_dictionary( *dictionary );
+      dos_assert( Z_OK == inflateSetDictionary( &stream, reinterpret_cast<const Bytef *>( primed.data() ),
+						primed.size() ) );
+    } else if ( ret == Z_STREAM_END ) {
+      finished = true;
+      dos_assert( stream.avail_in == 0 );
+    } else {
+      /* while draining, only a full buffer justifies another pass */
+      dos_assert( ret == Z_OK || ( ret == Z_BUF_ERROR && stream.avail_out == 0 ) );
+    }
+  }
+}
+
+/* as inflate_piece, for a zstd frame */
+void Decompressor::zstd_piece( const unsigned char *data, size_t len, size_t max_output )
+{
+#if HAVE_ZSTD
+  assert( zstd );
+  dos_assert( !finished || len == 0 );
+
+  ZSTD_inBuffer in = { data, len, 0 };
+
+  while ( !finished ) {
+    if ( produced == output.size() ) {
+      grow_output( max_output );
+    }
+
+    ZSTD_outBuffer out = { &output[ produced ], output.size() - produced, 0 };
+    size_t ret = ZSTD_decompressStream( zstd, &out, &in );
+    dos_assert( !ZSTD_isError( ret ) );
+    produced += out.pos;
+
+    if ( ret == 0 ) {
+      finished = true;
+      dos_assert( in.pos == in.size );
+    } else if ( in.pos == in.size && out.pos < out.size ) {
+      /* wants more input; at the end, the frame is cut short */
+      dos_assert( len != 0 );
+      break;
+    }
+  }
+#else
+  /* start() refuses codecs this build lacks */
+  (void)data;
+  (void)len;
+  (void)max_output;
+  assert( false );
+#endif
+}
+
+const string &Decompressor::finish( size_t max_output )
+{
+  dos_assert( codec != -1 );
+
+  if ( streaming ) {
+    inflate_piece( NULL, 0, max_output );
+  } else if ( codec == CODEC_ZSTD ) {
+    zstd_piece( NULL, 0, max_output );
+  }
+  output.resize( produced );
+  return output;
+}
+
+CodecSelector::CodecSelector()
+  : remote_codecs( 0 ), link_rate( 0 ), codec( CODEC_ZLIB ),
+    level( Compressor::default_level( CODEC_ZLIB ) ),
+    cpu_us( 0 ), saved_bytes( 0 ), samples( 0 )
+{}
+
+void CodecSelector::update( void )
+{
+  unsigned int shared = remote_codecs & Compressor::supported_codecs();
+  Codec best = CODEC_ZLIB;
+  if ( shared & ( 1 << CODEC_ZSTD ) ) {
+    best = CODEC_ZSTD;
+  } else if ( shared & ( 1 << CODEC_DEFLATE ) ) {
+    best = CODEC_DEFLATE;
+  }
+
+  if ( best != codec ) {
+    codec = best;
+    level = Compressor::default_level( codec );
+    samples = 0;
+    return;
+  }
+
+  if ( link_rate <= 0 || samples < ADAPT_SAMPLES ) {
+    return;
+  }
+
+  /* time the link would have spent on the bytes compression saved */
+  double saved_us = 1000.0 * saved_bytes / link_rate;
+  int old_level = level;
+  if ( cpu_us > saved_us / 2 && level > 1 ) {
+    level--;
+  } else if ( cpu_us * 8 < saved_us && level < Compressor::max_level( codec ) ) {
+    level++;
+  }
+  if ( level != old_level ) {
+    samples = 0;
+  }
+}
+
+void CodecSelector::compressed( size_t input_len, size_t output_len, double cost_us )
+{
+  double saved = output_len < input_len ? double( input_len - output_len ) : 0;
+  if ( samples == 0 ) {
+    cpu_us = cost_us;
+    saved_bytes = saved;
+  } else {
+    cpu_us = ( 7 * cpu_us + cost_us ) / 8;
+    saved_bytes = ( 7 * saved_bytes + saved ) / 8;
+  }
+  samples++;
+}
+
 Compressor & Network::get_compressor( void )
 {
   static Compressor the_compressor;
@@ -33,27 +33,156 @@
 #ifndef COMPRESSOR_H
 #define COMPRESSOR_H
 
+#include <stdint.h>
 #include <string>
 
+#include <zlib.h>
+
+/* zstd.h stays out of the header; it may not be installed */
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_DDict_s;
+
 namespace Network {
+  /* How a payload is compressed. Every tagged codec starts the payload
+     with its number, which never has the low nibble of 8 that starts a
+     zlib stream, so the untagged format of older peers stays readable. */
+  enum Codec {
+    CODEC_NONE = 0,    /* stored, for payloads compression cannot shrink */
+    CODEC_DEFLATE = 1, /* raw deflate with the preset dictionary */
+    CODEC_ZSTD = 2,    /* zstd with the preset dictionary */
+    /* 3 was lz4, whose blocks decode only whole; not to be reused */
+    CODEC_STATE = 4,   /* zlib primed with a receiver state, whose number follows the tag */
+    CODEC_ZLIB = 8     /* untagged zlib stream, understood by every peer */
+  };
+
   class Compressor {
   private:
     static const int BUFFER_SIZE = 2048 * 2048; /* effective limit on terminal size */
 
+    /* below this, a tagged codec stores rather than compresses */
+    static const size_t MIN_COMPRESS_SIZE = 48;
+
     unsigned char *buffer;
 
+    z_stream deflater;
+    int deflater_level;
+    z_stream inflater;
+    z_stream state_deflater;
+    z_stream state_inflater;
+
+    ZSTD_CCtx_s *zstd_compressor;
+    ZSTD_DCtx_s *zstd_decompressor;
+    ZSTD_DDict_s *zstd_dictionary; /* the preset dictionary, digested once */
+
+    size_t compress_deflate( const std::string &input, int level, unsigned char *output, size_t output_len );
+    size_t uncompress_deflate( const unsigned char *input, size_t input_len );
+    friend class Decompressor;
+    static std::string state_dictionary( const std::string &rendering );
+    size_t uncompress_state( const unsigned char *input, size_t input_len, const std::string &dictionary );
+
   public:
-    Compressor() : buffer( NULL ) { buffer = new unsigned char[ BUFFER_SIZE ]; }
-    ~Compressor() { if ( buffer ) { delete[] buffer; } }
+    Compressor();
+    ~Compressor();
 
-    std::string compress_str( const std::string &input );
-    std::string uncompress_str( const std::string &input );
+    /* bitmask of the codecs (1 << codec) this build can decode */
+    static unsigned int supported_codecs( void );
+    static int default_level( Codec codec );
+    static int max_level( Codec codec );
+
+    std::string compress_str( const std::string &input, Codec codec = CODEC_ZLIB, int level = Z_DEFAULT_COMPRESSION );
+    /* compressed into our buffer, valid until the next call */
+    const char *compress( const std::string &input, size_t *len,
+			  Codec codec = CODEC_ZLIB, int level = Z_DEFAULT_COMPRESSION );
+    /* Compressed against dictionary, the rendering of receiver state
+       reference_num, which the receiver must still hold to decode it. */
+    const char *compress_with_state( const std::string &input, size_t *len,
+				     uint64_t reference_num, const std::string &dictionary );
+    /* the state a CODEC_STATE payload needs, or -1 for any other payload */
+    static uint64_t reference_state( const std::string &input );
+    /* whether dictionary is the one a CODEC_STATE payload was compressed against */
+    static bool dictionary_matches( const std::string &input, const std::string &dictionary );
+
+    /* accepts any codec in supported_codecs() as well as plain zlib;
+       CODEC_STATE also needs the state's dictionary */
+    std::string uncompress_str( const std::string &input, const std::string &dictionary = std::string() );
 
     /* unused */
     Compressor( const Compressor & );
     Compressor & operator=( const Compressor & );
   };
 
+  /* Decodes one payload a piece at a time, as its fragments arrive in
+     order, into output that grows up to a cap. Payloads compressed
+     against a state wait for its dictionary. */
+  class Decompressor {
+  private:
+    static const size_t INITIAL_OUTPUT = 16384;
+    static const int MAX_WINDOW_LOG = 22; /* the Compressor's buffer */
+
+    int codec; /* -1 until the first piece */
+    size_t header_left; /* of the tag and state number, still to skip */
+    bool streaming; /* stream is initialized */
+    bool finished; /* stream has ended */
+    const std::string *dictionary; /* for CODEC_STATE, once known */
+    z_stream stream;
+    ZSTD_DCtx_s *zstd; /* for CODEC_ZSTD */
+    std::string output;
+    size_t produced;
+
+    void start( const std::string &piece );
+    void grow_output( size_t max_output );
+    void inflate_piece( const unsigned char *data, size_t len, size_t max_output );
+    void zstd_piece( const unsigned char *data, size_t len, size_t max_output );
+
+    /* unused */
+    Decompressor & operator=( const Decompressor & );
+
+  public:
+    Decompressor();
+    /* only while nothing has been fed, so that an Assembly can live in a map */
+    Decompressor( const Decompressor &other );
+    ~Decompressor();
+
+    /* false, consuming nothing, if the piece must wait for the dictionary */
+    bool feed( const std::string &piece, size_t max_output );
+    void set_dictionary( const std::string *s_dictionary ) { dictionary = s_dictionary; }
+    /* the payload, once every piece has been fed */
+    const std::string &finish( size_t max_output );
+    void clear( void );
+  };
+
+  /* Picks the codec and level a sender compresses with: the best codec
+     both ends can use, at a level whose CPU time stays well under the
+     transmission time it saves on the link. */
+  class CodecSelector {
+  private:
+    static const unsigned int ADAPT_SAMPLES = 8; /* instructions between level changes */
+
+    unsigned int remote_codecs; /* what the receiver decodes, 0 if it predates codecs */
+    double link_rate; /* bytes per ms, 0 if unknown */
+    Codec codec;
+    int level;
+    double cpu_us; /* smoothed compression time per instruction */
+    double saved_bytes; /* smoothed bytes saved per instruction */
+    unsigned int samples;
+
+  public:
+    CodecSelector();
+
+    void set_remote_codecs( unsigned int codecs ) { remote_codecs = codecs; }
+    void set_link_rate( double rate ) { link_rate = rate; }
+
+    /* Only call between instructions, so a retransmitted instruction
+       compresses to the same fragments. */
+    void update( void );
+    void compressed( size_t input_len, size_t output_len, double cost_us );
+
+    bool remote_supports( Codec c ) const { return ( remote_codecs & Compressor::supported_codecs() ) & ( 1 << c ); }
+    Codec get_codec( void ) const { return codec; }
+    int get_level( void ) const { return level; }
+  };
+
   Compressor & get_compressor( void );
 }
 
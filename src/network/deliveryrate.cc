@@ -0,0 +1,170 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include <math.h>
+#include <algorithm>
+
+#include "deliveryrate.h"
+
+using namespace Network;
+
+const double DeliveryRate::STARTUP_GAIN = 2.89;
+const double DeliveryRate::PACING_GAIN[ GAIN_CYCLE_LENGTH ] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+DeliveryRate::DeliveryRate()
+  : records(),
+    last_ack_at( 0 ),
+    max_bandwidth( 0 ),
+    max_bandwidth_at( 0 ),
+    min_rtt( 0 ),
+    min_rtt_at( 0 ),
+    ce_count( 0 ),
+    srtt( 1000 ),
+    startup_scale( 1 )
+{
+}
+
+void DeliveryRate::sent( uint64_t num, uint64_t now, size_t bytes, bool rate_limited, double s_srtt )
+{
+  srtt = s_srtt;
+
+  if ( !records.empty() && records.back().num == num ) {
+    /* resend of the same state */
+    records.back().bytes += bytes;
+    return;
+  }
+
+  records.push_back( SendRecord( num, now, bytes, rate_limited ) );
+  if ( records.size() > MAX_RECORDS ) {
+    records.pop_front();
+  }
+}
+
+void DeliveryRate::acked( uint64_t num, uint64_t now, uint64_t ack_delay, double rtt )
+{
+  if ( rtt > 0 && ( min_rtt == 0 || rtt <= min_rtt || now - min_rtt_at > MIN_RTT_WINDOW ) ) {
+    min_rtt = rtt;
+    min_rtt_at = now;
+  }
+
+  /* everything up to and including num has now been delivered or superseded */
+  size_t delivered = 0;
+  bool last_rate_limited = false;
+  uint64_t last_sent_at = 0;
+  while ( !records.empty() && records.front().num <= num ) {
+    last_rate_limited = records.front().rate_limited;
+    last_sent_at = records.front().sent_at;
+    delivered += records.front().bytes;
+    records.pop_front();
+  }
+
+  if ( delivered == 0 ) {
+    return;
+  }
+
+  /* take out the time the receiver sat on the ack */
+  double ack_at = double( now ) - double( ack_delay );
+  double previous_ack_at = last_ack_at;
+  last_ack_at = ack_at;
+
+  if ( previous_ack_at == 0 || delivered < MIN_SAMPLE_BYTES ) {
+    return;
+  }
+
+  /* Acks are per state rather than per datagram, so measure from the
+     previous ack; this includes any idle time when we had nothing to
+     send, and so is only a lower bound unless the path was kept busy. */
+  bool path_limited = last_rate_limited && previous_ack_at > last_sent_at;
+  double interval = ack_at - previous_ack_at;
+  if ( interval < 1 ) {
+    interval = 1;
+  }
+
+  /* An application-limited sample is only a lower bound on bandwidth,
+     so it never lowers the estimate; a path-limited one replaces it. */
+  double sample = double( delivered ) / interval;
+  if ( path_limited || sample >= max_bandwidth || now - max_bandwidth_at > BANDWIDTH_WINDOW ) {
+    max_bandwidth = sample;
+    max_bandwidth_at = now;
+  }
+}
+
+void DeliveryRate::congestion( unsigned int s_ce_count, uint64_t now )
+{
+  if ( s_ce_count == ce_count ) {
+    return;
+  }
+
+  ce_count = s_ce_count;
+
+  /* back off multiplicatively, as with a loss, and hold the lower estimate */
+  if ( max_bandwidth > 0 ) {
+    max_bandwidth *= 0.7;
+    max_bandwidth_at = now;
+  }
+}
+
+void DeliveryRate::lost( uint64_t now )
+{
+  if ( max_bandwidth > 0 ) {
+    max_bandwidth *= 0.7;
+    max_bandwidth_at = now;
+  } else if ( startup_scale > 1.0 / 64 ) {
+    /* a burst at the startup rate overflowed the path */
+    startup_scale /= 2;
+  }
+}
+
+double DeliveryRate::pacing_rate( uint64_t now ) const
+{
+  if ( max_bandwidth > 0 ) {
+    /* spend one propagation RTT in each phase of the gain cycle */
+    uint64_t phase = now / std::max( uint64_t( lrint( min_rtt ) ), uint64_t( 1 ) );
+    /* never pace so slowly that acks can't come back to correct us */
+    return std::max( PACING_GAIN[ phase % GAIN_CYCLE_LENGTH ] * max_bandwidth,
+		     MIN_WINDOW / std::max( min_rtt, 1.0 ) );
+  }
+
+  /* Before the first RTT sample, the connection reports a conservative
+     SRTT of one second; don't let that starve the first frames. */
+  return startup_scale * STARTUP_GAIN * INITIAL_WINDOW / std::max( std::min( srtt, 100.0 ), 1.0 );
+}
+
+uint64_t DeliveryRate::next_phase( uint64_t now ) const
+{
+  if ( max_bandwidth > 0 ) {
+    uint64_t phase_length = std::max( uint64_t( lrint( min_rtt ) ), uint64_t( 1 ) );
+    return ( now / phase_length + 1 ) * phase_length;
+  }
+  return uint64_t( -1 );
+}
@@ -0,0 +1,116 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef DELIVERY_RATE_HPP
+#define DELIVERY_RATE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+
+namespace Network {
+  /* BBR-style estimate of the path's bottleneck bandwidth, sampled
+     from acknowledged states, used to pace fragments and to choose
+     the interval between frames. */
+  class DeliveryRate {
+  private:
+    static const uint64_t BANDWIDTH_WINDOW = 10000; /* ms to remember max bandwidth sample */
+    static const uint64_t MIN_RTT_WINDOW = 10000; /* ms to remember min RTT sample */
+    static const size_t MIN_SAMPLE_BYTES = 3000; /* app-limited below this */
+    static const size_t MAX_RECORDS = 64;
+    static const size_t INITIAL_WINDOW = 10 * 1300; /* bytes per RTT before any sample */
+    static const size_t MIN_WINDOW = 4 * 1300; /* bytes per RTT to pace at, at least */
+
+    class SendRecord {
+    public:
+      uint64_t num;
+      uint64_t sent_at;
+      size_t bytes;
+      bool rate_limited; /* held back by the frame interval or pacing, not by lack of data */
+
+      SendRecord( uint64_t s_num, uint64_t s_sent_at, size_t s_bytes, bool s_rate_limited )
+	: num( s_num ), sent_at( s_sent_at ), bytes( s_bytes ), rate_limited( s_rate_limited )
+      {}
+    };
+
+    std::deque< SendRecord > records;
+
+    double last_ack_at; /* when the receiver got the last acknowledged state */
+
+    double max_bandwidth; /* bytes per ms, 0 if unknown */
+    uint64_t max_bandwidth_at;
+
+    double min_rtt; /* ms, 0 if unknown */
+    uint64_t min_rtt_at;
+
+    unsigned int ce_count; /* ECN congestion-experienced marks seen */
+
+    double srtt; /* latest smoothed RTT from the connection */
+    double startup_scale; /* backoff of the startup rate after losses */
+
+  public:
+    /* BBR's pacing gains in startup and in its steady state, which
+       cycles through probing for more bandwidth and draining any queue */
+    static const double STARTUP_GAIN;
+    static const int GAIN_CYCLE_LENGTH = 8;
+    static const double PACING_GAIN[ GAIN_CYCLE_LENGTH ];
+
+    DeliveryRate();
+
+    /* Record a datagram train carrying state num */
+    void sent( uint64_t num, uint64_t now, size_t bytes, bool rate_limited, double s_srtt );
+
+    /* Record acknowledgment of state num, which the receiver held for ack_delay ms */
+    void acked( uint64_t num, uint64_t now, uint64_t ack_delay, double rtt );
+
+    /* Record the counterparty's running count of ECN CE marks */
+    void congestion( unsigned int s_ce_count, uint64_t now );
+
+    /* Record a state that timed out and had to be resent */
+    void lost( uint64_t now );
+
+    bool has_estimate( void ) const { return max_bandwidth > 0; }
+    double bandwidth( void ) const { return max_bandwidth; }
+    double get_min_rtt( void ) const { return min_rtt; }
+
+    /* bytes per ms */
+    double pacing_rate( uint64_t now ) const;
+    /* when pacing_rate() next changes with the time alone, or -1 */
+    uint64_t next_phase( uint64_t now ) const;
+
+    /* ms to leave after sending bytes, at the pacing rate */
+    double pacing_delay( size_t bytes, uint64_t now ) const { return double( bytes ) / pacing_rate( now ); }
+  };
+}
+
+#endif
@@ -0,0 +1,291 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <string.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "netmonitor.h"
+
+using namespace Network;
+
+/* The monitor is an optional nicety: where netlink is missing or
+   forbidden, as in some containers, it quietly watches nothing. */
+NetworkMonitor::NetworkMonitor()
+  : _fd( -1 ), seq( 0 ), addresses(), default_routes()
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  _fd = socket( AF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+  if ( _fd < 0 ) {
+    return;
+  }
+
+  struct sockaddr_nl local;
+  memset( &local, 0, sizeof( local ) );
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+  if ( bind( _fd, (struct sockaddr *)&local, sizeof( local ) ) < 0
+       || !resync() ) {
+    stop();
+  }
+#endif
+}
+
+NetworkMonitor::~NetworkMonitor()
+{
+  stop();
+}
+
+void NetworkMonitor::stop( void )
+{
+  if ( _fd >= 0 && close( _fd ) < 0 ) {
+    perror( "close" );
+  }
+  _fd = -1;
+}
+
+std::set< std::string > NetworkMonitor::view( void ) const
+{
+  std::set< std::string > result;
+  for ( std::set< std::pair< int, std::string > >::const_iterator i = default_routes.begin();
+	i != default_routes.end();
+	i++ ) {
+    char ifindex[ 16 ];
+    snprintf( ifindex, sizeof( ifindex ), "%d ", i->first );
+    result.insert( std::string( "route " ) + ifindex + i->second );
+
+    std::map< int, std::set< std::string > >::const_iterator on_link = addresses.find( i->first );
+    if ( on_link != addresses.end() ) {
+      for ( std::set< std::string >::const_iterator j = on_link->second.begin();
+	    j != on_link->second.end();
+	    j++ ) {
+	result.insert( std::string( "address " ) + *j );
+      }
+    }
+  }
+  return result;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/* the bytes of an attribute, or empty if it isn't there */
+static std::string attribute( const struct rtattr *rta, int len, unsigned short type )
+{
+  for ( ; RTA_OK( rta, len ); rta = RTA_NEXT( rta, len ) ) {
+    if ( rta->rta_type == type ) {
+      return std::string( (const char *)RTA_DATA( rta ), RTA_PAYLOAD( rta ) );
+    }
+  }
+  return std::string();
+}
+#endif
+
+/* Brings what we know up to date with one report. A report that
+   repeats what we know, like the refresh of an IPv6 address's lifetime
+   on each router advertisement, changes nothing. */
+void NetworkMonitor::apply( const void *message )
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  const struct nlmsghdr *msg = (const struct nlmsghdr *)message;
+  switch ( msg->nlmsg_type ) {
+  case RTM_NEWADDR:
+  case RTM_DELADDR: {
+    const struct ifaddrmsg *ifa = (const struct ifaddrmsg *)NLMSG_DATA( msg );
+    if ( msg->nlmsg_len < NLMSG_LENGTH( sizeof( *ifa ) ) ) {
+      break;
+    }
+    /* link-local and loopback addresses don't reach the server */
+    if ( ifa->ifa_scope >= RT_SCOPE_LINK ) {
+      break;
+    }
+    int len = msg->nlmsg_len - NLMSG_LENGTH( sizeof( *ifa ) );
+    std::string address = attribute( IFA_RTA( ifa ), len, IFA_LOCAL );
+    if ( address.empty() ) {
+      address = attribute( IFA_RTA( ifa ), len, IFA_ADDRESS );
+    }
+    if ( address.empty() ) {
+      break;
+    }
+    address = std::string( 1, char( ifa->ifa_family ) ) + address;
+
+    /* an address still being checked for duplicates can't be used yet */
+    if ( msg->nlmsg_type == RTM_NEWADDR && !( ifa->ifa_flags & ( IFA_F_TENTATIVE | IFA_F_DADFAILED ) ) ) {
+      addresses[ ifa->ifa_index ].insert( address );
+    } else {
+      addresses[ ifa->ifa_index ].erase( address );
+    }
+    break;
+  }
+  case RTM_NEWROUTE:
+  case RTM_DELROUTE: {
+    /* only the main table's default routes decide how we reach the server */
+    const struct rtmsg *rtm = (const struct rtmsg *)NLMSG_DATA( msg );
+    if ( msg->nlmsg_len < NLMSG_LENGTH( sizeof( *rtm ) )
+	 || rtm->rtm_dst_len != 0 || rtm->rtm_table != RT_TABLE_MAIN
+	 || rtm->rtm_type != RTN_UNICAST ) {
+      break;
+    }
+    int len = msg->nlmsg_len - NLMSG_LENGTH( sizeof( *rtm ) );
+    std::string oif = attribute( RTM_RTA( rtm ), len, RTA_OIF );
+    int ifindex = 0;
+    if ( oif.size() == sizeof( ifindex ) ) {
+      memcpy( &ifindex, oif.data(), sizeof( ifindex ) );
+    }
+    std::pair< int, std::string > route( ifindex, std::string( 1, char( rtm->rtm_family ) )
+					 + attribute( RTM_RTA( rtm ), len, RTA_GATEWAY ) );
+    if ( msg->nlmsg_type == RTM_NEWROUTE ) {
+      /* a replaced route isn't reported gone */
+      if ( msg->nlmsg_flags & NLM_F_REPLACE ) {
+	for ( std::set< std::pair< int, std::string > >::iterator i = default_routes.begin();
+	      i != default_routes.end(); ) {
+	  if ( i->second[ 0 ] == route.second[ 0 ] ) {
+	    default_routes.erase( i++ );
+	  } else {
+	    i++;
+	  }
+	}
+      }
+      default_routes.insert( route );
+    } else {
+      default_routes.erase( route );
+    }
+    break;
+  }
+  default:
+    break;
+  }
+#else
+  (void)message;
+#endif
+}
+
+/* Asks for the whole of one table and reads it in, along with any
+   reports that come in meanwhile. */
+bool NetworkMonitor::dump( int type )
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  struct {
+    struct nlmsghdr header;
+    struct rtgenmsg body;
+  } request;
+  memset( &request, 0, sizeof( request ) );
+  request.header.nlmsg_len = NLMSG_LENGTH( sizeof( request.body ) );
+  request.header.nlmsg_type = type;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.header.nlmsg_seq = ++seq;
+  request.body.rtgen_family = AF_UNSPEC;
+  if ( send( _fd, &request, request.header.nlmsg_len, 0 ) < 0 ) {
+    return false;
+  }
+
+  uint32_t buf[ 4096 ]; /* aligned for the headers */
+  while ( true ) {
+    ssize_t received = recv( _fd, buf, sizeof( buf ), 0 );
+    if ( received < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      return false;
+    }
+
+    int len = received;
+    for ( struct nlmsghdr *msg = (struct nlmsghdr *)buf;
+	  NLMSG_OK( msg, len );
+	  msg = NLMSG_NEXT( msg, len ) ) {
+      if ( msg->nlmsg_seq == seq && msg->nlmsg_type == NLMSG_DONE ) {
+	return true;
+      } else if ( msg->nlmsg_seq == seq && msg->nlmsg_type == NLMSG_ERROR ) {
+	return false;
+      }
+      apply( msg );
+    }
+  }
+#else
+  (void)type;
+  return false;
+#endif
+}
+
+/* Learns the tables afresh, when starting or after reports were lost */
+bool NetworkMonitor::resync( void )
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  addresses.clear();
+  default_routes.clear();
+  return dump( RTM_GETADDR ) && dump( RTM_GETROUTE );
+#else
+  return false;
+#endif
+}
+
+bool NetworkMonitor::changed( void )
+{
+  if ( _fd < 0 ) {
+    return false;
+  }
+
+  const std::set< std::string > before = view();
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+  uint32_t buf[ 4096 ]; /* aligned for the headers */
+  while ( true ) {
+    ssize_t received = recv( _fd, buf, sizeof( buf ), MSG_DONTWAIT );
+    if ( received < 0 ) {
+      /* ENOBUFS means reports were lost, which may have been anything */
+      if ( errno == ENOBUFS && !resync() ) {
+	stop();
+	return true;
+      }
+      break;
+    }
+
+    int len = received;
+    for ( struct nlmsghdr *msg = (struct nlmsghdr *)buf;
+	  NLMSG_OK( msg, len );
+	  msg = NLMSG_NEXT( msg, len ) ) {
+      apply( msg );
+    }
+  }
+#endif
+
+  return view() != before;
+}
@@ -0,0 +1,81 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef NET_MONITOR_HPP
+#define NET_MONITOR_HPP
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+namespace Network {
+  /* Watches for the local network changing under the client, like a
+     handover from Wi-Fi to a mobile network: a new default route, or a
+     usable address coming or going on an interface one goes through.
+     On Linux, the kernel reports these on a netlink socket; elsewhere
+     nothing is watched and the client relies on its timers alone. */
+  class NetworkMonitor {
+  private:
+    int _fd; /* -1 if not watching */
+    uint32_t seq;
+
+    /* what we know of the tables, each entry as raw bytes */
+    std::map< int, std::set< std::string > > addresses; /* by interface */
+    std::set< std::pair< int, std::string > > default_routes; /* interface, gateway */
+
+    /* the default routes and the addresses on their interfaces; only a
+       change to these can move us */
+    std::set< std::string > view( void ) const;
+
+    void apply( const void *msg );
+    bool dump( int type );
+    bool resync( void );
+    void stop( void );
+
+    /* not implemented */
+    NetworkMonitor( const NetworkMonitor & );
+    NetworkMonitor & operator=( const NetworkMonitor & );
+
+  public:
+    NetworkMonitor();
+    ~NetworkMonitor();
+
+    int fd( void ) const { return _fd; }
+
+    /* Reads every report waiting, and says whether they moved us */
+    bool changed( void );
+  };
+}
+
+#endif
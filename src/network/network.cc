@@ -37,12 +37,15 @@
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
 #endif
+#include <sys/time.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "dos_assert.h"
 #include "fatal_assert.h"
@@ -86,28 +89,40 @@ Packet::Packet( const Message & message )
 
 /* Output from packet */
 Message Packet::toMessage( void )
+{
+  return Message( nonce(), timestamps() + payload );
+}
+
+Nonce Packet::nonce( void ) const
 {
   uint64_t direction_seq = (uint64_t( direction == TO_CLIENT ) << 63) | (seq & SEQUENCE_MASK);
 
+  return Nonce( direction_seq );
+}
+
+string Packet::timestamps( void ) const
+{
   uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
                            static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
 
-  string timestamps = string( (char *)ts_net, 2 * sizeof( uint16_t ) );
-
-  return Message( Nonce( direction_seq ), timestamps + payload );
+  return string( (char *)ts_net, 2 * sizeof( uint16_t ) );
 }
 
-Packet Connection::new_packet( const string &s_payload )
+Packet Connection::new_packet( const string &s_payload, Path &path )
 {
   uint16_t outgoing_timestamp_reply = -1;
 
   uint64_t now = timestamp();
 
-  if ( now - saved_timestamp_received_at < 1000 ) { /* we have a recent received timestamp */
+  if ( now - path.saved_timestamp_received_at < 1000 ) { /* we have a recent received timestamp */
     /* send "corrected" timestamp advanced by how long we held it */
-    outgoing_timestamp_reply = saved_timestamp + (now - saved_timestamp_received_at);
-    saved_timestamp = -1;
-    saved_timestamp_received_at = 0;
+    outgoing_timestamp_reply = path.saved_timestamp + (now - path.saved_timestamp_received_at);
+    path.saved_timestamp = -1;
+    path.saved_timestamp_received_at = 0;
+  }
+
+  if ( path.unanswered_since == uint64_t( -1 ) ) {
+    path.unanswered_since = now;
   }
 
   Packet p( direction, timestamp16(), outgoing_timestamp_reply, s_payload );
@@ -115,6 +130,63 @@ Packet Connection::new_packet( const string &s_payload )
   return p;
 }
 
+Path::Path( const Addr &s_remote_addr, socklen_t s_remote_addr_len, int s_fd )
+  : remote_addr( s_remote_addr ),
+    remote_addr_len( s_remote_addr_len ),
+    fd( s_fd ),
+    last_heard( -1 ),
+    expected_seq( 0 ),
+    saved_timestamp( -1 ),
+    saved_timestamp_received_at( 0 ),
+    RTT_hit( false ),
+    SRTT( 1000 ),
+    RTTVAR( 500 ),
+    unanswered_since( -1 ),
+    loss( 0 ),
+    datagrams_sent( 0 )
+{}
+
+bool Path::reaches( const Addr &addr, socklen_t addr_len ) const
+{
+  return remote_addr_len == addr_len && memcmp( &remote_addr, &addr, addr_len ) == 0;
+}
+
+void Path::RTT_sample( double R )
+{
+  if ( !RTT_hit ) {
+    SRTT = R;
+    RTTVAR = R / 2;
+    RTT_hit = true;
+  } else {
+    const double alpha = 1.0 / 8.0;
+    const double beta = 1.0 / 4.0;
+
+    RTTVAR = (1 - beta) * RTTVAR + ( beta * fabs( SRTT - R ) );
+    SRTT = (1 - alpha) * SRTT + ( alpha * R );
+  }
+}
+
+/* Loss is inferred from the timestamp echo: a datagram that comes back
+   along the path without one, well after the counterparty should have
+   had our timestamp, means that timestamp's datagram went missing. */
+void Path::heard( uint64_t now, bool echoed )
+{
+  const double alpha = 1.0 / 8.0;
+
+  last_heard = now;
+
+  if ( echoed ) {
+    loss = (1 - alpha) * loss;
+    unanswered_since = -1;
+  } else if ( unanswered_since != uint64_t( -1 ) && RTT_hit ) {
+    uint64_t waited = now - unanswered_since;
+    if ( waited > SRTT + 4 * RTTVAR && waited < 1000 ) { /* it would still have been echoed */
+      loss = (1 - alpha) * loss + alpha;
+      unanswered_since = -1;
+    }
+  }
+}
+
 void Connection::hop_port( void )
 {
   assert( !server );
@@ -122,10 +194,19 @@ void Connection::hop_port( void )
   setup();
   assert( remote_addr_len != 0 );
   socks.push_back( Socket( remote_addr.sa.sa_family ) );
+  bindings++;
 
   prune_sockets();
 }
 
+void Connection::roam( void )
+{
+  assert( !server );
+
+  /* as after a long silence, but without waiting for one */
+  hop_port();
+}
+
 void Connection::prune_sockets( void )
 {
   /* don't keep old sockets if the new socket has been working for long enough */
@@ -156,7 +237,8 @@ Connection::Socket::Socket( int family )
     throw NetworkException( "socket", errno );
   }
 
-  /* Disable path MTU discovery */
+  /* Disable the kernel's path MTU discovery; PathMTU sets the
+     don't-fragment bit on its own probes */
 #ifdef HAVE_IP_MTU_DISCOVER
   int flag = IP_PMTUDISC_DONT;
   if ( setsockopt( _fd, IPPROTO_IP, IP_MTU_DISCOVER, &flag, sizeof flag ) < 0 ) {
@@ -164,12 +246,27 @@ Connection::Socket::Socket( int family )
   }
 #endif
 
-  //  int dscp = 0x92; /* OS X does not have IPTOS_DSCP_AF42 constant */
-  int dscp = 0x02; /* ECN-capable transport only */
+  /* each datagram's traffic class is marked as it goes out, where the
+     system allows; this is for the rest */
+  int dscp = ECN_ECT; /* ECN-capable transport only */
   if ( setsockopt( _fd, IPPROTO_IP, IP_TOS, &dscp, sizeof dscp ) < 0 ) {
     //    perror( "setsockopt( IP_TOS )" );
   }
 
+  /* have the kernel stamp each datagram on arrival, so round trips
+     don't count the time it waited for us */
+#if defined( SO_TIMESTAMPNS )
+  int tsflag = true;
+  if ( setsockopt( _fd, SOL_SOCKET, SO_TIMESTAMPNS, &tsflag, sizeof tsflag ) < 0 ) {
+    perror( "setsockopt( SO_TIMESTAMPNS )" );
+  }
+#elif defined( SO_TIMESTAMP )
+  int tsflag = true;
+  if ( setsockopt( _fd, SOL_SOCKET, SO_TIMESTAMP, &tsflag, sizeof tsflag ) < 0 ) {
+    perror( "setsockopt( SO_TIMESTAMP )" );
+  }
+#endif
+
   /* request explicit congestion notification on received datagrams */
 #ifdef HAVE_IP_RECVTOS
   int tosflag = true;
@@ -197,6 +294,18 @@ const std::vector< int > Connection::fds( void ) const
     ret.push_back( it->fd() );
   }
 
+  for ( std::deque< Socket >::const_iterator it = path_socks.begin();
+	it != path_socks.end();
+	it++ ) {
+    ret.push_back( it->fd() );
+  }
+
+  for ( std::deque< Socket >::const_iterator it = candidate_socks.begin();
+	it != candidate_socks.end();
+	it++ ) {
+    ret.push_back( it->fd() );
+  }
+
   return ret;
 }
 
@@ -204,10 +313,10 @@ void Connection::set_MTU( int family )
 {
   switch ( family ) {
   case AF_INET:
-    MTU = DEFAULT_IPV4_MTU - IPV4_HEADER_LEN;
+    path_mtu.reset( DEFAULT_IPV4_MTU - IPV4_HEADER_LEN, IPV4_HEADER_LEN, Session::RECEIVE_MTU );
     break;
   case AF_INET6:
-    MTU = DEFAULT_IPV6_MTU - IPV6_HEADER_LEN;
+    path_mtu.reset( DEFAULT_IPV6_MTU - IPV6_HEADER_LEN, IPV6_HEADER_LEN, Session::RECEIVE_MTU );
     break;
   default:
     throw NetworkException( "Unknown address family", 0 );
@@ -237,22 +346,42 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
     remote_addr(),
     remote_addr_len( 0 ),
     server( true ),
-    MTU( DEFAULT_SEND_MTU ),
+    path_mtu( DEFAULT_SEND_MTU ),
     key(),
     session( key ),
     direction( TO_CLIENT ),
-    saved_timestamp( -1 ),
-    saved_timestamp_received_at( 0 ),
     expected_receiver_seq( 0 ),
+    paths(),
+    path_socks(),
+    remote_paths( 0 ),
+    candidates(),
+    candidate_socks(),
+    candidate_backlog(),
     last_heard( -1 ),
     last_port_choice( -1 ),
     last_roundtrip_success( -1 ),
+    keepalive_interval( 0 ),
+    bindings( 0 ),
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
-    send_error()
+    latest_RTT( 0 ),
+    network_RTT_hit( false ),
+    network_SRTT( 1000 ),
+    min_RTT( 0 ),
+    min_RTT_at( 0 ),
+    host_delay( 0 ),
+    receive_times(),
+    ecn_ce_count( 0 ),
+    send_error(),
+    traffic_dscp(),
+    traffic_marking( true ),
+    send_buffer( SEND_BATCH * Session::RECEIVE_MTU ),
+    recv_buffer( RECV_BATCH * Session::RECEIVE_MTU )
 {
   setup();
+  traffic_dscp[ TRAFFIC_INTERACTIVE ] = DEFAULT_INTERACTIVE_DSCP;
+  traffic_dscp[ TRAFFIC_BULK ] = DEFAULT_BULK_DSCP;
 
   /* The mosh wrapper always gives an IP request, in order
      to deal with multihomed servers. The port is optional. */
@@ -364,22 +493,42 @@ Connection::Connection( const char *key_str, const char *ip, const char *port )
     remote_addr(),
     remote_addr_len( 0 ),
     server( false ),
-    MTU( DEFAULT_SEND_MTU ),
+    path_mtu( DEFAULT_SEND_MTU ),
     key( key_str ),
     session( key ),
     direction( TO_SERVER ),
-    saved_timestamp( -1 ),
-    saved_timestamp_received_at( 0 ),
     expected_receiver_seq( 0 ),
+    paths(),
+    path_socks(),
+    remote_paths( 0 ),
+    candidates(),
+    candidate_socks(),
+    candidate_backlog(),
     last_heard( -1 ),
     last_port_choice( -1 ),
     last_roundtrip_success( -1 ),
+    keepalive_interval( 0 ),
+    bindings( 0 ),
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
-    send_error()
+    latest_RTT( 0 ),
+    network_RTT_hit( false ),
+    network_SRTT( 1000 ),
+    min_RTT( 0 ),
+    min_RTT_at( 0 ),
+    host_delay( 0 ),
+    receive_times(),
+    ecn_ce_count( 0 ),
+    send_error(),
+    traffic_dscp(),
+    traffic_marking( true ),
+    send_buffer( SEND_BATCH * Session::RECEIVE_MTU ),
+    recv_buffer( RECV_BATCH * Session::RECEIVE_MTU )
 {
   setup();
+  traffic_dscp[ TRAFFIC_INTERACTIVE ] = DEFAULT_INTERACTIVE_DSCP;
+  traffic_dscp[ TRAFFIC_BULK ] = DEFAULT_BULK_DSCP;
 
   /* associate socket with remote host and port */
   struct addrinfo hints;
@@ -395,61 +544,547 @@ Connection::Connection( const char *key_str, const char *ip, const char *port )
   has_remote_addr = true;
 
   socks.push_back( Socket( remote_addr.sa.sa_family ) );
+  paths.push_back( Path( remote_addr, remote_addr_len, -1 ) );
 
   set_MTU( remote_addr.sa.sa_family );
 }
 
 void Connection::send( const string & s )
+{
+  send( string(), s );
+}
+
+void Connection::send( const string & header, const string & payload )
+{
+  send( std::vector< Datagram >( 1, Datagram( header, payload ) ) );
+}
+
+/* Each header and payload is gathered straight into the cipher's input,
+   and the nonce and ciphertext go out from where they are, so a payload
+   is copied only once on its way to the socket. A frame's datagrams
+   share system calls where sendmmsg() is available. */
+void Connection::send( const std::vector< Datagram > & datagrams, PathPolicy policy, TrafficClass traffic )
 {
   if ( !has_remote_addr ) {
     return;
   }
 
-  Packet px = new_packet( s );
-
-  string p = session.encrypt( px.toMessage() );
-
-  ssize_t bytes_sent = sendto( sock(), p.data(), p.size(), MSG_DONTWAIT,
-			       &remote_addr.sa, remote_addr_len );
-
-  if ( bytes_sent != static_cast<ssize_t>( p.size() ) ) {
-    /* Make sendto() failure available to the frontend. */
-    send_error = "sendto: ";
-    send_error += strerror( errno );
+  if ( racing() ) {
+    candidate_backlog.clear();
+    for ( size_t i = 0; i < datagrams.size(); i++ ) {
+      candidate_backlog.push_back( std::make_pair( datagrams[ i ].header, *datagrams[ i ].payload ) );
+    }
+    for ( size_t i = 0; i < candidates.size(); i++ ) {
+      if ( candidates[ i ].started ) {
+	send_candidate( datagrams, candidates[ i ], traffic );
+      }
+    }
+  }
 
-    if ( errno == EMSGSIZE ) {
-      MTU = DEFAULT_SEND_MTU; /* payload MTU of last resort */
+  if ( paths.size() == 1 || remote_paths == 0 ) {
+    send_on_path( datagrams, main_path(), traffic );
+  } else {
+    std::vector< std::vector< Datagram > > per_path = schedule( datagrams, policy );
+    for ( size_t i = 0; i < per_path.size(); i++ ) {
+      if ( !per_path[ i ].empty() ) {
+	send_on_path( per_path[ i ], paths[ i ], traffic );
+      }
     }
   }
 
   uint64_t now = timestamp();
   if ( server ) {
-    if ( now - last_heard > SERVER_ASSOCIATION_TIMEOUT ) {
+    if ( now - last_heard > SERVER_ASSOCIATION_TIMEOUT + keepalive_interval ) {
       has_remote_addr = false;
       fprintf( stderr, "Server now detached from client.\n" );
     }
   } else { /* client */
     if ( ( now - last_port_choice > PORT_HOP_INTERVAL )
-	 && ( now - last_roundtrip_success > PORT_HOP_INTERVAL ) ) {
+	 && ( now - last_roundtrip_success > PORT_HOP_INTERVAL + keepalive_interval ) ) {
       hop_port();
     }
   }
 }
 
-string Connection::recv( void )
+void Connection::send_on_path( const std::vector< Datagram > & datagrams, Path &path, TrafficClass traffic )
+{
+  for ( size_t start = 0; start < datagrams.size(); start += SEND_BATCH ) {
+    const int count = std::min( datagrams.size() - start, size_t( SEND_BATCH ) );
+
+    if ( !send_batch( &datagrams[ start ], count, path, traffic ) ) {
+      /* Make sendmsg() failure available to the frontend. */
+      send_error = "sendmsg: ";
+      send_error += strerror( errno );
+
+      if ( errno == EMSGSIZE ) {
+	path_mtu.fallback( DEFAULT_SEND_MTU ); /* payload MTU of last resort */
+      }
+      break;
+    }
+  }
+}
+
+class FasterPath {
+private:
+  const std::vector< Path > &paths;
+  uint64_t now;
+
+public:
+  FasterPath( const std::vector< Path > &s_paths, uint64_t s_now ) : paths( s_paths ), now( s_now ) {}
+  bool operator()( size_t a, size_t b ) const
+  {
+    if ( paths[ a ].alive( now ) != paths[ b ].alive( now ) ) {
+      return paths[ a ].alive( now );
+    }
+    return paths[ a ].SRTT < paths[ b ].SRTT;
+  }
+};
+
+/* Decide which datagrams go along which path. A path we haven't heard
+   from lately gets redundant copies and acks, until it comes back. */
+std::vector< std::vector< Datagram > > Connection::schedule( const std::vector< Datagram > & datagrams,
+							     PathPolicy policy )
+{
+  std::vector< std::vector< Datagram > > per_path( paths.size() );
+  const uint64_t now = timestamp();
+
+  /* live paths first, fastest first */
+  std::vector< size_t > candidates;
+  size_t live = 0;
+  for ( size_t i = 0; i < paths.size(); i++ ) {
+    candidates.push_back( i );
+    live += paths[ i ].alive( now );
+  }
+  std::sort( candidates.begin(), candidates.end(), FasterPath( paths, now ) );
+
+  switch ( policy ) {
+  case PATHS_ALL:
+  case PATHS_REDUNDANT:
+    if ( policy == PATHS_REDUNDANT && candidates.size() > REDUNDANT_PATHS ) {
+      candidates.resize( REDUNDANT_PATHS );
+    }
+    for ( size_t i = 0; i < candidates.size(); i++ ) {
+      per_path[ candidates[ i ] ] = datagrams;
+    }
+    break;
+  case PATHS_SPREAD: {
+    if ( live > 0 ) { /* while nothing is known to work, try everything */
+      candidates.resize( live );
+    }
+
+    /* a path much slower than the best would only hold the frame up */
+    const double slowest = 2 * paths[ candidates.front() ].SRTT + SPREAD_RTT_SLACK;
+    while ( candidates.size() > 1 && paths[ candidates.back() ].SRTT > slowest ) {
+      candidates.pop_back();
+    }
+
+    /* smooth weighted round robin */
+    std::vector< double > credit( candidates.size(), 0 );
+    double total = 0;
+    for ( size_t i = 0; i < candidates.size(); i++ ) {
+      total += paths[ candidates[ i ] ].weight();
+    }
+    for ( size_t d = 0; d < datagrams.size(); d++ ) {
+      size_t chosen = 0;
+      for ( size_t i = 0; i < candidates.size(); i++ ) {
+	credit[ i ] += paths[ candidates[ i ] ].weight();
+	if ( credit[ i ] > credit[ chosen ] ) {
+	  chosen = i;
+	}
+      }
+      credit[ chosen ] -= total;
+      per_path[ candidates[ chosen ] ].push_back( datagrams[ d ] );
+    }
+    break;
+  }
+  }
+
+  return per_path;
+}
+
+Path &Connection::main_path( void )
+{
+  assert( !paths.empty() );
+
+  if ( server ) {
+    for ( std::vector< Path >::iterator it = paths.begin(); it != paths.end(); it++ ) {
+      if ( it->reaches( remote_addr, remote_addr_len ) ) {
+	return *it;
+      }
+    }
+  }
+
+  return paths.front();
+}
+
+Path *Connection::find_path( int sock_received, const Addr &addr, socklen_t addr_len )
+{
+  for ( std::vector< Path >::iterator it = paths.begin(); it != paths.end(); it++ ) {
+    if ( server ? it->reaches( addr, addr_len ) : it->fd == sock_received ) {
+      return &*it;
+    }
+  }
+
+  if ( !server && !paths.empty() ) { /* any of the main sockets, old or new */
+    return &paths.front();
+  }
+
+  return NULL;
+}
+
+size_t Connection::stalest_path( void ) const
+{
+  size_t stalest = 0;
+  for ( size_t i = 1; i < paths.size(); i++ ) {
+    if ( paths[ i ].last_heard < paths[ stalest ].last_heard ) {
+      stalest = i;
+    }
+  }
+  return stalest;
+}
+
+void Connection::set_remote_paths( unsigned int count )
+{
+  remote_paths = std::min( std::max( count, 1u ), MAX_PATHS );
+}
+
+void Connection::add_path( const char *local_ip )
+{
+  assert( !server );
+
+  if ( paths.size() >= MAX_PATHS ) {
+    throw NetworkException( "Too many paths", 0 );
+  }
+
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof( hints ) );
+  hints.ai_family = remote_addr.sa.sa_family;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+  AddrInfo ai( local_ip, "0", &hints );
+
+  path_socks.push_back( Socket( remote_addr.sa.sa_family ) );
+  if ( bind( path_socks.back().fd(), ai.res->ai_addr, ai.res->ai_addrlen ) < 0 ) {
+    int saved_errno = errno;
+    path_socks.pop_back();
+    throw NetworkException( std::string( "bind " ) + local_ip, saved_errno );
+  }
+
+  paths.push_back( Path( remote_addr, remote_addr_len, path_socks.back().fd() ) );
+}
+
+void Connection::add_candidate( const char *ip, const char *port )
+{
+  assert( !server );
+
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof( hints ) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  AddrInfo ai( ip, port, &hints );
+  fatal_assert( static_cast<size_t>( ai.res->ai_addrlen ) <= sizeof( Addr ) );
+  Addr addr;
+  memcpy( &addr.sa, ai.res->ai_addr, ai.res->ai_addrlen );
+
+  candidate_socks.push_back( Socket( addr.sa.sa_family ) );
+  const uint64_t start = last_port_choice + CANDIDATE_DELAY * ( candidates.size() + 1 );
+  candidates.push_back( Candidate( Path( addr, ai.res->ai_addrlen, candidate_socks.back().fd() ), start ) );
+}
+
+/* Happy eyeballs: the first address goes first, and each of the rest
+   joins in when its turn comes, starting with the datagrams last sent
+   so that it need not wait for the next retransmission */
+void Connection::start_candidates( void )
+{
+  const uint64_t now = timestamp();
+  std::vector< Datagram > backlog;
+  for ( size_t i = 0; i < candidate_backlog.size(); i++ ) {
+    backlog.push_back( Datagram( candidate_backlog[ i ].first, candidate_backlog[ i ].second ) );
+  }
+
+  for ( size_t i = 0; i < candidates.size(); i++ ) {
+    if ( !candidates[ i ].started && now >= candidates[ i ].start ) {
+      candidates[ i ].started = true;
+      send_candidate( backlog, candidates[ i ], TRAFFIC_INTERACTIVE );
+    }
+  }
+}
+
+int Connection::candidate_wait_time( void ) const
+{
+  const uint64_t now = timestamp();
+  int wait = INT_MAX;
+  for ( size_t i = 0; i < candidates.size(); i++ ) {
+    if ( !candidates[ i ].started ) {
+      wait = std::min( wait, candidates[ i ].start > now ? int( candidates[ i ].start - now ) : 0 );
+    }
+  }
+  return wait;
+}
+
+/* An address that doesn't work may well refuse the datagrams outright;
+   that is no reason to complain while another may yet answer */
+void Connection::send_candidate( const std::vector< Datagram > & datagrams, Candidate &candidate, TrafficClass traffic )
+{
+  for ( size_t start = 0; start < datagrams.size(); start += SEND_BATCH ) {
+    const int count = std::min( datagrams.size() - start, size_t( SEND_BATCH ) );
+
+    if ( !send_batch( &datagrams[ start ], count, candidate.path, traffic ) ) {
+      break;
+    }
+  }
+}
+
+/* The first authenticated datagram settles the race. If it came to a
+   candidate's socket, that address and socket become the main path. */
+void Connection::commit_candidate( int sock_received )
+{
+  for ( size_t i = 0; i < candidates.size(); i++ ) {
+    if ( candidates[ i ].path.fd == sock_received ) {
+      const Path &winner = candidates[ i ].path;
+      for ( std::vector< Path >::iterator it = paths.begin(); it != paths.end(); it++ ) {
+	if ( it->remote_addr.sa.sa_family == winner.remote_addr.sa.sa_family || it->fd == -1 ) {
+	  it->remote_addr = winner.remote_addr;
+	  it->remote_addr_len = winner.remote_addr_len;
+	}
+      }
+      remote_addr = winner.remote_addr;
+      remote_addr_len = winner.remote_addr_len;
+      socks.push_back( candidate_socks[ i ] );
+      bindings++;
+      last_port_choice = timestamp();
+      set_MTU( remote_addr.sa.sa_family );
+      break;
+    }
+  }
+
+  candidates.clear();
+  candidate_socks.clear();
+  candidate_backlog.clear();
+}
+
+/* A probe goes out with the don't-fragment bit set, so that it either
+   arrives whole or not at all. The rest of the traffic may still be
+   fragmented, in case the path shrinks. Padded out, it is no longer
+   interactive, and goes in the class of the fragments it measures for. */
+void Connection::send_probe( const Datagram & probe, int size )
+{
+  if ( !has_remote_addr ) {
+    return;
+  }
+
+  if ( !set_dont_fragment( true ) ) {
+    path_mtu.disable();
+    return;
+  }
+
+  bool sent = send_batch( &probe, 1, main_path(), TRAFFIC_BULK );
+  int saved_errno = errno;
+  set_dont_fragment( false );
+
+  if ( sent ) {
+    path_mtu.probe_sent( size, timestamp() );
+  } else if ( saved_errno == EMSGSIZE ) {
+    path_mtu.probe_refused( size );
+  } else {
+    send_error = "sendmsg: ";
+    send_error += strerror( saved_errno );
+  }
+}
+
+bool Connection::set_dont_fragment( bool dont_fragment )
+{
+  bool ok = false;
+
+#if defined( HAVE_IP_MTU_DISCOVER ) && defined( IP_PMTUDISC_PROBE )
+  /* also covers IPv4-mapped addresses on an IPv6 socket */
+  int flag = dont_fragment ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+  ok = setsockopt( sock(), IPPROTO_IP, IP_MTU_DISCOVER, &flag, sizeof flag ) == 0;
+#elif defined( IP_DONTFRAG )
+  int flag = dont_fragment;
+  ok = setsockopt( sock(), IPPROTO_IP, IP_DONTFRAG, &flag, sizeof flag ) == 0;
+#endif
+
+  if ( remote_addr.sa.sa_family == AF_INET6 ) {
+#ifdef IPV6_DONTFRAG
+    int v6flag = dont_fragment;
+    ok = setsockopt( sock(), IPPROTO_IPV6, IPV6_DONTFRAG, &v6flag, sizeof v6flag ) == 0;
+#else
+    ok = false;
+#endif
+  }
+
+  return ok;
+}
+
+bool Connection::send_batch( const Datagram *datagrams, int count, Path &path, TrafficClass traffic )
+{
+  const int fd = path.fd == -1 ? sock() : path.fd;
+
+  std::vector< Nonce > nonces;
+  nonces.reserve( count );
+  struct iovec iovecs[ SEND_BATCH ][ 2 ];
+  struct msghdr headers[ SEND_BATCH ];
+  size_t lengths[ SEND_BATCH ];
+
+  /* the traffic class goes along with each datagram, as IP_TOS or
+     IPV6_TCLASS ancillary data, keeping the ECN bits */
+  const int family = path.remote_addr.sa.sa_family;
+  const int tos = ( traffic_dscp[ traffic ] << 2 ) | ECN_ECT;
+  union {
+    char buf[ CMSG_SPACE( sizeof( int ) ) ];
+    struct cmsghdr align;
+  } control[ SEND_BATCH ];
+  bool marked = traffic_marking;
+#ifndef IPV6_TCLASS
+  marked = marked && family == AF_INET;
+#endif
+
+  for ( int i = 0; i < count; i++ ) {
+    const Datagram &datagram = datagrams[ i ];
+    Packet px = new_packet( string(), path );
+    nonces.push_back( px.nonce() );
+    const string timestamps = px.timestamps();
+
+    struct iovec plaintext[ 3 ];
+    plaintext[ 0 ].iov_base = const_cast<char *>( timestamps.data() );
+    plaintext[ 0 ].iov_len = timestamps.size();
+    plaintext[ 1 ].iov_base = const_cast<char *>( datagram.header.data() );
+    plaintext[ 1 ].iov_len = datagram.header.size();
+    plaintext[ 2 ].iov_base = const_cast<char *>( datagram.payload->data() );
+    plaintext[ 2 ].iov_len = datagram.payload->size();
+
+    char *ciphertext = send_buffer.data() + i * Session::RECEIVE_MTU;
+    size_t ciphertext_len = session.encrypt( nonces.back(), plaintext, 3, ciphertext );
+
+    iovecs[ i ][ 0 ].iov_base = const_cast<char *>( nonces.back().cc_data() );
+    iovecs[ i ][ 0 ].iov_len = Nonce::CC_LEN;
+    iovecs[ i ][ 1 ].iov_base = ciphertext;
+    iovecs[ i ][ 1 ].iov_len = ciphertext_len;
+    lengths[ i ] = Nonce::CC_LEN + ciphertext_len;
+
+    memset( &headers[ i ], 0, sizeof( headers[ i ] ) );
+    headers[ i ].msg_name = &path.remote_addr.sa;
+    headers[ i ].msg_namelen = path.remote_addr_len;
+    headers[ i ].msg_iov = iovecs[ i ];
+    headers[ i ].msg_iovlen = 2;
+
+    if ( marked ) {
+      memset( control[ i ].buf, 0, sizeof( control[ i ].buf ) );
+      headers[ i ].msg_control = control[ i ].buf;
+      headers[ i ].msg_controllen = sizeof( control[ i ].buf );
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR( &headers[ i ] );
+#ifdef IPV6_TCLASS
+      if ( family == AF_INET6 ) {
+	cmsg->cmsg_level = IPPROTO_IPV6;
+	cmsg->cmsg_type = IPV6_TCLASS;
+      } else
+#endif
+      {
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type = IP_TOS;
+      }
+      cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+      memcpy( CMSG_DATA( cmsg ), &tos, sizeof( int ) );
+    }
+  }
+
+  int sent = 0;
+  ssize_t bytes_sent = 0;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr messages[ SEND_BATCH ];
+  for ( int i = 0; i < count; i++ ) {
+    messages[ i ].msg_hdr = headers[ i ];
+    messages[ i ].msg_len = 0;
+  }
+
+  /* sendmmsg() stops at the first datagram that fails */
+  while ( sent < count ) {
+    int n = sendmmsg( fd, messages + sent, count - sent, MSG_DONTWAIT );
+    if ( n <= 0 ) {
+      bytes_sent = -1;
+      break;
+    }
+    sent += n;
+    bytes_sent = messages[ sent - 1 ].msg_len;
+    if ( bytes_sent != static_cast<ssize_t>( lengths[ sent - 1 ] ) ) {
+      break;
+    }
+  }
+#else
+  for ( ; sent < count; sent++ ) {
+    bytes_sent = sendmsg( fd, &headers[ sent ], MSG_DONTWAIT );
+    if ( bytes_sent != static_cast<ssize_t>( lengths[ sent ] ) ) {
+      break;
+    }
+  }
+#endif
+
+  path.datagrams_sent += sent;
+
+  /* a system that won't take the class with the datagram refuses it;
+     send the rest unmarked from now on */
+  if ( marked && sent < count && bytes_sent < 0 && errno == EINVAL ) {
+    traffic_marking = false;
+    return send_batch( datagrams + sent, count - sent, path, traffic );
+  }
+
+  return sent == count && bytes_sent == static_cast<ssize_t>( lengths[ count - 1 ] );
+}
+
+std::vector< string > Connection::recv( void )
 {
   assert( !socks.empty() );
+  receive_times.clear();
+
+  /* the extra paths first, so that if they had something we need not
+     wait on the main socket */
+  std::vector< string > payloads;
+  for ( std::deque< Socket >::const_iterator it = path_socks.begin();
+	it != path_socks.end();
+	it++ ) {
+    try {
+      std::vector< string > batch = recv_batch( it->fd(), true );
+      payloads.insert( payloads.end(), batch.begin(), batch.end() );
+    } catch ( NetworkException & e ) {
+      if ( (e.the_errno != EAGAIN)
+	   && (e.the_errno != EWOULDBLOCK) ) {
+	throw;
+      }
+    }
+  }
+
+  /* an answer on a candidate's socket settles the race and closes the
+     rest, so go by descriptor rather than over the sockets themselves */
+  std::vector< int > candidate_fds;
+  for ( size_t i = 0; i < candidate_socks.size(); i++ ) {
+    candidate_fds.push_back( candidate_socks[ i ].fd() );
+  }
+  for ( size_t i = 0; i < candidate_fds.size() && racing(); i++ ) {
+    try {
+      std::vector< string > batch = recv_batch( candidate_fds[ i ], true );
+      payloads.insert( payloads.end(), batch.begin(), batch.end() );
+    } catch ( NetworkException & e ) {
+      if ( (e.the_errno != EAGAIN)
+	   && (e.the_errno != EWOULDBLOCK) ) {
+	throw;
+      }
+    }
+  }
+
   for ( std::deque< Socket >::const_iterator it = socks.begin();
 	it != socks.end();
 	it++ ) {
     bool islast = (it + 1) == socks.end();
-    string payload;
+    bool blocking = islast && payloads.empty();
+    std::vector< string > batch;
     try {
-      payload = recv_one( it->fd(), !islast );
+      batch = recv_batch( it->fd(), !blocking );
     } catch ( NetworkException & e ) {
       if ( (e.the_errno == EAGAIN)
 	   || (e.the_errno == EWOULDBLOCK) ) {
-	assert( !islast );
+	assert( !blocking );
 	continue;
       } else {
 	throw;
@@ -457,97 +1092,213 @@ string Connection::recv( void )
     }
 
     /* succeeded */
+    payloads.insert( payloads.end(), batch.begin(), batch.end() );
     prune_sockets();
-    return payload;
+    break;
   }
-  assert( false );
-  return "";
+
+  return payloads;
 }
 
-string Connection::recv_one( int sock_to_recv, bool nonblocking )
+/* Read every datagram waiting, up to a batch, in one system call where
+   recvmmsg() is available */
+std::vector< string > Connection::recv_batch( int sock_to_recv, bool nonblocking )
 {
   /* receive source address, ECN, and payload in msghdr structure */
-  Addr packet_remote_addr;
-  struct msghdr header;
-  struct iovec msg_iovec;
+  Addr packet_remote_addr[ RECV_BATCH ];
+  struct msghdr headers[ RECV_BATCH ];
+  struct iovec msg_iovec[ RECV_BATCH ];
+
+  const size_t control_len = 256;
+  char msg_control[ RECV_BATCH ][ control_len ];
+
+  for ( int i = 0; i < RECV_BATCH; i++ ) {
+    /* receive source address */
+    headers[ i ].msg_name = &packet_remote_addr[ i ];
+    headers[ i ].msg_namelen = sizeof packet_remote_addr[ i ];
+
+    /* receive payload */
+    msg_iovec[ i ].iov_base = recv_buffer.data() + i * Session::RECEIVE_MTU;
+    msg_iovec[ i ].iov_len = Session::RECEIVE_MTU;
+    headers[ i ].msg_iov = &msg_iovec[ i ];
+    headers[ i ].msg_iovlen = 1;
+
+    /* receive explicit congestion notification */
+    headers[ i ].msg_control = msg_control[ i ];
+    headers[ i ].msg_controllen = control_len;
+
+    /* receive flags */
+    headers[ i ].msg_flags = 0;
+  }
 
-  char msg_payload[ Session::RECEIVE_MTU ];
-  char msg_control[ Session::RECEIVE_MTU ];
+  size_t received_len[ RECV_BATCH ];
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr messages[ RECV_BATCH ];
+  for ( int i = 0; i < RECV_BATCH; i++ ) {
+    messages[ i ].msg_hdr = headers[ i ];
+    messages[ i ].msg_len = 0;
+  }
 
-  /* receive source address */
-  header.msg_name = &packet_remote_addr;
-  header.msg_namelen = sizeof packet_remote_addr;
+  /* block, if asked to, only for the first */
+  int received = recvmmsg( sock_to_recv, messages, RECV_BATCH, nonblocking ? MSG_DONTWAIT : MSG_WAITFORONE, NULL );
 
-  /* receive payload */
-  msg_iovec.iov_base = msg_payload;
-  msg_iovec.iov_len = sizeof msg_payload;
-  header.msg_iov = &msg_iovec;
-  header.msg_iovlen = 1;
+  if ( received < 0 ) {
+    throw NetworkException( "recvmmsg", errno );
+  }
 
-  /* receive explicit congestion notification */
-  header.msg_control = msg_control;
-  header.msg_controllen = sizeof msg_control;
+  for ( int i = 0; i < received; i++ ) {
+    headers[ i ] = messages[ i ].msg_hdr;
+    received_len[ i ] = messages[ i ].msg_len;
+  }
+#else
+  ssize_t len = recvmsg( sock_to_recv, &headers[ 0 ], nonblocking ? MSG_DONTWAIT : 0 );
 
-  /* receive flags */
-  header.msg_flags = 0;
+  if ( len < 0 ) {
+    throw NetworkException( "recvmsg", errno );
+  }
 
-  ssize_t received_len = recvmsg( sock_to_recv, &header, nonblocking ? MSG_DONTWAIT : 0 );
+  int received = 1;
+  received_len[ 0 ] = len;
+#endif
 
-  if ( received_len < 0 ) {
-    throw NetworkException( "recvmsg", errno );
+  /* A datagram that fails to decrypt or is malformed is dropped without
+     losing the rest of the batch; its error is raised only if nothing
+     in the batch was good. */
+  std::vector< string > payloads;
+  for ( int i = 0; i < received; i++ ) {
+    try {
+      uint64_t received_at;
+      payloads.push_back( process_datagram( sock_to_recv, headers[ i ], received_len[ i ], headers[ i ].msg_flags & MSG_TRUNC, received_at ) );
+      receive_times.push_back( received_at );
+    } catch ( const CryptoException & e ) {
+      if ( e.fatal || ( payloads.empty() && i == received - 1 ) ) {
+	throw;
+      }
+    } catch ( const NetworkException & e ) {
+      if ( payloads.empty() && i == received - 1 ) {
+	throw;
+      }
+    }
   }
 
-  if ( header.msg_flags & MSG_TRUNC ) {
+  return payloads;
+}
+
+string Connection::process_datagram( int sock_received, struct msghdr &header, size_t received_len, bool truncated,
+				     uint64_t &received_at )
+{
+  char *msg_payload = static_cast<char *>( header.msg_iov[ 0 ].iov_base );
+
+  if ( truncated ) {
     throw NetworkException( "Received oversize datagram", errno );
   }
 
-  /* receive ECN */
+  /* receive ECN, and the kernel's receive timestamp */
   bool congestion_experienced = false;
-
-  struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( &header );
-  if ( ecn_hdr
-       && (ecn_hdr->cmsg_level == IPPROTO_IP)
-       && ((ecn_hdr->cmsg_type == IP_TOS)
+  const uint64_t now_us = timestamp_us();
+  received_at = now_us;
+
+  for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &header );
+	cmsg != NULL;
+	cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+    if ( (cmsg->cmsg_level == IPPROTO_IP)
+	 && ((cmsg->cmsg_type == IP_TOS)
 #ifdef IP_RECVTOS
-	   || (ecn_hdr->cmsg_type == IP_RECVTOS)
+	     || (cmsg->cmsg_type == IP_RECVTOS)
 #endif
-	   )) {
-    /* got one */
-    uint8_t *ecn_octet_p = (uint8_t *)CMSG_DATA( ecn_hdr );
-    assert( ecn_octet_p );
+	     )) {
+      /* got one */
+      uint8_t *ecn_octet_p = (uint8_t *)CMSG_DATA( cmsg );
+      assert( ecn_octet_p );
 
-    if ( (*ecn_octet_p & 0x03) == 0x03 ) {
-      congestion_experienced = true;
+      if ( (*ecn_octet_p & 0x03) == 0x03 ) {
+	congestion_experienced = true;
+      }
     }
+#ifdef SCM_TIMESTAMPNS
+    else if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS) ) {
+      struct timespec kernel_ts, wall;
+      memcpy( &kernel_ts, CMSG_DATA( cmsg ), sizeof( kernel_ts ) );
+      if ( clock_gettime( CLOCK_REALTIME, &wall ) == 0 ) {
+	/* the stamp is wall-clock time; carry its age over to our clock */
+	int64_t age_us = int64_t( wall.tv_sec - kernel_ts.tv_sec ) * 1000000
+	  + ( wall.tv_nsec - kernel_ts.tv_nsec ) / 1000;
+	if ( age_us > 0 && uint64_t( age_us ) < now_us ) {
+	  received_at = now_us - age_us;
+	}
+      }
+    }
+#elif defined( SCM_TIMESTAMP )
+    else if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMP) ) {
+      struct timeval kernel_tv, wall;
+      memcpy( &kernel_tv, CMSG_DATA( cmsg ), sizeof( kernel_tv ) );
+      if ( gettimeofday( &wall, NULL ) == 0 ) {
+	int64_t age_us = int64_t( wall.tv_sec - kernel_tv.tv_sec ) * 1000000
+	  + ( wall.tv_usec - kernel_tv.tv_usec );
+	if ( age_us > 0 && uint64_t( age_us ) < now_us ) {
+	  received_at = now_us - age_us;
+	}
+      }
+    }
+#endif
   }
 
   Packet p( session.decrypt( msg_payload, received_len ) );
 
   dos_assert( p.direction == (server ? TO_SERVER : TO_CLIENT) ); /* prevent malicious playback to sender */
 
-  if ( p.seq >= expected_receiver_seq ) { /* don't use out-of-order packets for timestamp or targeting */
+  if ( racing() ) {
+    commit_candidate( sock_received );
+  }
+
+  const Addr &packet_remote_addr = *static_cast<Addr *>( header.msg_name );
+  const bool in_order = p.seq >= expected_receiver_seq;
+
+  if ( in_order ) {
     expected_receiver_seq = p.seq + 1; /* this is security-sensitive because a replay attack could otherwise
 					  screw up the timestamp and targeting */
+  }
+
+  Path *path = find_path( sock_received, packet_remote_addr, header.msg_namelen );
+  if ( server && in_order && path == NULL ) { /* only in-order packets may add a path */
+    if ( paths.size() >= MAX_PATHS ) {
+      paths.erase( paths.begin() + stalest_path() );
+    }
+    paths.push_back( Path( packet_remote_addr, header.msg_namelen, -1 ) );
+    path = &paths.back();
+  }
+
+  /* Each path keeps its own order, so a slower path's datagrams still
+     count; don't use out-of-order packets for timestamp or targeting */
+  if ( path != NULL && p.seq >= path->expected_seq ) {
+    path->expected_seq = p.seq + 1;
 
     if ( p.timestamp != uint16_t(-1) ) {
-      saved_timestamp = p.timestamp;
-      saved_timestamp_received_at = timestamp();
+      path->saved_timestamp = p.timestamp;
+      path->saved_timestamp_received_at = timestamp();
 
       if ( congestion_experienced ) {
+	ecn_ce_count++;
+
 	/* signal counterparty to slow down */
 	/* this will gradually slow the counterparty down to the minimum frame rate */
-	saved_timestamp -= CONGESTION_TIMESTAMP_PENALTY;
+	path->saved_timestamp -= CONGESTION_TIMESTAMP_PENALTY;
 	if ( server ) {
 	  fprintf( stderr, "Received explicit congestion notification.\n" );
 	}
       }
     }
 
+    bool echoed = false;
     if ( p.timestamp_reply != uint16_t(-1) ) {
       uint16_t now = timestamp16();
       double R = timestamp_diff( now, p.timestamp_reply );
 
       if ( R < 5000 ) { /* ignore large values, e.g. server was Ctrl-Zed */
+	echoed = true;
+	path->RTT_sample( R );
+
+	latest_RTT = R;
 	if ( !RTT_hit ) { /* first measurement */
 	  SRTT = R;
 	  RTTVAR = R / 2;
@@ -561,27 +1312,49 @@ string Connection::recv_one( int sock_to_recv, bool nonblocking )
 	}
       }
     }
+    path->heard( timestamp(), echoed );
+
+    /* how long the datagram waited for us after the kernel had it */
+    const double alpha = 1.0 / 8.0;
+    host_delay = (1 - alpha) * host_delay + alpha * ( now_us - received_at ) / 1000.0;
 
     /* auto-adjust to remote host */
     has_remote_addr = true;
     last_heard = timestamp();
+  }
 
-    if ( server ) { /* only client can roam */
-      if ( remote_addr_len != header.msg_namelen ||
-	   memcmp( &remote_addr, &packet_remote_addr, remote_addr_len ) != 0 ) {
-	remote_addr = packet_remote_addr;
-	remote_addr_len = header.msg_namelen;
-	char host[ NI_MAXHOST ], serv[ NI_MAXSERV ];
-	int errcode = getnameinfo( &remote_addr.sa, remote_addr_len,
-				   host, sizeof( host ), serv, sizeof( serv ),
-				   NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV );
-	if ( errcode != 0 ) {
-	  throw NetworkException( std::string( "recv_one: getnameinfo: " ) + gai_strerror( errcode ), 0 );
-	}
-	fprintf( stderr, "Server now attached to client at %s:%s\n",
-		 host, serv );
+  if ( server && in_order ) { /* only client can roam */
+    /* keep as many of the client's addresses as it says it has paths */
+    const unsigned int keep = std::max( remote_paths, 1u );
+    for ( size_t i = 0; i < paths.size(); ) {
+      if ( timestamp() - paths[ i ].last_heard > SERVER_ASSOCIATION_TIMEOUT + keepalive_interval ) {
+	paths.erase( paths.begin() + i );
+      } else {
+	i++;
       }
     }
+    while ( paths.size() > keep ) {
+      paths.erase( paths.begin() + stalest_path() );
+    }
+
+    bool attached = false;
+    for ( size_t i = 0; i < paths.size(); i++ ) {
+      attached = attached || paths[ i ].reaches( remote_addr, remote_addr_len );
+    }
+    if ( !attached ) {
+      remote_addr = packet_remote_addr;
+      remote_addr_len = header.msg_namelen;
+      set_MTU( remote_addr.sa.sa_family ); /* a new path */
+      char host[ NI_MAXHOST ], serv[ NI_MAXSERV ];
+      int errcode = getnameinfo( &remote_addr.sa, remote_addr_len,
+				 host, sizeof( host ), serv, sizeof( serv ),
+				 NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV );
+      if ( errcode != 0 ) {
+	throw NetworkException( std::string( "process_datagram: getnameinfo: " ) + gai_strerror( errcode ), 0 );
+      }
+      fprintf( stderr, "Server now attached to client at %s:%s\n",
+	       host, serv );
+    }
   }
 
   return p.payload; /* we do return out-of-order or duplicated packets to caller */
@@ -634,6 +1407,24 @@ uint16_t Network::timestamp_diff( uint16_t tsnew, uint16_t tsold )
   return diff;
 }
 
+void Connection::network_RTT_sample( double R )
+{
+  uint64_t now = timestamp();
+
+  if ( !network_RTT_hit ) {
+    network_SRTT = R;
+    network_RTT_hit = true;
+  } else {
+    const double alpha = 1.0 / 8.0;
+    network_SRTT = (1 - alpha) * network_SRTT + ( alpha * R );
+  }
+
+  if ( min_RTT == 0 || R <= min_RTT || now - min_RTT_at > MIN_RTT_WINDOW ) {
+    min_RTT = R;
+    min_RTT_at = now;
+  }
+}
+
 uint64_t Connection::timeout( void ) const
 {
   uint64_t RTO = lrint( ceil( SRTT + 4 * RTTVAR ) );
@@ -718,3 +1509,31 @@ bool Connection::parse_portrange( const char * desired_port, int & desired_port_
 
   return true;
 }
+
+bool Connection::parse_traffic_classes( const char * desired_classes, int & interactive_dscp, int & bulk_dscp )
+{
+  /* parse "interactive,bulk" */
+  int dscp[ TRAFFIC_CLASSES ];
+  const char *names[ TRAFFIC_CLASSES ] = { "interactive", "bulk" };
+  const char *cp = desired_classes;
+
+  for ( int i = 0; i < TRAFFIC_CLASSES; i++ ) {
+    char *end;
+    errno = 0;
+    long value = strtol( cp, &end, 0 );
+    if ( (errno != 0) || (end == cp) || (*end != ( i + 1 < TRAFFIC_CLASSES ? ',' : '\0' )) ) {
+      fprintf( stderr, "Invalid %s DSCP (%s)\n", names[ i ], desired_classes );
+      return false;
+    }
+    if ( (value < 0) || (value > 63) ) {
+      fprintf( stderr, "%s DSCP %ld outside valid range [0..63]\n", names[ i ], value );
+      return false;
+    }
+    dscp[ i ] = (int)value;
+    cp = end + 1;
+  }
+
+  interactive_dscp = dscp[ TRAFFIC_INTERACTIVE ];
+  bulk_dscp = dscp[ TRAFFIC_BULK ];
+  return true;
+}
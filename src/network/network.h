@@ -43,13 +43,16 @@
 #include <assert.h>
 #include <exception>
 #include <string.h>
+#include <algorithm>
 
 #include "crypto.h"
+#include "pathmtu.h"
 
 using namespace Crypto;
 
 namespace Network {
   static const unsigned int MOSH_PROTOCOL_VERSION = 2; /* bumped for echo-ack */
+  static const unsigned int MOSH_COMPACT_PROTOCOL_VERSION = 3; /* compact headers, used once both ends offer them */
 
   uint64_t timestamp( void );
   uint16_t timestamp16( void );
@@ -90,6 +93,34 @@ namespace Network {
     Packet( const Message & message );
     
     Message toMessage( void );
+
+    /* what goes before the payload in the plaintext, in network order */
+    Nonce nonce( void ) const;
+    string timestamps( void ) const;
+  };
+
+  /* plaintext of an outgoing datagram, as a fragment header and the
+     fragment contents, which the caller keeps while the batch is sent;
+     copies share them */
+  class Datagram {
+  public:
+    string header;
+    const string *payload;
+
+    Datagram( const string & s_header, const string & s_payload )
+      : header( s_header ), payload( &s_payload )
+    {}
+
+    Datagram( const Datagram &other )
+      : header( other.header ), payload( other.payload )
+    {}
+
+    Datagram & operator=( const Datagram &other )
+    {
+      header = other.header;
+      payload = other.payload;
+      return *this;
+    }
   };
 
   union Addr {
@@ -99,6 +130,54 @@ namespace Network {
     struct sockaddr_storage ss;
   };
 
+  /* How Connection::send() uses the paths it has */
+  enum PathPolicy {
+    PATHS_SPREAD, /* each datagram on one of the faster paths, in proportion to what they deliver */
+    PATHS_REDUNDANT, /* each datagram on each of the fastest paths */
+    PATHS_ALL /* each datagram on every path, to keep them all measured */
+  };
+
+  /* How the network should treat a datagram, as marked in its DSCP */
+  enum TrafficClass {
+    TRAFFIC_INTERACTIVE = 0, /* acks, and frames that fit in one datagram, like a keystroke or its echo */
+    TRAFFIC_BULK = 1, /* the fragments of a larger frame, like a repaint */
+    TRAFFIC_CLASSES = 2
+  };
+
+  /* One way to reach the counterparty, from a local socket to one of
+     its addresses, and what we know of the round trip and loss on it */
+  class Path {
+  public:
+    static const uint64_t PATH_TIMEOUT = 6000; /* ms unheard before a path carries only acks */
+
+    Addr remote_addr;
+    socklen_t remote_addr_len;
+    int fd; /* -1 for the connection's main socket */
+
+    uint64_t last_heard;
+    uint64_t expected_seq; /* older datagrams along this path don't count */
+    uint16_t saved_timestamp; /* to echo back along this path */
+    uint64_t saved_timestamp_received_at;
+
+    bool RTT_hit;
+    double SRTT;
+    double RTTVAR;
+
+    uint64_t unanswered_since; /* first timestamp sent since the last echo, -1 if none */
+    double loss; /* smoothed fraction of timestamps that weren't echoed */
+    uint64_t datagrams_sent;
+
+    Path( const Addr &s_remote_addr, socklen_t s_remote_addr_len, int s_fd );
+
+    bool reaches( const Addr &addr, socklen_t addr_len ) const;
+    bool alive( uint64_t now ) const { return last_heard != uint64_t( -1 ) && now - last_heard < PATH_TIMEOUT; }
+    /* datagrams delivered per ms of round trip */
+    double weight( void ) const { return ( 1 - loss ) / std::max( SRTT, 1.0 ); }
+
+    void RTT_sample( double R );
+    void heard( uint64_t now, bool echoed );
+  };
+
   class Connection {
   private:
     /*
@@ -124,7 +203,8 @@ namespace Network {
      * dropped if tunnelled packets are 1320 bytes or larger.  Use a
      * 1280-byte IPv4 MTU for now.
      *
-     * We may have to implement ICMP-less PMTUD (RFC 4821) eventually.
+     * This is only where the search for a larger MTU starts; see
+     * PathMTU.
      */
     static const int DEFAULT_IPV4_MTU = 1280;
     /* IPv6 MTU. Use the guaranteed minimum to avoid fragmentation. */
@@ -140,10 +220,20 @@ namespace Network {
     static const unsigned int PORT_HOP_INTERVAL          = 10000;
 
     static const unsigned int MAX_PORTS_OPEN             = 10;
+    static const unsigned int MAX_PATHS                  = 4;
+    static const unsigned int REDUNDANT_PATHS            = 2;
+    static const unsigned int SPREAD_RTT_SLACK           = 10; /* ms */
     static const unsigned int MAX_OLD_SOCKET_AGE         = 60000;
+    static const unsigned int CANDIDATE_DELAY            = 250; /* ms between trying each of the server's addresses */
 
     static const int CONGESTION_TIMESTAMP_PENALTY = 500; /* ms */
 
+    /* DSCPs of the traffic classes, unless configured otherwise: AF42
+       for interactive traffic, AF11 (high-throughput data) for bulk */
+    static const int DEFAULT_INTERACTIVE_DSCP = 0x24;
+    static const int DEFAULT_BULK_DSCP = 0x0a;
+    static const int ECN_ECT = 0x02; /* ECN-capable transport, in the low bits of every mark */
+
     bool try_bind( const char *addr, int port_low, int port_high );
 
     class Socket
@@ -167,7 +257,7 @@ namespace Network {
 
     bool server;
 
-    int MTU; /* application datagram MTU */
+    PathMTU path_mtu; /* application datagram MTU */
 
     Base64Key key;
     Session session;
@@ -175,22 +265,71 @@ namespace Network {
     void setup( void );
 
     Direction direction;
-    uint16_t saved_timestamp;
-    uint64_t saved_timestamp_received_at;
     uint64_t expected_receiver_seq;
 
+    /* client: the first leads from the main socket to remote_addr;
+       server: the client's addresses heard most recently */
+    std::vector< Path > paths;
+    std::deque< Socket > path_socks; /* client: bound to extra local addresses */
+    unsigned int remote_paths; /* how many paths the counterparty uses, 0 if it hasn't said */
+
+    /* client: the server's other addresses, each tried in its turn
+       until one of them (or remote_addr) answers */
+    class Candidate {
+    public:
+      Path path;
+      uint64_t start; /* when its turn comes */
+      bool started;
+
+      Candidate( const Path &s_path, uint64_t s_start ) : path( s_path ), start( s_start ), started( false ) {}
+    };
+    std::vector< Candidate > candidates;
+    std::deque< Socket > candidate_socks;
+    /* the last datagrams sent, as header and payload, for a candidate whose turn comes */
+    std::vector< std::pair< string, string > > candidate_backlog;
+
+    void send_candidate( const std::vector< Datagram > & datagrams, Candidate &candidate, TrafficClass traffic );
+    void commit_candidate( int sock_received );
+
     uint64_t last_heard;
     uint64_t last_port_choice;
     uint64_t last_roundtrip_success; /* transport layer needs to tell us this */
+    uint64_t keepalive_interval; /* ms between heartbeats while the session idles, 0 while it's active */
+    unsigned int bindings; /* client: times it has moved to a new socket, and so a new NAT binding */
 
     bool RTT_hit;
     double SRTT;
     double RTTVAR;
+    double latest_RTT; /* most recent unsmoothed sample */
+
+    /* round trip on the wire, without either host's processing delay */
+    static const uint64_t MIN_RTT_WINDOW = 10000; /* ms to remember min RTT sample */
+    bool network_RTT_hit;
+    double network_SRTT;
+    double min_RTT;
+    uint64_t min_RTT_at;
+    double host_delay; /* smoothed ms from kernel receipt to our reading the datagram */
+
+    /* when the kernel received each datagram of the last recv(), in timestamp_us() time */
+    std::vector< uint64_t > receive_times;
 
-    /* Error from send()/sendto(). */
+    unsigned int ecn_ce_count; /* congestion-experienced datagrams received */
+
+    /* Error from send()/sendmsg(). */
     string send_error;
 
-    Packet new_packet( const string &s_payload );
+    /* each datagram marked with its class's DSCP, unless the system
+       won't take a traffic class per datagram */
+    int traffic_dscp[ TRAFFIC_CLASSES ];
+    bool traffic_marking;
+
+    /* batched I/O: datagrams per system call, and space for their ciphertexts */
+    static const int SEND_BATCH = 16;
+    static const int RECV_BATCH = 16;
+    AlignedBuffer send_buffer;
+    AlignedBuffer recv_buffer;
+
+    Packet new_packet( const string &s_payload, Path &path );
 
     void hop_port( void );
 
@@ -198,9 +337,18 @@ namespace Network {
 
     void prune_sockets( void );
 
-    string recv_one( int sock_to_recv, bool nonblocking );
+    std::vector< string > recv_batch( int sock_to_recv, bool nonblocking );
+    string process_datagram( int sock_received, struct msghdr &header, size_t received_len, bool truncated,
+			     uint64_t &received_at );
+    Path *find_path( int sock_received, const Addr &addr, socklen_t addr_len );
+    size_t stalest_path( void ) const;
+    Path &main_path( void );
+    std::vector< std::vector< Datagram > > schedule( const std::vector< Datagram > & datagrams, PathPolicy policy );
 
     void set_MTU( int family );
+    bool send_batch( const Datagram *datagrams, int count, Path &path, TrafficClass traffic );
+    void send_on_path( const std::vector< Datagram > & datagrams, Path &path, TrafficClass traffic );
+    bool set_dont_fragment( bool dont_fragment );
 
   public:
     /* Network transport overhead. */
@@ -210,9 +358,17 @@ namespace Network {
     Connection( const char *key_str, const char *ip, const char *port ); /* client */
 
     void send( const string & s );
-    string recv( void );
+    void send( const string & header, const string & payload );
+    void send( const std::vector< Datagram > & datagrams, PathPolicy policy = PATHS_SPREAD,
+	       TrafficClass traffic = TRAFFIC_INTERACTIVE );
+    /* every datagram waiting on the sockets, up to a batch each */
+    std::vector< string > recv( void );
     const std::vector< int > fds( void ) const;
-    int get_MTU( void ) const { return MTU; }
+    int get_MTU( void ) const { return path_mtu.get_MTU(); }
+
+    /* Send a path MTU probe, which may not be fragmented on the way */
+    void send_probe( const Datagram & probe, int size );
+    PathMTU &get_path_mtu( void ) { return path_mtu; }
 
     std::string port( void ) const;
     string get_key( void ) const { return key.printable_key(); }
@@ -220,6 +376,35 @@ namespace Network {
 
     uint64_t timeout( void ) const;
     double get_SRTT( void ) const { return SRTT; }
+    double get_latest_RTT( void ) const { return latest_RTT; }
+
+    /* Sample of the network round trip, in ms, from the transport's
+       microsecond timestamp echo */
+    void network_RTT_sample( double R );
+    double get_network_SRTT( void ) const { return network_RTT_hit ? network_SRTT : SRTT; }
+    double get_min_RTT( void ) const { return min_RTT; }
+    double get_host_delay( void ) const { return host_delay; }
+    const std::vector< uint64_t > & get_receive_times( void ) const { return receive_times; }
+    unsigned int get_ecn_ce_count( void ) const { return ecn_ce_count; }
+
+    /* Client: our local network has changed; move to a new socket */
+    void roam( void );
+
+    /* Client: also reach the server from this local address */
+    void add_path( const char *local_ip );
+    const std::vector< Path > &get_paths( void ) const { return paths; }
+    /* the counterparty's count of its paths; until it reports one we
+       assume it knows nothing of them and use only the main path */
+    void set_remote_paths( unsigned int count );
+    unsigned int get_remote_paths( void ) const { return remote_paths; }
+
+    /* Client: race another of the server's addresses against the
+       first, starting it CANDIDATE_DELAY after the one before, and keep
+       whichever answers first */
+    void add_candidate( const char *ip, const char *port );
+    void start_candidates( void );
+    int candidate_wait_time( void ) const;
+    bool racing( void ) const { return !candidates.empty(); }
 
     const Addr &get_remote_addr( void ) const { return remote_addr; }
     socklen_t get_remote_addr_len( void ) const { return remote_addr_len; }
@@ -231,7 +416,19 @@ namespace Network {
 
     void set_last_roundtrip_success( uint64_t s_success ) { last_roundtrip_success = s_success; }
 
+    /* While the session idles, heartbeats stretch out, and so does the
+       silence before the client hops ports or the server lets it go */
+    void set_keepalive_interval( uint64_t s_interval ) { keepalive_interval = s_interval; }
+    uint64_t get_keepalive_interval( void ) const { return keepalive_interval; }
+    unsigned int get_bindings( void ) const { return bindings; }
+
+    /* DSCP (0 to 63) to mark a traffic class with */
+    void set_traffic_class( TrafficClass traffic, int dscp ) { traffic_dscp[ traffic ] = dscp; }
+    int get_traffic_class( TrafficClass traffic ) const { return traffic_dscp[ traffic ]; }
+
     static bool parse_portrange( const char * desired_port_range, int & desired_port_low, int & desired_port_high );
+    /* parse "interactive,bulk" DSCPs, each decimal or 0x hex */
+    static bool parse_traffic_classes( const char * desired_classes, int & interactive_dscp, int & bulk_dscp );
   };
 }
 
@@ -45,13 +45,16 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
 					    const char *desired_ip, const char *desired_port )
   : connection( desired_ip, desired_port ),
     sender( &connection, initial_state ),
-    received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
+    received_states(),
     receiver_quench_timer( 0 ),
     last_receiver_state( initial_remote ),
     fragments(),
+    dictionary_num( -1 ),
+    dictionary(),
     verbose( 0 )
 {
   /* server */
+  received_states.insert( make_pair( uint64_t( 0 ), TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ) );
 }
 
 template <class MyState, class RemoteState>
@@ -59,58 +62,139 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
 					    const char *key_str, const char *ip, const char *port )
   : connection( key_str, ip, port ),
     sender( &connection, initial_state ),
-    received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
+    received_states(),
     receiver_quench_timer( 0 ),
     last_receiver_state( initial_remote ),
     fragments(),
+    dictionary_num( -1 ),
+    dictionary(),
     verbose( 0 )
 {
   /* client */
+  received_states.insert( make_pair( uint64_t( 0 ), TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ) );
 }
 
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::recv( void )
 {
-  string s( connection.recv() );
+  std::vector< string > datagrams( connection.recv() );
+  const std::vector< uint64_t > &receive_times = connection.get_receive_times();
+  sender.invalidate_timers(); /* the RTT and path MTU may have moved */
+
+  for ( size_t i = 0; i < datagrams.size(); i++ ) {
+    recv_fragment( datagrams[ i ], receive_times[ i ] );
+  }
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::recv_fragment( const string &s, uint64_t received_at )
+{
   Fragment frag( s );
 
-  if ( fragments.add_fragment( frag ) ) { /* complete packet */
-    Instruction inst = fragments.get_assembly();
+  bool complete = fragments.add_fragment( frag );
+  sender.set_fragment_loss( fragments.get_loss() );
+  sender.set_received( fragments.get_received_id(), fragments.get_received_mask() );
+
+  if ( complete ) {
+    uint64_t reference = fragments.get_reference();
+    if ( reference != uint64_t( -1 ) && reference != dictionary_num ) {
+      typename received_states_type::const_iterator dictionary_state = received_states.find( reference );
+      if ( dictionary_state != received_states.end() ) {
+	dictionary = dictionary_state->second.state.compression_dictionary();
+	dictionary_num = reference;
+      } else {
+	dictionary.clear();
+	dictionary_num = uint64_t( -1 );
+      }
+    }
+
+    Instruction inst;
+    if ( !fragments.get_assembly( inst, dictionary ) ) {
+      if ( verbose ) {
+	fprintf( stderr, "[%u] Ignoring instruction compressed against state %d, which we lack or render differently\n",
+		 (unsigned int)(timestamp() % 100000), (int)reference );
+      }
+      return;
+    }
 
-    if ( inst.protocol_version() != MOSH_PROTOCOL_VERSION ) {
+    if ( inst.protocol_version() != MOSH_PROTOCOL_VERSION
+	 && inst.protocol_version() != MOSH_COMPACT_PROTOCOL_VERSION ) {
       throw NetworkException( "mosh protocol version mismatch", 0 );
     }
 
-    sender.process_acknowledgment_through( inst.ack_num() );
+    sender.process_acknowledgment_through( inst.ack_num(), inst.ack_delay() );
+
+    if ( inst.has_received_id() ) {
+      sender.remote_received_report( inst.received_id(), inst.received_mask() );
+    }
+
+    if ( inst.has_ecn_ce() ) {
+      sender.remote_congestion( inst.ecn_ce() );
+    }
+
+    if ( inst.has_fragment_loss() ) {
+      sender.remote_fragment_loss_report( inst.fragment_loss() );
+    }
+
+    if ( inst.has_codecs() ) {
+      sender.remote_codecs_report( inst.codecs() );
+    }
+
+    if ( inst.has_max_datagram() ) {
+      sender.remote_max_datagram_report( inst.max_datagram() );
+    }
+
+    if ( inst.has_mtu_probe_ack() ) {
+      sender.mtu_probe_ack_report( inst.mtu_probe_ack() );
+    }
+
+    if ( inst.has_mtu_probe() ) {
+      sender.mtu_probe_received( inst.mtu_probe() );
+    }
+
+    if ( inst.roamed() ) {
+      sender.remote_roamed();
+    }
+
+    if ( inst.has_max_protocol_version() ) {
+      sender.remote_protocol_report( inst.max_protocol_version() );
+    }
+
+    if ( inst.has_paths() ) {
+      connection.set_remote_paths( inst.paths() );
+    }
+
+    sender.remote_keepalive_report( inst.keepalive_interval() );
+
+    if ( inst.has_timestamp_us() ) {
+      sender.remote_timestamp( inst.timestamp_us(), received_at );
+    }
+
+    if ( inst.has_timestamp_us_reply() ) {
+      /* both ends' processing is left out: ours by the kernel's receive
+	 time, the counterparty's by the hold it reports */
+      uint32_t elapsed = uint32_t( received_at ) - inst.timestamp_us_reply();
+      if ( elapsed >= inst.reply_hold_us() && elapsed - inst.reply_hold_us() < 5000000 ) {
+	connection.network_RTT_sample( ( elapsed - inst.reply_hold_us() ) / 1000.0 );
+      }
+    }
 
     /* inform network layer of roundtrip (end-to-end-to-end) connectivity */
     connection.set_last_roundtrip_success( sender.get_sent_state_acked_timestamp() );
 
     /* first, make sure we don't already have the new state */
-    for ( typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-	  i != received_states.end();
-	  i++ ) {
-      if ( inst.new_num() == i->num ) {
-	return;
-      }
+    if ( received_states.find( inst.new_num() ) != received_states.end() ) {
+      return;
     }
-    
+
     /* now, make sure we do have the old state */
-    bool found = 0;
-    typename list< TimestampedState<RemoteState> >::iterator reference_state = received_states.begin();
-    while ( reference_state != received_states.end() ) {
-      if ( inst.old_num() == reference_state->num ) {
-	found = true;
-	break;
-      }
-      reference_state++;
-    }
-    
-    if ( !found ) {
+    typename received_states_type::const_iterator reference_state = received_states.find( inst.old_num() );
+
+    if ( reference_state == received_states.end() ) {
       //    fprintf( stderr, "Ignoring out-of-order packet. Reference state %d has been discarded or hasn't yet been received.\n", int(inst.old_num) );
       return; /* this is security-sensitive and part of how we enforce idempotency */
     }
-    
+
     /* Do not accept state if our queue is full */
     /* This is better than dropping states from the middle of the
        queue (as sender does), because we don't want to ACK a state
@@ -132,7 +216,7 @@ void Transport<MyState, RemoteState>::recv( void )
     }
 
     /* apply diff to reference state */
-    TimestampedState<RemoteState> new_state = *reference_state;
+    TimestampedState<RemoteState> new_state = reference_state->second;
     new_state.timestamp = timestamp();
     new_state.num = inst.new_num();
 
@@ -141,28 +225,24 @@ void Transport<MyState, RemoteState>::recv( void )
     }
 
     /* Insert new state in sorted place */
-    for ( typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-	  i != received_states.end();
-	  i++ ) {
-      if ( i->num > new_state.num ) {
-	received_states.insert( i, new_state );
-	if ( verbose ) {
-	  fprintf( stderr, "[%u] Received OUT-OF-ORDER state %d [ack %d]\n",
-		   (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.ack_num() );
-	}
-	return;
+    typename received_states_type::iterator inserted =
+      received_states.insert( received_states.end(), make_pair( new_state.num, new_state ) );
+    if ( ++inserted != received_states.end() ) {
+      if ( verbose ) {
+	fprintf( stderr, "[%u] Received OUT-OF-ORDER state %d [ack %d]\n",
+		 (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.ack_num() );
       }
+      return;
     }
     if ( verbose ) {
       fprintf( stderr, "[%u] Received state %d [coming from %d, ack %d]\n",
 	       (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.old_num(), (int)inst.ack_num() );
     }
-    received_states.push_back( new_state );
-    sender.set_ack_num( received_states.back().num );
+    sender.set_ack_num( received_states.rbegin()->second.num );
 
     sender.remote_heard( new_state.timestamp );
     if ( !inst.diff().empty() ) {
-      sender.set_data_ack();
+      sender.set_data_ack( inst.ack_states(), inst.max_ack_delay() );
     }
   }
 }
@@ -171,15 +251,7 @@ void Transport<MyState, RemoteState>::recv( void )
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::process_throwaway_until( uint64_t throwaway_num )
 {
-  typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-  while ( i != received_states.end() ) {
-    typename list< TimestampedState<RemoteState> >::iterator inext = i;
-    inext++;
-    if ( i->num < throwaway_num ) {
-      received_states.erase( i );
-    }
-    i = inext;
-  }
+  received_states.erase( received_states.begin(), received_states.lower_bound( throwaway_num ) );
 
   fatal_assert( received_states.size() > 0 );
 }
@@ -189,17 +261,17 @@ string Transport<MyState, RemoteState>::get_remote_diff( void )
 {
   /* find diff between last receiver state and current remote state, then rationalize states */
 
-  string ret( received_states.back().state.diff_from( last_receiver_state ) );
+  string ret( received_states.rbegin()->second.state.diff_from( last_receiver_state ) );
 
-  const RemoteState *oldest_receiver_state = &received_states.front().state;
+  const RemoteState *oldest_receiver_state = &received_states.begin()->second.state;
 
-  for ( typename list< TimestampedState<RemoteState> >::reverse_iterator i = received_states.rbegin();
+  for ( typename received_states_type::reverse_iterator i = received_states.rbegin();
 	i != received_states.rend();
 	i++ ) {
-    i->state.subtract( oldest_receiver_state );
+    i->second.state.subtract( oldest_receiver_state );
   }  
 
-  last_receiver_state = received_states.back().state;
+  last_receiver_state = received_states.rbegin()->second.state;
 
   return ret;
 }
@@ -37,7 +37,9 @@
 #include <signal.h>
 #include <time.h>
 #include <list>
+#include <map>
 #include <vector>
+#include <algorithm>
 
 #include "network.h"
 #include "transportsender.h"
@@ -59,25 +61,32 @@ namespace Network {
     void process_throwaway_until( uint64_t throwaway_num );
 
     /* simple receiver */
-    list< TimestampedState<RemoteState> > received_states;
+    /* indexed by state number, so lookups, inserts and throwaways are O(log n) */
+    typedef std::map< uint64_t, TimestampedState<RemoteState> > received_states_type;
+    received_states_type received_states;
     uint64_t receiver_quench_timer;
     RemoteState last_receiver_state; /* the state we were in when user last queried state */
     FragmentAssembly fragments;
+    uint64_t dictionary_num; /* received state the cached dictionary renders, -1 if none */
+    string dictionary;
     unsigned int verbose;
 
+    void recv_fragment( const string &s, uint64_t received_at );
+
   public:
     Transport( MyState &initial_state, RemoteState &initial_remote,
 	       const char *desired_ip, const char *desired_port );
     Transport( MyState &initial_state, RemoteState &initial_remote,
 	       const char *key_str, const char *ip, const char *port );
 
-    /* Send data or an ack if necessary. */
-    void tick( void ) { sender.tick(); }
+    /* Send data or an ack if necessary, and to any of the server's
+       other addresses whose turn has come. */
+    void tick( void ) { connection.start_candidates(); sender.tick(); }
 
     /* Returns the number of ms to wait until next possible event. */
-    int wait_time( void ) { return sender.wait_time(); }
+    int wait_time( void ) { return std::min( sender.wait_time(), connection.candidate_wait_time() ); }
 
-    /* Blocks waiting for a packet. */
+    /* Blocks waiting for a packet, then handles every one waiting. */
     void recv( void );
 
     /* Find diff between last receiver state and current remote state, then rationalize states. */
@@ -100,9 +109,9 @@ namespace Network {
     MyState &get_current_state( void ) { return sender.get_current_state(); }
     void set_current_state( const MyState &x ) { sender.set_current_state( x ); }
 
-    uint64_t get_remote_state_num( void ) const { return received_states.back().num; }
+    uint64_t get_remote_state_num( void ) const { return received_states.rbegin()->second.num; }
 
-    const TimestampedState<RemoteState> & get_latest_remote_state( void ) const { return received_states.back(); }
+    const TimestampedState<RemoteState> & get_latest_remote_state( void ) const { return received_states.rbegin()->second; }
 
     const std::vector< int > fds( void ) const { return connection.fds(); }
 
@@ -110,12 +119,64 @@ namespace Network {
 
     void set_send_delay( int new_delay ) { sender.set_send_delay( new_delay ); }
 
+    void set_interactive( bool interactive ) { sender.set_interactive( interactive ); }
+
+    void set_output_cadence( bool writing, unsigned int quiet ) { sender.set_output_cadence( writing, quiet ); }
+
+    void set_pacing( bool pacing ) { sender.set_pacing( pacing ); }
+
+    void set_fec( bool fec ) { sender.set_fec( fec ); }
+
+    void set_partial_frames( bool partial_frames ) { sender.set_partial_frames( partial_frames ); }
+
+    /* Ask the counterparty to ack a stream of frames less often */
+    void set_ack_frequency( bool ack_frequency ) { sender.set_ack_frequency( ack_frequency ); }
+
+    void set_state_dictionary( bool state_dictionary ) { sender.set_state_dictionary( state_dictionary ); }
+
+    /* Offer compact headers, which leave out what the counterparty has
+       already heard; and pad instructions with chaff to hide their length */
+    void set_compact_header( bool compact_header ) { sender.set_compact_header( compact_header ); }
+    void set_chaff( bool chaff ) { sender.set_chaff( chaff ); }
+
+    void set_max_instruction_size( size_t size ) { fragments.set_max_instruction_size( size ); }
+
     uint64_t get_sent_state_acked_timestamp( void ) const { return sender.get_sent_state_acked_timestamp(); }
     uint64_t get_sent_state_acked( void ) const { return sender.get_sent_state_acked(); }
     uint64_t get_sent_state_last( void ) const { return sender.get_sent_state_last(); }
 
+    /* Bytes held by the states sent and not yet known to be superseded,
+       and the most they may hold before the least useful are dropped */
+    size_t get_memory_usage( void ) const { return sender.memory_usage(); }
+    void set_state_budget( size_t budget ) { sender.set_state_budget( budget ); }
+
     unsigned int send_interval( void ) const { return sender.send_interval(); }
 
+    /* Learn how long an idle session may go between heartbeats (the
+       client, behind the NAT), or follow the counterparty's lead */
+    void set_keepalive_probing( bool probing ) { sender.set_keepalive_probing( probing ); }
+    uint64_t get_keepalive_interval( void ) const { return connection.get_keepalive_interval(); }
+
+    /* DSCP (0 to 63) that marks acks and frames of one datagram, or the
+       fragments of larger frames */
+    void set_traffic_class( TrafficClass traffic, int dscp ) { connection.set_traffic_class( traffic, dscp ); }
+
+    int get_MTU( void ) const { return connection.get_MTU(); }
+    void add_path( const char *local_ip ) { connection.add_path( local_ip ); }
+    void add_candidate( const char *ip, const char *port ) { connection.add_candidate( ip, port ); }
+
+    /* Client: our local network has changed, so move to a new socket
+       and have the server answer and resend at once */
+    void local_network_changed( void ) { connection.roam(); sender.roamed(); }
+    const std::vector< Path > &get_paths( void ) const { return connection.get_paths(); }
+
+    /* Round trip as the event loop sees it, on the wire alone, its
+       recent minimum, and how long datagrams wait for us to read them */
+    double get_SRTT( void ) const { return connection.get_SRTT(); }
+    double get_network_SRTT( void ) const { return connection.get_network_SRTT(); }
+    double get_min_RTT( void ) const { return connection.get_min_RTT(); }
+    double get_host_delay( void ) const { return connection.get_host_delay(); }
+
     const Addr &get_remote_addr( void ) const { return connection.get_remote_addr(); }
     socklen_t get_remote_addr_len( void ) const { return connection.get_remote_addr_len(); }
 
@@ -0,0 +1,81 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include <math.h>
+
+#include "outputburst.h"
+
+using namespace Network;
+
+OutputBurst::OutputBurst()
+  : last_read( 0 ),
+    writing( false ),
+    gap_hit( false ),
+    gap_mean( 0 ),
+    gap_var( 0 )
+{}
+
+void OutputBurst::read( uint64_t now_us, size_t bytes, size_t capacity )
+{
+  if ( last_read && now_us >= last_read && now_us - last_read < MAX_QUIET * 1000 ) {
+    const double gap = now_us - last_read;
+    if ( !gap_hit ) {
+      gap_mean = gap;
+      gap_var = gap / 2;
+      gap_hit = true;
+    } else {
+      const double alpha = 1.0 / 8.0;
+      const double beta = 1.0 / 4.0;
+
+      gap_var = (1 - beta) * gap_var + ( beta * fabs( gap_mean - gap ) );
+      gap_mean = (1 - alpha) * gap_mean + ( alpha * gap );
+    }
+  }
+
+  last_read = now_us;
+  writing = bytes >= capacity;
+}
+
+unsigned int OutputBurst::quiet( void ) const
+{
+  if ( !gap_hit ) {
+    return DEFAULT_QUIET;
+  }
+
+  unsigned int ms = lrint( ceil( ( gap_mean + 4 * gap_var ) / 1000.0 ) );
+  if ( ms < MIN_QUIET ) {
+    ms = MIN_QUIET;
+  } else if ( ms > MAX_QUIET ) {
+    ms = MAX_QUIET;
+  }
+  return ms;
+}
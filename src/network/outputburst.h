@@ -0,0 +1,73 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef OUTPUT_BURST_HPP
+#define OUTPUT_BURST_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Network {
+  /* Predicts when an application has finished writing a screen, from
+     the cadence of the server's reads of the pty. Reads that follow
+     each other closely belong to one burst; the gaps between them,
+     smoothed like a round-trip time, say how long a silence has to
+     last before the burst is probably over. */
+  class OutputBurst {
+  private:
+    static const unsigned int MIN_QUIET = 1; /* ms */
+    static const unsigned int MAX_QUIET = 20; /* ms; a longer silence starts a new burst */
+    static const unsigned int DEFAULT_QUIET = 2; /* ms, until gaps have been measured */
+
+    uint64_t last_read; /* us, 0 if none */
+    bool writing; /* the last read filled the buffer, so more is waiting */
+
+    bool gap_hit;
+    double gap_mean; /* us between reads within a burst */
+    double gap_var;
+
+  public:
+    OutputBurst();
+
+    /* The server read this many bytes into a buffer of that size */
+    void read( uint64_t now_us, size_t bytes, size_t capacity );
+
+    /* The application is certainly still writing */
+    bool still_writing( void ) const { return writing; }
+
+    /* ms of silence after which the burst has probably ended */
+    unsigned int quiet( void ) const;
+  };
+}
+
+#endif
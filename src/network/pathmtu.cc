@@ -0,0 +1,212 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include <algorithm>
+
+#include "pathmtu.h"
+
+using namespace Network;
+
+const int PathMTU::PLATEAUS[ NUM_PLATEAUS ] = { 1500 /* Ethernet */, 9000 /* jumbo frames */ };
+
+PathMTU::PathMTU( int s_base )
+  : base( s_base ),
+    header_len( 0 ),
+    local_max( s_base ),
+    remote_max( 0 ),
+    mtu( s_base ),
+    ceiling( s_base ),
+    probe( 0 ),
+    tries( 0 ),
+    probe_sent_at( 0 ),
+    searching( false ),
+    next_search( -1 ),
+    losses( 0 )
+{
+}
+
+void PathMTU::reset( int s_base, int s_header_len, int s_local_max )
+{
+  base = s_base;
+  header_len = s_header_len;
+  local_max = s_local_max;
+  mtu = base;
+  ceiling = local_max;
+  probe = 0;
+  tries = 0;
+  searching = true;
+  next_search = -1;
+  losses = 0;
+}
+
+bool PathMTU::is_plateau( int size ) const
+{
+  for ( int i = 0; i < NUM_PLATEAUS; i++ ) {
+    if ( size == PLATEAUS[ i ] - header_len ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Try the common link MTUs first, then bisect what's left */
+int PathMTU::next_size( void ) const
+{
+  const int limit = std::min( ceiling, remote_max );
+  if ( limit <= mtu ) {
+    return 0;
+  }
+
+  for ( int i = 0; i < NUM_PLATEAUS; i++ ) {
+    const int size = PLATEAUS[ i ] - header_len;
+    if ( size > mtu && size <= limit ) {
+      return size;
+    }
+  }
+
+  if ( limit - mtu < SEARCH_GRANULARITY ) {
+    return 0;
+  }
+  return mtu + ( limit - mtu + 1 ) / 2;
+}
+
+void PathMTU::too_big( int size )
+{
+  /* confirmed one plateau and not the next: the link MTU is the plateau */
+  if ( is_plateau( size ) && is_plateau( mtu ) ) {
+    ceiling = mtu;
+  } else {
+    ceiling = std::min( ceiling, size - 1 );
+  }
+  probe = 0;
+  tries = 0;
+}
+
+int PathMTU::probe_due( uint64_t now, uint64_t probe_timeout )
+{
+  if ( !remote_max ) {
+    return 0;
+  }
+
+  if ( !searching ) {
+    if ( now < next_search ) {
+      return 0;
+    }
+    /* look for a larger MTU, in case the path has changed */
+    searching = true;
+    ceiling = local_max;
+  }
+
+  if ( probe ) {
+    if ( now < probe_sent_at + probe_timeout ) {
+      return 0;
+    }
+    if ( tries < PROBE_TRIES ) {
+      return probe;
+    }
+    too_big( probe );
+  }
+
+  int size = next_size();
+  if ( !size ) {
+    searching = false;
+    next_search = now + SEARCH_INTERVAL;
+  }
+  return size;
+}
+
+uint64_t PathMTU::next_probe_time( uint64_t probe_timeout ) const
+{
+  if ( !remote_max ) {
+    return -1;
+  } else if ( !searching ) {
+    return next_search;
+  } else if ( probe ) {
+    return probe_sent_at + probe_timeout;
+  }
+  return 0;
+}
+
+void PathMTU::probe_sent( int size, uint64_t now )
+{
+  if ( size != probe ) {
+    probe = size;
+    tries = 0;
+  }
+  tries++;
+  probe_sent_at = now;
+}
+
+void PathMTU::probe_refused( int size )
+{
+  too_big( size );
+}
+
+void PathMTU::probe_acked( int size )
+{
+  if ( probe && size == probe ) {
+    mtu = size;
+    probe = 0;
+    tries = 0;
+    losses = 0;
+  }
+}
+
+/* RFC 4821 section 7.7: repeated loss of full-sized datagrams after
+   the MTU was raised may be a black hole, so drop back and search again */
+void PathMTU::lost( void )
+{
+  if ( mtu <= base ) {
+    return;
+  }
+
+  if ( ++losses >= BLACK_HOLE_LOSSES ) {
+    ceiling = mtu - 1;
+    mtu = base;
+    probe = 0;
+    tries = 0;
+    searching = true;
+    losses = 0;
+  }
+}
+
+void PathMTU::fallback( int size )
+{
+  base = std::min( base, size );
+  mtu = size;
+  ceiling = local_max;
+  probe = 0;
+  tries = 0;
+  searching = true;
+  losses = 0;
+}
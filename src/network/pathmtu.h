@@ -0,0 +1,108 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef PATH_MTU_HPP
+#define PATH_MTU_HPP
+
+#include <stdint.h>
+
+namespace Network {
+  /* Packetization-layer path MTU discovery (RFC 4821). Searches for
+     the largest datagram the path delivers by sending padded probes
+     that may not be fragmented, and raises the MTU only once the
+     counterparty reports receiving one. Falls back to the safe size
+     when full-sized datagrams stop getting through. */
+  class PathMTU {
+  private:
+    static const unsigned int PROBE_TRIES = 3; /* unanswered probes before a size is too big */
+    static const int SEARCH_GRANULARITY = 16; /* bytes; stop bisecting when this close */
+    static const uint64_t SEARCH_INTERVAL = 600000; /* ms before looking for a larger MTU again */
+    static const unsigned int BLACK_HOLE_LOSSES = 3; /* consecutive timeouts before falling back */
+    static const int NUM_PLATEAUS = 2;
+    static const int PLATEAUS[ NUM_PLATEAUS ]; /* common link MTUs, tried before bisecting */
+
+    int base; /* safe datagram size for the path */
+    int header_len; /* IP and UDP headers, to convert link MTUs */
+    int local_max; /* largest datagram we can send or receive */
+    int remote_max; /* counterparty's receive limit, 0 if it doesn't answer probes */
+
+    int mtu; /* largest confirmed datagram size */
+    int ceiling; /* largest size not yet found too big */
+    int probe; /* size of the outstanding probe, 0 if none */
+    unsigned int tries; /* probes sent at that size */
+    uint64_t probe_sent_at;
+
+    bool searching;
+    uint64_t next_search; /* once the search has converged */
+
+    unsigned int losses; /* consecutive timeouts */
+
+    bool is_plateau( int size ) const;
+    int next_size( void ) const;
+    void too_big( int size );
+
+  public:
+    PathMTU( int s_base );
+
+    /* Start over on a new path */
+    void reset( int s_base, int s_header_len, int s_local_max );
+
+    /* Counterparty's receive limit, from its instructions */
+    void set_remote_max( int s_remote_max ) { remote_max = s_remote_max; }
+
+    int get_MTU( void ) const { return mtu; }
+
+    /* Size of probe to send now, or 0. An outstanding probe counts
+       as lost once probe_timeout ms have passed. */
+    int probe_due( uint64_t now, uint64_t probe_timeout );
+
+    /* When probe_due() will next have something, or -1 */
+    uint64_t next_probe_time( uint64_t probe_timeout ) const;
+
+    void probe_sent( int size, uint64_t now );
+    void probe_refused( int size ); /* too big for the local interface */
+    void probe_acked( int size );
+
+    /* Stop searching, for a socket that cannot forbid fragmentation */
+    void disable( void ) { local_max = ceiling = mtu; }
+
+    /* Full-sized states that timed out or got through */
+    void lost( void );
+    void delivered( void ) { losses = 0; }
+
+    /* The local stack refused a datagram of the current MTU */
+    void fallback( int size );
+  };
+}
+
+#endif
@@ -31,12 +31,17 @@
 */
 
 #include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
 
 #include "byteorder.h"
+#include "network.h"
 #include "transportfragment.h"
 #include "transportinstruction.pb.h"
 #include "compressor.h"
 #include "fatal_assert.h"
+#include "dos_assert.h"
 
 using namespace Network;
 using namespace TransportBuffers;
@@ -53,52 +58,233 @@ static string network_order_string( uint64_t host_order )
   return string( (char *)&net_int, sizeof( net_int ) );
 }
 
-string Fragment::tostring( void )
+string Fragment::tostring( void ) const
+{
+  return header() + contents;
+}
+
+string Fragment::header( void ) const
 {
   assert( initialized );
 
   string ret;
-  
-  ret += network_order_string( id );
 
   fatal_assert( !( fragment_num & 0x8000 ) ); /* effective limit on size of a terminal screen change or buffered user input */
   uint16_t combined_fragment_num = ( final << 15 ) | fragment_num;
-  ret += network_order_string( combined_fragment_num );
 
-  assert( ret.size() == frag_header_len );
+  if ( compact ) {
+    ret += network_order_string( uint16_t( compact_flag | ( is_single() ? single_flag : 0 )
+					   | ( id & compact_id_mask ) ) );
+    if ( !is_single() ) {
+      ret += network_order_string( combined_fragment_num );
+    }
+  } else {
+    fatal_assert( !( id >> 63 ) );
+    ret += network_order_string( id );
+    ret += network_order_string( combined_fragment_num );
+  }
 
-  ret += contents;
+  assert( ret.size() == header_len() );
 
   return ret;
 }
 
+size_t Fragment::header_len( void ) const
+{
+  if ( !compact ) {
+    return frag_header_len;
+  }
+  return is_single() ? single_header_len : compact_header_len;
+}
+
 Fragment::Fragment( const string &x )
-  : id( -1 ), fragment_num( -1 ), final( false ), initialized( true ),
+  : id( -1 ), fragment_num( -1 ), final( false ), compact( false ), initialized( true ),
     contents()
 {
-  fatal_assert( x.size() >= frag_header_len );
-  contents = string( x.begin() + frag_header_len, x.end() );
+  fatal_assert( x.size() >= single_header_len );
+  uint16_t data16[ 2 ];
+  memcpy( data16, x.data(), sizeof( data16[ 0 ] ) );
+  uint16_t lead = be16toh( data16[ 0 ] );
+
+  size_t len = frag_header_len;
+  if ( lead & compact_flag ) {
+    compact = true;
+    id = lead & compact_id_mask;
+    if ( lead & single_flag ) {
+      fragment_num = 0x8000;
+      len = single_header_len;
+    } else {
+      fatal_assert( x.size() >= compact_header_len );
+      memcpy( &data16[ 1 ], x.data() + sizeof( uint16_t ), sizeof( data16[ 1 ] ) );
+      fragment_num = be16toh( data16[ 1 ] );
+      len = compact_header_len;
+    }
+  } else {
+    fatal_assert( x.size() >= frag_header_len );
+    uint64_t data64;
+    memcpy( &data64, x.data(), sizeof( data64 ) );
+    memcpy( &data16[ 1 ], x.data() + sizeof( data64 ), sizeof( data16[ 1 ] ) );
+    id = be64toh( data64 );
+    fragment_num = be16toh( data16[ 1 ] );
+  }
 
-  uint64_t data64;
-  uint16_t *data16 = (uint16_t *)x.data();
-  memcpy( &data64, x.data(), sizeof( data64 ) );
-  id = be64toh( data64 );
-  fragment_num = be16toh( data16[ 4 ] );
   final = ( fragment_num & 0x8000 ) >> 15;
   fragment_num &= 0x7FFF;
+  contents = string( x.begin() + len, x.end() );
+}
+
+static void put_varint( string &out, uint64_t value )
+{
+  while ( value >= 0x80 ) {
+    out.push_back( char( ( value & 0x7F ) | 0x80 ) );
+    value >>= 7;
+  }
+  out.push_back( char( value ) );
+}
+
+static uint64_t get_varint( const string &in, size_t &offset )
+{
+  uint64_t value = 0;
+  for ( unsigned int shift = 0; shift < 64; shift += 7 ) {
+    fatal_assert( offset < in.size() );
+    uint8_t byte = in[ offset++ ];
+    value |= uint64_t( byte & 0x7F ) << shift;
+    if ( !( byte & 0x80 ) ) {
+      return value;
+    }
+  }
+  fatal_assert( false );
+  return value;
+}
+
+static uint16_t host_order_uint16( const string &x, size_t offset )
+{
+  uint16_t net_int;
+  assert( x.size() >= offset + sizeof( net_int ) );
+  memcpy( &net_int, x.data() + offset, sizeof( net_int ) );
+  return be16toh( net_int );
 }
 
 bool FragmentAssembly::add_fragment( Fragment &frag )
 {
-  /* see if this is a totally new packet */
-  if ( current_id != frag.id ) {
-    fragments.clear();
-    fragments.resize( frag.fragment_num + 1 );
-    fragments.at( frag.fragment_num ) = frag;
-    fragments_arrived = 1;
-    fragments_total = -1; /* unknown */
+  if ( frag.compact ) {
+    frag.id = extend_id( frag.id );
+  }
+  newest_id = std::max( newest_id, frag.id );
+
+  /* Fragments of several instructions can be in flight at once, and
+     reordering can interleave them, so assemble each separately. */
+  Assembly &assembly = assemblies[ frag.id ];
+  assembly.last_touched = ++fragments_added;
+
+  if ( assembly.completed ) {
+    /* duplicate, or parity we turned out not to need */
+    return false;
+  }
+
+  size_t previous_bytes = assembly.bytes;
+  assembly.compact = frag.compact;
+  bool complete = assembly.add_fragment( frag );
+  bytes += assembly.bytes - previous_bytes;
+
+  /* one instruction larger than the whole budget can't be held, and
+     would otherwise push out everything else to no end */
+  const bool within_budget = assembly.bytes <= MAX_BYTES;
+  if ( !within_budget ) {
+    bytes -= assembly.bytes;
+    assemblies.erase( frag.id );
+  }
+  dos_assert( within_budget );
+
+  assembly.feed( max_instruction_size );
+
+  if ( complete ) {
     current_id = frag.id;
- } else { /* not a new packet */
+    mark_received( frag.id );
+  }
+
+  evict( frag.id );
+
+  return complete;
+}
+
+void FragmentAssembly::mark_received( uint64_t id )
+{
+  if ( received_id == uint64_t( -1 ) ) {
+    received_id = id;
+  } else if ( id > received_id ) {
+    const uint64_t shift = id - received_id;
+    received_mask = ( shift > RECEIVED_WINDOW ) ? 0
+      : uint32_t( ( uint64_t( received_mask ) << shift ) | ( uint64_t( 1 ) << ( shift - 1 ) ) );
+    received_id = id;
+  } else if ( id < received_id && received_id - id <= RECEIVED_WINDOW ) {
+    received_mask |= uint32_t( 1 ) << ( received_id - id - 1 );
+  }
+}
+
+/* The full id nearest the newest seen with these low bits */
+uint64_t FragmentAssembly::extend_id( uint64_t low_bits ) const
+{
+  const uint64_t span = uint64_t( Fragment::compact_id_mask ) + 1;
+  uint64_t id = ( newest_id & ~uint64_t( Fragment::compact_id_mask ) ) | low_bits;
+
+  if ( id > newest_id + span / 2 && id >= span ) {
+    id -= span;
+  } else if ( id + span / 2 < newest_id ) {
+    id += span;
+  }
+
+  return id;
+}
+
+/* Drop the least recently added-to instructions, over the limits,
+   but never the one just added to, nor the one get_assembly() returns */
+void FragmentAssembly::evict( uint64_t added_id )
+{
+  while ( assemblies.size() > MAX_ASSEMBLIES || bytes > MAX_BYTES ) {
+    assemblies_type::iterator oldest = assemblies.end();
+    for ( assemblies_type::iterator i = assemblies.begin(); i != assemblies.end(); i++ ) {
+      if ( i->first != added_id && i->first != current_id
+	   && ( oldest == assemblies.end() || i->second.last_touched < oldest->second.last_touched ) ) {
+	oldest = i;
+      }
+    }
+    if ( oldest == assemblies.end() ) {
+      break;
+    }
+
+    const Assembly &assembly = oldest->second;
+    if ( !assembly.completed && assembly.fragments_arrived ) {
+      /* abandoned, so at least the fragments we never saw were lost */
+      int total = ( assembly.fragments_total != -1 ) ? assembly.fragments_total : int( assembly.fragments.size() ) + 1;
+      count_loss( total - assembly.fragments_arrived, total );
+    }
+
+    bytes -= assembly.bytes;
+    assemblies.erase( oldest );
+  }
+}
+
+bool FragmentAssembly::Assembly::add_fragment( const Fragment &frag )
+{
+  if ( frag.is_parity() ) {
+    for ( vector<Fragment>::const_iterator i = parity.begin(); i != parity.end(); i++ ) {
+      if ( i->fragment_num == frag.fragment_num ) {
+	/* make sure new version is same as what we already have */
+	assert( *i == frag );
+	return false;
+      }
+    }
+
+    fatal_assert( frag.contents.size() >= Fragment::parity_header_len );
+    parity.push_back( frag );
+    bytes += frag.contents.size();
+
+    if ( frag.final ) {
+      set_total( ( frag.fragment_num & ~Fragment::parity_flag )
+		 + host_order_uint16( frag.contents, 0 ) );
+    }
+  } else {
     /* see if we already have this fragment */
     if ( (fragments.size() > frag.fragment_num)
 	 && (fragments.at( frag.fragment_num ).initialized) ) {
@@ -110,15 +296,16 @@ bool FragmentAssembly::add_fragment( Fragment &frag )
       }
       fragments.at( frag.fragment_num ) = frag;
       fragments_arrived++;
+      bytes += frag.contents.size();
     }
-  }
 
-  if ( frag.final ) {
-    fragments_total = frag.fragment_num + 1;
-    assert( (int)fragments.size() <= fragments_total );
-    fragments.resize( fragments_total );
+    if ( frag.final ) {
+      set_total( frag.fragment_num + 1 );
+    }
   }
 
+  recover();
+
   if ( fragments_total != -1 ) {
     assert( fragments_arrived <= fragments_total );
   }
@@ -127,44 +314,208 @@ bool FragmentAssembly::add_fragment( Fragment &frag )
   return ( fragments_arrived == fragments_total );
 }
 
-Instruction FragmentAssembly::get_assembly( void )
+/* Hand the decompressor every fragment that now follows on from what
+   it has, so inflating keeps pace with arrival. */
+void FragmentAssembly::Assembly::feed( size_t max_output )
 {
-  assert( fragments_arrived == fragments_total );
+  while ( fed < (int)fragments.size()
+	  && fragments.at( fed ).initialized
+	  && decompressor.feed( fragments.at( fed ).contents, max_output ) ) {
+    fed++;
+  }
+}
 
-  string encoded;
+void FragmentAssembly::Assembly::set_total( int total )
+{
+  fragments_total = total;
+  assert( (int)fragments.size() <= fragments_total );
+  fragments.resize( fragments_total );
+}
+
+/* Rebuild any data fragment that is the only one missing from its parity group */
+void FragmentAssembly::Assembly::recover( void )
+{
+  for ( vector<Fragment>::const_iterator i = parity.begin(); i != parity.end(); i++ ) {
+    int first = i->fragment_num & ~Fragment::parity_flag;
+    int count = host_order_uint16( i->contents, 0 );
+
+    int missing = -1;
+    for ( int num = first; num < first + count; num++ ) {
+      if ( (int)fragments.size() <= num || !fragments.at( num ).initialized ) {
+	if ( missing != -1 ) {
+	  missing = -2; /* more than one; can't help yet */
+	  break;
+	}
+	missing = num;
+      }
+    }
+
+    if ( missing < 0 ) {
+      continue;
+    }
+
+    uint16_t length = host_order_uint16( i->contents, sizeof( uint16_t ) );
+    string contents( i->contents.begin() + Fragment::parity_header_len, i->contents.end() );
+    for ( int num = first; num < first + count; num++ ) {
+      if ( num == missing ) {
+	continue;
+      }
+
+      const string &data = fragments.at( num ).contents;
+      assert( data.size() <= contents.size() );
+      length ^= data.size();
+      for ( size_t j = 0; j < data.size(); j++ ) {
+	contents[ j ] ^= data[ j ];
+      }
+    }
+
+    assert( length <= contents.size() );
+    contents.resize( length );
+    bool final = i->final && ( missing == first + count - 1 );
+
+    if ( (int)fragments.size() < missing + 1 ) {
+      fragments.resize( missing + 1 );
+    }
+    fragments.at( missing ) = Fragment( i->id, missing, final, contents );
+    fragments_arrived++;
+    fragments_recovered++;
+    bytes += contents.size();
+
+    if ( final ) {
+      set_total( missing + 1 );
+    }
+  }
+}
 
-  for ( int i = 0; i < fragments_total; i++ ) {
-    assert( fragments.at( i ).initialized );
-    encoded += fragments.at( i ).contents;
+void FragmentAssembly::count_loss( int lost, int total )
+{
+  /* forget the past by halves, so a change in the path shows up within a few hundred fragments */
+  if ( fragments_counted > 512 ) {
+    fragments_counted /= 2;
+    fragments_lost /= 2;
   }
 
-  Instruction ret;
-  fatal_assert( ret.ParseFromString( get_compressor().uncompress_str( encoded ) ) );
+  fragments_counted += total;
+  fragments_lost += lost;
+}
 
-  fragments.clear();
-  fragments_arrived = 0;
-  fragments_total = -1;
+unsigned int FragmentAssembly::get_loss( void ) const
+{
+  if ( fragments_counted == 0 ) {
+    return 0;
+  }
 
+  return 1000 * fragments_lost / fragments_counted;
+}
+
+uint64_t FragmentAssembly::get_reference( void ) const
+{
+  assemblies_type::const_iterator completed = assemblies.find( current_id );
+  assert( completed != assemblies.end() );
+  assert( completed->second.fragments.at( 0 ).initialized );
+  return Compressor::reference_state( completed->second.fragments.at( 0 ).contents );
+}
+
+Instruction FragmentAssembly::get_assembly( void )
+{
+  Instruction ret;
+  dos_assert( get_assembly( ret, string() ) );
   return ret;
 }
 
+bool FragmentAssembly::get_assembly( Instruction &inst, const string &dictionary )
+{
+  assemblies_type::iterator completed = assemblies.find( current_id );
+  assert( completed != assemblies.end() );
+  Assembly &assembly = completed->second;
+  assert( assembly.fragments_arrived == assembly.fragments_total );
+  assert( !assembly.completed );
+
+  /* a differing dictionary is caught by its checksum before inflating */
+  const string &first = assembly.fragments.at( 0 ).contents;
+  bool usable = ( Compressor::reference_state( first ) == uint64_t( -1 ) )
+    || Compressor::dictionary_matches( first, dictionary );
+  if ( usable ) {
+    assembly.decompressor.set_dictionary( &dictionary );
+    assembly.feed( max_instruction_size );
+    assert( assembly.fed == assembly.fragments_total );
+    const string &serialized = assembly.decompressor.finish( max_instruction_size );
+    if ( assembly.compact ) {
+      size_t offset = 0;
+      uint64_t new_num = get_varint( serialized, offset );
+      uint64_t ack_num = get_varint( serialized, offset );
+      uint64_t old_num = new_num - get_varint( serialized, offset );
+      uint64_t throwaway_num = old_num - get_varint( serialized, offset );
+      fatal_assert( inst.ParseFromArray( serialized.data() + offset, serialized.size() - offset ) );
+      inst.set_protocol_version( MOSH_COMPACT_PROTOCOL_VERSION );
+      inst.set_old_num( old_num );
+      inst.set_new_num( new_num );
+      inst.set_ack_num( ack_num );
+      inst.set_throwaway_num( throwaway_num );
+    } else {
+      fatal_assert( inst.ParseFromString( serialized ) );
+    }
+  }
+
+  count_loss( assembly.fragments_recovered, assembly.fragments_total );
+
+  bytes -= assembly.bytes;
+  assembly.decompressor.clear();
+  assembly.fragments.clear();
+  assembly.parity.clear();
+  assembly.bytes = 0;
+  assembly.completed = true;
+
+  return usable;
+}
+
 bool Fragment::operator==( const Fragment &x ) const
 {
   return ( id == x.id ) && ( fragment_num == x.fragment_num ) && ( final == x.final )
     && ( initialized == x.initialized ) && ( contents == x.contents );
 }
 
-vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_t MTU )
+vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_t MTU, unsigned int parity_group,
+					     uint64_t reference_num, const string &dictionary )
 {
-  MTU -= Fragment::frag_header_len;
+  if ( dictionary.empty() || !codec_selector.remote_supports( CODEC_STATE ) ) {
+    reference_num = uint64_t( -1 );
+  }
+  bool new_instruction = false;
+
+  MTU -= compact ? Fragment::compact_header_len : Fragment::frag_header_len;
+  if ( parity_group ) {
+    MTU -= Fragment::parity_header_len;
+  }
   if ( (inst.old_num() != last_instruction.old_num())
        || (inst.new_num() != last_instruction.new_num())
        || (inst.ack_num() != last_instruction.ack_num())
        || (inst.throwaway_num() != last_instruction.throwaway_num())
        || (inst.chaff() != last_instruction.chaff())
+       || (inst.ecn_ce() != last_instruction.ecn_ce())
+       || (inst.ack_delay() != last_instruction.ack_delay())
        || (inst.protocol_version() != last_instruction.protocol_version())
-       || (last_MTU != MTU) ) {
+       || (inst.fragment_loss() != last_instruction.fragment_loss())
+       || (inst.has_fragment_loss() != last_instruction.has_fragment_loss()) /* and the other reports with it */
+       || (inst.codecs() != last_instruction.codecs())
+       || (inst.max_datagram() != last_instruction.max_datagram())
+       || (inst.mtu_probe() != last_instruction.mtu_probe())
+       || (inst.mtu_probe_ack() != last_instruction.mtu_probe_ack())
+       || (inst.timestamp_us() != last_instruction.timestamp_us())
+       || (inst.timestamp_us_reply() != last_instruction.timestamp_us_reply())
+       || (inst.reply_hold_us() != last_instruction.reply_hold_us())
+       || (inst.paths() != last_instruction.paths())
+       || (inst.max_protocol_version() != last_instruction.max_protocol_version())
+       || (last_compact != compact)
+       || (last_MTU != MTU)
+       || (last_parity_group != parity_group)
+       || (last_reference_num != reference_num) ) {
     next_instruction_id++;
+    codec_selector.update();
+    new_instruction = true;
+    if ( reference_skip ) {
+      reference_skip--;
+    }
   }
 
   if ( (inst.old_num() == last_instruction.old_num())
@@ -174,26 +525,113 @@ vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, size_t MTU
 
   last_instruction = inst;
   last_MTU = MTU;
+  last_parity_group = parity_group;
+  last_reference_num = reference_num;
+  last_compact = compact;
+
+  /* cut each fragment straight from the compressor's output */
+  const string serialized = serialize( inst );
+  size_t payload_len;
+  clock_t compress_start = clock();
+  const char *payload = get_compressor().compress( serialized, &payload_len,
+						   codec_selector.get_codec(), codec_selector.get_level() );
+  codec_selector.compressed( serialized.size(), payload_len,
+			     1e6 * double( clock() - compress_start ) / CLOCKS_PER_SEC );
+
+  /* The reference state only pays when the screen reuses its text;
+     otherwise its header makes the result larger, so keep the smaller. */
+  string plain;
+  if ( reference_num != uint64_t( -1 ) ) {
+    plain.assign( payload, payload_len );
+    size_t state_len;
+    const char *against_state = get_compressor().compress_with_state( serialized, &state_len,
+								      reference_num, dictionary );
+    if ( state_len < payload_len ) {
+      payload = against_state;
+      payload_len = state_len;
+      reference_misses = 0;
+    } else {
+      payload = plain.data();
+      if ( new_instruction ) {
+	reference_misses = std::min( reference_misses + 1, 4u );
+	reference_skip = std::min( 1u << reference_misses, MAX_REFERENCE_SKIP );
+      }
+    }
+  }
+  /* one that fits in a datagram by itself needs only the single header */
+  if ( compact && payload_len <= MTU + Fragment::compact_header_len - Fragment::single_header_len ) {
+    MTU = payload_len;
+  }
 
-  string payload = get_compressor().compress_str( inst.SerializeAsString() );
   uint16_t fragment_num = 0;
   vector<Fragment> ret;
+  ret.reserve( payload_len / MTU + 1 );
 
-  while ( !payload.empty() ) {
-    string this_fragment;
-    bool final = false;
+  for ( size_t offset = 0; offset < payload_len; offset += MTU ) {
+    size_t this_len = std::min( MTU, payload_len - offset );
+    bool final = ( offset + this_len == payload_len );
 
-    if ( payload.size() > MTU ) {
-      this_fragment = string( payload.begin(), payload.begin() + MTU );
-      payload = string( payload.begin() + MTU, payload.end() );
-    } else {
-      this_fragment = payload;
-      payload.clear();
-      final = true;
+    ret.push_back( Fragment( next_instruction_id, fragment_num++, final, string(), compact ) );
+    ret.back().contents.assign( payload + offset, this_len );
+  }
+
+  if ( parity_group == 0 || ret.size() < 2 ) {
+    return ret;
+  }
+
+  fatal_assert( ret.size() <= Fragment::parity_flag );
+
+  /* follow each group of data fragments with its parity */
+  vector<Fragment> with_parity;
+  with_parity.reserve( ret.size() + ret.size() / parity_group + 1 );
+  for ( size_t first = 0; first < ret.size(); first += parity_group ) {
+    size_t count = std::min( size_t( parity_group ), ret.size() - first );
+    uint16_t length = 0;
+    string contents;
+
+    for ( size_t i = first; i < first + count; i++ ) {
+      const string &data = ret[ i ].contents;
+      if ( contents.size() < data.size() ) {
+	contents.resize( data.size() );
+      }
+      length ^= data.size();
+      for ( size_t j = 0; j < data.size(); j++ ) {
+	contents[ j ] ^= data[ j ];
+      }
+
+      /* move, rather than copy, the data fragment */
+      with_parity.push_back( Fragment( ret[ i ].id, ret[ i ].fragment_num, ret[ i ].final, string(), compact ) );
+      with_parity.back().contents.swap( ret[ i ].contents );
     }
 
-    ret.push_back( Fragment( next_instruction_id, fragment_num++, final, this_fragment ) );
+    with_parity.push_back( Fragment( next_instruction_id, Fragment::parity_flag | first,
+				     ret[ first + count - 1 ].final,
+				     network_order_string( uint16_t( count ) )
+				     + network_order_string( length )
+				     + contents, compact ) );
   }
 
-  return ret;
+  return with_parity;
+}
+
+string Fragmenter::serialize( const Instruction &inst ) const
+{
+  if ( !compact ) {
+    return inst.SerializeAsString();
+  }
+
+  /* the differences wrap around, rather than fail, in the odd case of shutdown */
+  string ret;
+  put_varint( ret, inst.new_num() );
+  put_varint( ret, inst.ack_num() );
+  put_varint( ret, inst.new_num() - inst.old_num() );
+  put_varint( ret, inst.old_num() - inst.throwaway_num() );
+
+  Instruction rest( inst );
+  rest.clear_protocol_version();
+  rest.clear_old_num();
+  rest.clear_new_num();
+  rest.clear_ack_num();
+  rest.clear_throwaway_num();
+  return ret + rest.SerializeAsString();
 }
@@ -36,8 +36,10 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <map>
 
 #include "transportinstruction.pb.h"
+#include "compressor.h"
 
 using std::vector;
 using std::string;
@@ -49,26 +51,52 @@ namespace Network {
   public:
     static const size_t frag_header_len = sizeof( uint64_t ) + sizeof( uint16_t );
 
+    /* Once the counterparty understands it, the header is compact: a
+       16-bit word with compact_flag set, the single_flag if the
+       instruction fits in one fragment, and the low bits of the id,
+       followed, unless single, by fragment_num as in the full header.
+       Full ids never reach compact_flag, so the two can be told apart. */
+    static const uint16_t compact_flag = 0x8000;
+    static const uint16_t single_flag = 0x4000;
+    static const uint16_t compact_id_mask = 0x3FFF;
+    static const size_t compact_header_len = 2 * sizeof( uint16_t );
+    static const size_t single_header_len = sizeof( uint16_t );
+
+    /* A parity fragment has this bit set in fragment_num, along with the
+       number of the first data fragment it covers. Its contents are the
+       number of data fragments covered and the XOR of their lengths,
+       followed by the XOR of their contents. Its final bit is set if it
+       covers the final data fragment. */
+    static const uint16_t parity_flag = 0x4000;
+    static const size_t parity_header_len = 2 * sizeof( uint16_t );
+
     uint64_t id;
     uint16_t fragment_num;
     bool final;
+    bool compact; /* with the compact header; id holds only its low bits on arrival */
 
     bool initialized;
 
     string contents;
 
     Fragment()
-      : id( -1 ), fragment_num( -1 ), final( false ), initialized( false ), contents()
+      : id( -1 ), fragment_num( -1 ), final( false ), compact( false ), initialized( false ), contents()
     {}
 
-    Fragment( uint64_t s_id, uint16_t s_fragment_num, bool s_final, const string & s_contents )
-      : id( s_id ), fragment_num( s_fragment_num ), final( s_final ), initialized( true ),
-	contents( s_contents )
+    Fragment( uint64_t s_id, uint16_t s_fragment_num, bool s_final, const string & s_contents,
+	      bool s_compact = false )
+      : id( s_id ), fragment_num( s_fragment_num ), final( s_final ), compact( s_compact ),
+	initialized( true ), contents( s_contents )
     {}
 
     Fragment( const string &x );
 
-    string tostring( void );
+    string tostring( void ) const;
+    string header( void ) const;
+    size_t header_len( void ) const;
+
+    bool is_parity( void ) const { return fragment_num & parity_flag; }
+    bool is_single( void ) const { return fragment_num == 0 && final; }
 
     bool operator==( const Fragment &x ) const;
   };
@@ -76,14 +104,85 @@ namespace Network {
   class FragmentAssembly
   {
   private:
-    vector<Fragment> fragments;
-    uint64_t current_id;
-    int fragments_arrived, fragments_total;
+    static const size_t MAX_ASSEMBLIES = 8; /* instructions in progress at once */
+    static const size_t MAX_BYTES = 4 * 1048576; /* fragment contents held across them */
+    static const size_t DEFAULT_MAX_INSTRUCTION_SIZE = 2048 * 2048; /* effective limit on terminal size */
+
+    /* what has arrived of one instruction */
+    class Assembly
+    {
+    public:
+      vector<Fragment> fragments;
+      vector<Fragment> parity;
+      int fragments_arrived, fragments_total, fragments_recovered;
+      bool completed; /* kept so that late duplicates are ignored */
+      bool compact; /* the instruction's numbers come in a compact header */
+      size_t bytes;
+      uint64_t last_touched;
+      Decompressor decompressor; /* decoding while the rest arrives */
+      int fed; /* fragments handed to the decompressor */
+
+      Assembly()
+	: fragments(), parity(), fragments_arrived( 0 ), fragments_total( -1 ),
+	  fragments_recovered( 0 ), completed( false ), compact( false ), bytes( 0 ), last_touched( 0 ),
+	  decompressor(), fed( 0 )
+      {}
+
+      bool add_fragment( const Fragment &frag );
+      void set_total( int total );
+      void recover( void );
+      void feed( size_t max_output );
+    };
+
+    typedef std::map< uint64_t, Assembly > assemblies_type;
+    assemblies_type assemblies;
+    uint64_t current_id; /* most recently completed */
+    uint64_t newest_id; /* highest seen, from which compact ids are extended */
+    uint64_t fragments_added;
+    size_t bytes;
+    size_t max_instruction_size; /* decompressed, beyond which the sender is misbehaving */
+
+    /* data fragments seen and lost (or rebuilt from parity), decayed */
+    unsigned int fragments_counted, fragments_lost;
+
+    /* the newest instruction completed, -1 before one is, and a bit for
+       each of the RECEIVED_WINDOW ids before it, set if that one was */
+    uint64_t received_id;
+    uint32_t received_mask;
+
+    void evict( uint64_t added_id );
+    void count_loss( int lost, int total );
+    uint64_t extend_id( uint64_t low_bits ) const;
+    void mark_received( uint64_t id );
 
   public:
-    FragmentAssembly() : fragments(), current_id( -1 ), fragments_arrived( 0 ), fragments_total( -1 ) {}
+    static const unsigned int RECEIVED_WINDOW = 32;
+
+    FragmentAssembly()
+      : assemblies(), current_id( -1 ), newest_id( 0 ), fragments_added( 0 ), bytes( 0 ),
+	max_instruction_size( DEFAULT_MAX_INSTRUCTION_SIZE ), fragments_counted( 0 ), fragments_lost( 0 ),
+	received_id( -1 ), received_mask( -1 )
+    {}
+    /* true if this completes an instruction, which get_assembly() returns */
     bool add_fragment( Fragment &inst );
     Instruction get_assembly( void );
+
+    /* the receiver state that instruction was compressed against, or -1 */
+    uint64_t get_reference( void ) const;
+    /* With the reference state's dictionary; false, consuming the
+       instruction, if the sender compressed it against another. */
+    bool get_assembly( Instruction &inst, const string &dictionary );
+
+    /* fraction of data fragments lost in transit, in thousandths */
+    unsigned int get_loss( void ) const;
+
+    /* Which instructions have been completed, for the sender to tell a
+       lost one from one still on its way. Ids before the first are
+       taken to have arrived. */
+    uint64_t get_received_id( void ) const { return received_id; }
+    uint32_t get_received_mask( void ) const { return received_mask; }
+
+    void set_max_instruction_size( size_t size ) { max_instruction_size = size; }
   };
 
   class Fragmenter
@@ -92,15 +191,49 @@ namespace Network {
     uint64_t next_instruction_id;
     Instruction last_instruction;
     size_t last_MTU;
+    unsigned int last_parity_group;
+    uint64_t last_reference_num;
+    bool last_compact;
+    CodecSelector codec_selector;
+    bool compact; /* the receiver understands compact headers */
+
+    /* after the reference state fails to help, skip it for a while */
+    static const unsigned int MAX_REFERENCE_SKIP = 16;
+    unsigned int reference_misses;
+    unsigned int reference_skip;
 
   public:
-    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_MTU( -1 )
+    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_MTU( -1 ), last_parity_group( 0 ),
+		   last_reference_num( -1 ), last_compact( false ), codec_selector(), compact( false ),
+		   reference_misses( 0 ), reference_skip( 0 )
     {
       last_instruction.set_old_num( -1 );
       last_instruction.set_new_num( -1 );
     }
-    vector<Fragment> make_fragments( const Instruction &inst, size_t MTU );
+    /* With parity_group nonzero, an instruction that needs more than one
+       fragment is followed by a parity fragment for every parity_group
+       data fragments, so the receiver can rebuild any one lost from each.
+       With a dictionary, the rendering of receiver state reference_num,
+       the instruction is compressed against it if the receiver can decode that. */
+    vector<Fragment> make_fragments( const Instruction &inst, size_t MTU, unsigned int parity_group = 0,
+				     uint64_t reference_num = uint64_t( -1 ),
+				     const string &dictionary = string() );
     uint64_t last_ack_sent( void ) const { return last_instruction.ack_num(); }
+
+    /* The instruction as compressed: in a compact header, its state
+       numbers as varints, old_num and throwaway_num counted back from
+       the one before, with the version implied, then the rest. */
+    string serialize( const Instruction &inst ) const;
+    /* header of a datagram carrying a whole instruction */
+    size_t single_header_len( void ) const { return compact ? Fragment::single_header_len : Fragment::frag_header_len; }
+    void set_compact( bool s_compact ) { compact = s_compact; }
+    bool get_compact( void ) const { return compact; }
+    /* whether the next instruction would be compressed against a reference state */
+    bool wants_reference( void ) const { return reference_skip == 0 && codec_selector.remote_supports( CODEC_STATE ); }
+
+    /* the receiver's advertised codecs, and the link rate in bytes per ms */
+    void set_remote_codecs( unsigned int codecs ) { codec_selector.set_remote_codecs( codecs ); }
+    void set_link_rate( double rate ) { codec_selector.set_link_rate( rate ); }
   };
   
 }
@@ -41,6 +41,7 @@
 
 #include "transportsender.h"
 #include "transportfragment.h"
+#include "timestamp.h"
 
 #include <limits.h>
 
@@ -53,9 +54,12 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     current_state( initial_state ),
     sent_states( 1, TimestampedState<MyState>( timestamp(), 0, initial_state ) ),
     assumed_receiver_state( sent_states.begin() ),
+    state_budget( DEFAULT_STATE_BUDGET ),
     fragmenter(),
     next_ack_time( timestamp() ),
     next_send_time( timestamp() ),
+    next_probe_time( -1 ),
+    timers_valid_until( 0 ),
     verbose( 0 ),
     shutdown_in_progress( false ),
     shutdown_tries( 0 ),
@@ -64,16 +68,80 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     pending_data_ack( false ),
     SEND_MINDELAY( 8 ),
     last_heard( 0 ),
+    chaff( true ),
     prng(),
-    mindelay_clock( -1 )
+    mindelay_clock( -1 ),
+    interval_limited( false ),
+    interactive( false ),
+    last_change( 0 ),
+    output_writing( false ),
+    output_quiet( INTERACTIVE_QUIET ),
+    last_data_sent( 0 ),
+    last_data_heard( 0 ),
+    quick_ack( false ),
+    delivery_rate(),
+    pacing( true ),
+    paced_fragments(),
+    next_paced_send( 0 ),
+    last_frame_bytes( 0 ),
+    last_frame_rate_limited( false ),
+    fec( true ),
+    fragment_loss( 0 ),
+    remote_fragment_loss( -1 ),
+    partial_frames( false ),
+    state_dictionary( true ),
+    dictionary_num( -1 ),
+    dictionary(),
+    saved_timestamp_us( 0 ),
+    saved_timestamp_received_at( 0 ),
+    compact_header( true ),
+    report_num( -1 ),
+    report_loss( 0 ),
+    acked_loss( -1 ),
+    mtu_probe_ack( 0 ),
+    received_id( -1 ),
+    received_mask( -1 ),
+    gap_ack( false ),
+    sent_ids(),
+    tail_fragment(),
+    tail_num( 0 ),
+    tail_probed( true ),
+    next_tail_probe_time( -1 ),
+    ack_frequency( true ),
+    requested_ack_delays(),
+    data_ack_delay( ACK_DELAY ),
+    data_ack_states( 0 ),
+    unacked_data_states( 0 ),
+    keepalive_probing( false ),
+    keepalive_interval( 2 * ACK_INTERVAL ),
+    keepalive_good( ACK_INTERVAL ),
+    keepalive_bad( 0 ),
+    keepalive_probe( 0 ),
+    keepalive_answered( 0 ),
+    remote_keepalive( 0 ),
+    keepalive_bindings( 0 ),
+    last_sent( 0 ),
+    last_idle( 0 ),
+    roam_probes( 0 ),
+    roam_ack( false ),
+    doubt_before( 0 )
 {
 }
 
-/* Try to send roughly two frames per RTT, bounded by limits on frame rate */
+/* Try to send roughly two frames per RTT, bounded by limits on frame rate.
+   While frames are queuing up behind the interval and we have a bandwidth
+   estimate, allow up to four frames per propagation RTT so long as each
+   frame has drained at the pacing rate before the next. */
 template <class MyState>
 unsigned int TransportSender<MyState>::send_interval( void ) const
 {
-  int SEND_INTERVAL = lrint( ceil( connection->get_SRTT() / 2.0 ) );
+  double interval = connection->get_network_SRTT() / 2.0;
+  if ( pacing && last_frame_rate_limited && delivery_rate.has_estimate() ) {
+    interval = max( delivery_rate.get_min_rtt() / 4.0,
+		    delivery_rate.pacing_delay( last_frame_bytes, timestamp() ) );
+  }
+
+  int SEND_INTERVAL = lrint( ceil( interval ) );
   if ( SEND_INTERVAL < SEND_INTERVAL_MIN ) {
     SEND_INTERVAL = SEND_INTERVAL_MIN;
   } else if ( SEND_INTERVAL > SEND_INTERVAL_MAX ) {
@@ -89,14 +157,28 @@ void TransportSender<MyState>::calculate_timers( void )
 {
   uint64_t now = timestamp();
 
+  interval_limited = false;
+
+  if ( connection->get_bindings() != keepalive_bindings ) {
+    reset_keepalive();
+  }
+
   /* Update assumed receiver state */
   update_assumed_receiver_state();
 
   /* Cut out common prefix of all states */
   rationalize_states();
 
-  if ( pending_data_ack && (next_ack_time > now + ACK_DELAY) ) {
-    next_ack_time = now + ACK_DELAY;
+  uint64_t ack_delay = data_ack_delay;
+  if ( roam_ack ) {
+    ack_delay = 0;
+  } else if ( quick_ack || gap_ack ) {
+    ack_delay = INTERACTIVE_ACK_DELAY;
+  } else if ( data_ack_states && unacked_data_states >= data_ack_states ) {
+    ack_delay = 0;
+  }
+  if ( pending_data_ack && (next_ack_time > now + ack_delay) ) {
+    next_ack_time = now + ack_delay;
   }
 
   if ( !(current_state == sent_states.back().state) ) {
@@ -104,8 +186,35 @@ void TransportSender<MyState>::calculate_timers( void )
       mindelay_clock = now;
     }
 
-    next_send_time = max( mindelay_clock + SEND_MINDELAY,
-			  sent_states.back().timestamp + send_interval() );
+    /* In latency mode, collect output until the application has
+       probably finished drawing, rather than for a fixed delay, so a
+       frame neither waits on an idle application nor tears one that
+       is still at work. A state edited in place has nothing to wait for. */
+    uint64_t collected = mindelay_clock + SEND_MINDELAY;
+    if ( interactive ) {
+      if ( !last_change ) {
+	collected = mindelay_clock;
+      } else if ( output_writing ) {
+	collected = mindelay_clock + OUTPUT_COLLECT_MAX;
+      } else {
+	collected = min( max( mindelay_clock, last_change ) + output_quiet,
+			 mindelay_clock + OUTPUT_COLLECT_MAX );
+      }
+    }
+
+    if ( lone_change( now ) ) {
+      /* without lining up with the last ack */
+      next_send_time = collected;
+    } else {
+      next_send_time = max( collected, sent_states.back().timestamp + send_interval() );
+      /* the frame interval, not the application, is what's holding us back */
+      interval_limited = next_send_time > collected;
+    }
+
+    if ( quick_ack && pending_data_ack ) {
+      /* the frame will carry the ack; don't send it half drawn */
+      next_ack_time = max( next_ack_time, next_send_time );
+    }
   } else if ( !(current_state == assumed_receiver_state->state)
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + send_interval();
@@ -114,27 +223,106 @@ void TransportSender<MyState>::calculate_timers( void )
     }
   } else if ( !(current_state == sent_states.front().state )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
-    next_send_time = sent_states.back().timestamp + connection->timeout() + ACK_DELAY;
+    next_send_time = sent_states.back().timestamp + resend_timeout( sent_states.back().num );
   } else {
     next_send_time = uint64_t(-1);
   }
 
+  /* An idle client heartbeats at the interval it's probing; the server
+     answers so its heartbeat arrives a little before the next is due. */
+  const unsigned int heartbeat = heartbeat_interval( now );
+  if ( heartbeat ) {
+    last_idle = now;
+    connection->set_keepalive_interval( heartbeat );
+    if ( !pending_data_ack ) {
+      if ( keepalive_probing ) {
+	next_ack_time = last_sent + heartbeat;
+      } else {
+	const uint64_t lead = min( uint64_t( heartbeat / 2 ),
+				   uint64_t( connection->get_SRTT() ) + KEEPALIVE_LEAD );
+	next_ack_time = max( last_sent, last_heard ) + heartbeat - lead;
+      }
+    }
+  } else if ( connection->get_keepalive_interval() && now - last_idle >= uint64_t( ACK_INTERVAL ) ) {
+    /* keep allowing for the stretch until a round trip could have ended it */
+    connection->set_keepalive_interval( 0 );
+  }
+
+  /* roaming probes go back to back */
+  if ( roam_probes ) {
+    next_ack_time = now;
+  }
+
   /* speed up shutdown sequence */
   if ( shutdown_in_progress || (ack_num == uint64_t(-1)) ) {
     next_ack_time = sent_states.back().timestamp + send_interval();
   }
+
+  /* probe the path only while there is nothing else to send */
+  next_probe_time = uint64_t( -1 );
+  if ( !shutdown_in_progress && (current_state == assumed_receiver_state->state) ) {
+    next_probe_time = connection->get_path_mtu().next_probe_time( probe_timeout() );
+  }
+
+  /* The tail probe waits out the ack a counterparty in latency mode
+     sends a lone frame, and goes only if it beats the timeout */
+  next_tail_probe_time = uint64_t( -1 );
+  if ( !tail_probed && paced_fragments.empty() && sent_states.front().num < tail_num ) {
+    const uint64_t probe_at = last_data_sent + lrint( 1.5 * connection->get_SRTT() )
+      + ( interactive ? INTERACTIVE_ACK_DELAY : requested_ack_delay( tail_num ) );
+    const uint64_t resend_at = last_data_sent + resend_timeout( tail_num );
+    if ( probe_at + SEND_INTERVAL_MIN < resend_at ) {
+      next_tail_probe_time = probe_at;
+    }
+  }
+
+  /* Short of a change in input, all this holds until a timer comes
+     due or the oldest unacknowledged state, the frame interval since
+     the last data or the remote's last word goes stale; and while the
+     frame interval follows the pacing rate, until its gain cycle moves on. */
+  timers_valid_until = min( min( next_ack_time, next_send_time ), min( next_probe_time, next_tail_probe_time ) );
+  for ( typename sent_states_type::const_iterator i = ++sent_states.begin();
+	i != sent_states.end();
+	i++ ) {
+    uint64_t stale = i->timestamp + resend_timeout( i->num );
+    if ( stale > now ) {
+      timers_valid_until = min( timers_valid_until, stale );
+    }
+  }
+  if ( interactive && last_data_sent + send_interval() > now ) {
+    timers_valid_until = min( timers_valid_until, last_data_sent + send_interval() );
+  }
+  if ( last_heard + ACTIVE_RETRY_TIMEOUT > now ) {
+    timers_valid_until = min( timers_valid_until, last_heard + ACTIVE_RETRY_TIMEOUT );
+  }
+  const uint64_t idle_at = max( last_data_sent, last_data_heard ) + KEEPALIVE_IDLE;
+  if ( idle_at > now ) {
+    timers_valid_until = min( timers_valid_until, idle_at );
+  }
+  if ( !heartbeat && connection->get_keepalive_interval() ) {
+    timers_valid_until = min( timers_valid_until, last_idle + ACK_INTERVAL );
+  }
+  if ( pacing && last_frame_rate_limited && delivery_rate.has_estimate() ) {
+    timers_valid_until = min( timers_valid_until, delivery_rate.next_phase( now ) );
+  }
 }
 
 /* How many ms to wait until next event */
 template <class MyState>
 int TransportSender<MyState>::wait_time( void )
 {
-  calculate_timers();
+  update_timers();
 
   uint64_t next_wakeup = next_ack_time;
   if ( next_send_time < next_wakeup ) {
     next_wakeup = next_send_time;
   }
+  if ( next_probe_time < next_wakeup ) {
+    next_wakeup = next_probe_time;
+  }
+  if ( next_tail_probe_time < next_wakeup ) {
+    next_wakeup = next_tail_probe_time;
+  }
 
   uint64_t now = timestamp();
 
@@ -142,6 +330,11 @@ int TransportSender<MyState>::wait_time( void )
     return INT_MAX;
   }
 
+  /* nothing else goes out until the paced datagrams have */
+  if ( !paced_fragments.empty() ) {
+    next_wakeup = lrint( ceil( next_paced_send ) );
+  }
+
   if ( next_wakeup > now ) {
     return next_wakeup - now;
   } else {
@@ -153,24 +346,36 @@ int TransportSender<MyState>::wait_time( void )
 template <class MyState>
 void TransportSender<MyState>::tick( void )
 {
-  calculate_timers(); /* updates assumed receiver state and rationalizes */
+  update_timers(); /* updates assumed receiver state and rationalizes */
 
   if ( !connection->get_has_remote_addr() ) {
     return;
   }
 
+  if ( !paced_fragments.empty() ) {
+    send_paced_fragments();
+    if ( !paced_fragments.empty() ) {
+      return;
+    }
+  }
+
   uint64_t now = timestamp();
 
+  if ( now >= next_tail_probe_time ) {
+    send_tail_probe();
+  }
+
   if ( (now < next_ack_time)
-       && (now < next_send_time) ) {
+       && (now < next_send_time)
+       && (now < next_probe_time) ) {
     return;
   }
 
   /* Determine if a new diff or empty ack needs to be sent */
     
-  string diff = current_state.diff_from( assumed_receiver_state->state );
+  choose_reference_state();
 
-  attempt_prospective_resend_optimization( diff );
+  string diff = current_state.diff_from( assumed_receiver_state->state );
 
   if ( verbose ) {
     /* verify diff has round-trip identity (modulo Unicode fallback rendering) */
@@ -196,11 +401,35 @@ void TransportSender<MyState>::tick( void )
       next_send_time = uint64_t( -1 );
       mindelay_clock = uint64_t( -1 );
     }
+    if ( (now >= next_probe_time) ) {
+      send_mtu_probe();
+    }
   } else if ( (now >= next_send_time) || (now >= next_ack_time) ) {
     /* Send diffs or ack */
-    send_to_receiver( diff );
+    if ( !send_partial_frame( diff.size() ) ) {
+      send_to_receiver( current_state, diff );
+    }
     mindelay_clock = uint64_t( -1 );
   }
+
+  invalidate_timers();
+}
+
+/* A frame that comes alone, like a keystroke the application doesn't
+   echo, is acked promptly in latency mode; frames in a stream are acked
+   together. */
+template <class MyState>
+void TransportSender<MyState>::set_data_ack( unsigned int states, unsigned int delay )
+{
+  uint64_t now = timestamp();
+
+  quick_ack = interactive && now - last_data_heard >= uint64_t( ACK_DELAY );
+  last_data_heard = now;
+  data_ack_states = states;
+  data_ack_delay = delay ? min( delay, (unsigned int)MAX_ACK_DELAY ) : ACK_DELAY;
+  unacked_data_states++;
+  pending_data_ack = true;
+  invalidate_timers();
 }
 
 template <class MyState>
@@ -225,22 +454,110 @@ void TransportSender<MyState>::send_empty_ack( void )
   next_send_time = uint64_t(-1);
 }
 
+/* A probe is an empty ack padded out to the size being tried */
+template <class MyState>
+void TransportSender<MyState>::send_mtu_probe( void )
+{
+  uint64_t now = timestamp();
+
+  int size = connection->get_path_mtu().probe_due( now, probe_timeout() );
+  if ( !size ) {
+    return;
+  }
+
+  uint64_t new_num = sent_states.back().num + 1;
+  add_sent_state( now, new_num, current_state );
+  send_in_fragments( "", new_num, false, size );
+
+  next_ack_time = now + ACK_INTERVAL;
+}
+
 template <class MyState>
 void TransportSender<MyState>::add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state )
 {
   sent_states.push_back( TimestampedState<MyState>( the_timestamp, num, state ) );
-  if ( sent_states.size() > 32 ) { /* limit on state queue */
-    typename sent_states_type::iterator last = sent_states.end();
-    for ( int i = 0; i < 16; i++ ) { last--; }
-    sent_states.erase( last ); /* erase state from middle of queue */
+
+  /* limit on state queue, by number and by memory; each eviction
+     accounts for its own change to the usage */
+  size_t usage = memory_usage();
+  while ( sent_states.size() > MAX_SENT_STATES || usage > state_budget ) {
+    if ( verbose && sent_states.size() <= MAX_SENT_STATES ) {
+      fprintf( stderr, "[%u] %d sent states hold %d bytes, over the budget of %d\n",
+	       (unsigned int)(timestamp() % 100000), (int)sent_states.size(), (int)usage, (int)state_budget );
+    }
+    if ( !evict_sent_state( usage ) ) {
+      break;
+    }
+  }
+}
+
+template <class MyState>
+size_t TransportSender<MyState>::memory_usage( void ) const
+{
+  size_t bytes = 0;
+  for ( typename sent_states_type::const_iterator i = sent_states.begin(); i != sent_states.end(); i++ ) {
+    bytes += memory_usage( i );
   }
+
+  return bytes;
+}
+
+template <class MyState>
+size_t TransportSender<MyState>::memory_usage( typename sent_states_type::const_iterator i ) const
+{
+  typename sent_states_type::const_iterator prev = i, next = i;
+  next++;
+  return i->state.memory_usage( i == sent_states.begin() ? NULL : &(--prev)->state,
+				next == sent_states.end() ? NULL : &next->state );
 }
 
+/* Drop the state whose loss costs least: one the receiver could as
+   well be brought up from the state before, should it hold that one.
+   The known and assumed receiver states and the last sent are kept.
+   Only the victim and its neighbors change what they add to usage. */
 template <class MyState>
-void TransportSender<MyState>::send_to_receiver( const string & diff )
+bool TransportSender<MyState>::evict_sent_state( size_t &usage )
+{
+  typename sent_states_type::iterator victim = sent_states.end();
+  size_t victim_value = 0;
+
+  typename sent_states_type::iterator prev = sent_states.begin();
+  for ( typename sent_states_type::iterator i = ++sent_states.begin();
+	i != sent_states.end();
+	prev = i++ ) {
+    if ( i == assumed_receiver_state || &*i == &sent_states.back() ) {
+      continue;
+    }
+
+    size_t value = i->state.diff_size_estimate( prev->state );
+    if ( victim == sent_states.end() || value < victim_value ) {
+      victim = i;
+      victim_value = value;
+    }
+  }
+
+  if ( victim == sent_states.end() ) {
+    return false;
+  }
+
+  typename sent_states_type::iterator before = victim, after = victim;
+  before--;
+  after++;
+  usage -= memory_usage( before ) + memory_usage( victim ) + memory_usage( after );
+
+  sent_ids.erase( victim->num );
+  requested_ack_delays.erase( victim->num );
+  sent_states.erase( victim );
+
+  usage += memory_usage( before ) + memory_usage( after );
+  return true;
+}
+
+template <class MyState>
+void TransportSender<MyState>::send_to_receiver( MyState &state, const string & diff )
 {
   uint64_t new_num;
-  if ( current_state == sent_states.back().state ) { /* previously sent */
+  if ( state == sent_states.back().state ) { /* previously sent */
     new_num = sent_states.back().num;
   } else { /* new state */
     new_num = sent_states.back().num + 1;
@@ -251,13 +568,23 @@ void TransportSender<MyState>::send_to_receiver( const string & diff )
     new_num = uint64_t( -1 );
   }
 
+  bool timed_out = false;
   if ( new_num == sent_states.back().num ) {
+    if ( assumed_receiver_state->num != new_num ) {
+      /* resending after the previous attempt timed out */
+      delivery_rate.lost( timestamp() );
+      if ( last_frame_bytes >= size_t( connection->get_MTU() ) ) {
+	connection->get_path_mtu().lost();
+      }
+      timed_out = true;
+    }
     sent_states.back().timestamp = timestamp();
   } else {
-    add_sent_state( timestamp(), new_num, current_state );
+    add_sent_state( timestamp(), new_num, state );
   }
 
-  send_in_fragments( diff, new_num ); // Can throw NetworkException
+  send_in_fragments( diff, new_num, timed_out ); // Can throw NetworkException
+  last_data_sent = timestamp();
 
   /* successfully sent, probably */
   /* ("probably" because the FIRST size-exceeded datagram doesn't get an error) */
@@ -267,6 +594,62 @@ void TransportSender<MyState>::send_to_receiver( const string & diff )
   next_send_time = uint64_t(-1);
 }
 
+/* Not the round trip, which on a slow link a big frame inflates, but a
+   short time at the bottleneck rate */
+template <class MyState>
+size_t TransportSender<MyState>::partial_frame_budget( void ) const
+{
+  return max( size_t( delivery_rate.bandwidth() * PARTIAL_FRAME_TIME ),
+	      PARTIAL_FRAME_MIN );
+}
+
+/* Returns false if the whole diff should go instead */
+template <class MyState>
+bool TransportSender<MyState>::send_partial_frame( size_t diff_size )
+{
+  if ( !partial_frames || shutdown_in_progress || !delivery_rate.has_estimate() ) {
+    return false;
+  }
+
+  const size_t budget = partial_frame_budget();
+  if ( diff_size <= budget ) {
+    return false;
+  }
+
+  MyState partial( current_state );
+  if ( !partial.limit_diff( assumed_receiver_state->state, budget ) ) {
+    return false;
+  }
+
+  /* Rows already on their way would make no headway. While the last
+     frame is in flight, build on it instead. */
+  typename sent_states_type::iterator last = sent_states.end();
+  last--;
+  bool repeated = false;
+  for ( typename sent_states_type::iterator i = assumed_receiver_state; i != last; ) {
+    i++;
+    repeated = repeated || (partial == i->state);
+  }
+  if ( repeated && (timestamp() - last->timestamp < resend_timeout( last->num )) ) {
+    assumed_receiver_state = last;
+    partial = current_state;
+    if ( !partial.limit_diff( assumed_receiver_state->state, budget ) ) {
+      /* the rest fits */
+      send_to_receiver( current_state, current_state.diff_from( assumed_receiver_state->state ) );
+      return true;
+    }
+  }
+
+  string diff = partial.diff_from( assumed_receiver_state->state );
+  if ( verbose ) {
+    fprintf( stderr, "[%u] Partial frame of %d bytes, of %d in all\n",
+	     (unsigned int)(timestamp() % 100000), (int)diff.size(), (int)diff_size );
+  }
+
+  send_to_receiver( partial, diff );
+  return true;
+}
+
 template <class MyState>
 void TransportSender<MyState>::update_assumed_receiver_state( void )
 {
@@ -282,7 +665,7 @@ void TransportSender<MyState>::update_assumed_receiver_state( void )
   while ( i != sent_states.end() ) {
     assert( now >= i->timestamp );
 
-    if ( uint64_t(now - i->timestamp) < connection->timeout() + ACK_DELAY ) {
+    if ( uint64_t(now - i->timestamp) < resend_timeout( i->num ) && i->timestamp >= doubt_before ) {
       assumed_receiver_state = i;
     } else {
       return;
@@ -317,8 +700,32 @@ const string TransportSender<MyState>::make_chaff( void )
   return string( chaff, chaff_len );
 }
 
+/* Replace the chaff with enough random bytes to make the datagram
+   carrying inst exactly size bytes, assuming it goes uncompressed */
 template <class MyState>
-void TransportSender<MyState>::send_in_fragments( const string & diff, uint64_t new_num )
+void TransportSender<MyState>::pad_to( Instruction &inst, int size )
+{
+  const int payload_len = size - Network::Connection::ADDED_BYTES - Crypto::Session::ADDED_BYTES
+    - fragmenter.single_header_len() - 1 /* codec */;
+
+  inst.clear_chaff();
+  string chaff;
+  /* the chaff's length prefix grows with it, so settle in a few steps */
+  for ( int i = 0; i < 3; i++ ) {
+    int short_by = payload_len - int( fragmenter.serialize( inst ).size() );
+    if ( short_by == 0 || int( chaff.size() ) + short_by < 0 ) {
+      break;
+    }
+    chaff.resize( chaff.size() + short_by );
+    if ( !chaff.empty() ) {
+      prng.fill( &chaff[ 0 ], chaff.size() );
+    }
+    inst.set_chaff( chaff );
+  }
+}
+
+template <class MyState>
+void TransportSender<MyState>::send_in_fragments( const string & diff, uint64_t new_num, bool timed_out, int probe_size )
 {
   Instruction inst;
 
@@ -328,47 +735,401 @@ void TransportSender<MyState>::send_in_fragments( const string & diff, uint64_t
   inst.set_ack_num( ack_num );
   inst.set_throwaway_num( sent_states.front().num );
   inst.set_diff( diff );
-  inst.set_chaff( make_chaff() );
+  if ( chaff ) {
+    inst.set_chaff( make_chaff() );
+  }
+  if ( connection->get_ecn_ce_count() ) {
+    inst.set_ecn_ce( connection->get_ecn_ce_count() );
+  }
+  if ( last_heard && timestamp() > last_heard ) {
+    inst.set_ack_delay( timestamp() - last_heard );
+  }
+  if ( !fragmenter.get_compact() || acked_loss != int( fragment_loss ) ) {
+    inst.set_fragment_loss( fragment_loss );
+    inst.set_codecs( Compressor::supported_codecs() );
+    inst.set_max_datagram( Crypto::Session::RECEIVE_MTU );
+    if ( compact_header ) {
+      inst.set_max_protocol_version( MOSH_COMPACT_PROTOCOL_VERSION );
+    }
+    /* only an ack of a new state shows they arrived */
+    if ( !diff.empty() ) {
+      report_num = new_num;
+      report_loss = fragment_loss;
+    }
+  }
+
+  /* echo the counterparty's timestamp once, less the time we held it */
+  const uint64_t now_us = timestamp_us();
+  inst.set_timestamp_us( uint32_t( now_us ) );
+  if ( saved_timestamp_received_at && now_us - saved_timestamp_received_at < 1000000 ) {
+    inst.set_timestamp_us_reply( saved_timestamp_us );
+    inst.set_reply_hold_us( now_us - saved_timestamp_received_at );
+    saved_timestamp_received_at = 0;
+  }
+  if ( mtu_probe_ack ) {
+    inst.set_mtu_probe_ack( mtu_probe_ack );
+  }
+  /* frames going out back to back may be acked together */
+  if ( !diff.empty() ) {
+    requested_ack_delays[ new_num ] = ACK_DELAY;
+    if ( ack_frequency && interval_limited ) {
+      requested_ack_delays[ new_num ] = STREAM_ACK_DELAY;
+      inst.set_max_ack_delay( STREAM_ACK_DELAY );
+      inst.set_ack_states( STREAM_ACK_STATES );
+    }
+  }
+  if ( roam_probes ) {
+    inst.set_roamed( true );
+    roam_probes--;
+    invalidate_timers();
+  }
+  /* an idle heartbeat says how long until the next; the client's
+     starts a probe, settled when the next is due, unless it went out
+     on a binding we have since left */
+  if ( connection->get_bindings() != keepalive_bindings ) {
+    reset_keepalive();
+  }
+  if ( keepalive_probe && timestamp() - last_sent >= keepalive_probe ) {
+    keepalive_result();
+  }
+  keepalive_probe = 0;
+  keepalive_answered = 0;
+  if ( diff.empty() && !probe_size ) {
+    const unsigned int heartbeat = heartbeat_interval( timestamp() );
+    if ( heartbeat ) {
+      inst.set_keepalive_interval( heartbeat );
+      if ( keepalive_probing ) {
+	keepalive_probe = heartbeat;
+      }
+    }
+  }
+  if ( received_mask != uint32_t( -1 ) ) {
+    inst.set_received_id( received_id );
+    inst.set_received_mask( received_mask );
+  }
+  /* only sessions that use several paths say so, and the answer tells
+     the client the server understands them */
+  if ( connection->get_paths().size() > 1 || connection->get_remote_paths() ) {
+    inst.set_paths( connection->get_paths().size() );
+  }
+  if ( probe_size ) {
+    inst.set_mtu_probe( probe_size );
+    pad_to( inst, probe_size );
+  }
 
   if ( new_num == uint64_t(-1) ) {
     shutdown_tries++;
   }
 
-  vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU()
+  /* Compress against the newest state the receiver has acknowledged,
+     which it keeps until told otherwise. A retransmission after a
+     timeout goes without, in case the two ends render it differently. */
+  uint64_t reference_num = uint64_t( -1 );
+  if ( state_dictionary && !diff.empty() && !timed_out && fragmenter.wants_reference() ) {
+    const TimestampedState<MyState> &acked = sent_states.front();
+    if ( acked.num != dictionary_num ) {
+      dictionary = acked.state.compression_dictionary();
+      dictionary_num = acked.num;
+    }
+    reference_num = dictionary_num;
+  }
+
+  fragmenter.set_link_rate( delivery_rate.bandwidth() );
+  const int MTU = probe_size ? probe_size : connection->get_MTU();
+  vector<Fragment> fragments = fragmenter.make_fragments( inst, MTU
 							  - Network::Connection::ADDED_BYTES
-							  - Crypto::Session::ADDED_BYTES );
+							  - Crypto::Session::ADDED_BYTES,
+							  probe_size ? 0 : parity_group(), reference_num, dictionary );
+
+  uint64_t now = timestamp();
+  sent_ids[ new_num ] = fragments.front().id;
+  if ( !diff.empty() && !probe_size ) {
+    tail_fragment = fragments.back();
+    tail_num = new_num;
+    tail_probed = false;
+  }
+  size_t bytes = 0;
+  bool rate_limited = !diff.empty() && interval_limited;
+  next_paced_send = now;
+  vector<Datagram> batch;
+
   for ( vector<Fragment>::iterator i = fragments.begin();
         i != fragments.end();
         i++ ) {
-    connection->send( i->tostring() );
+    size_t datagram_size = i->header_len() + i->contents.size();
+    bytes += datagram_size + Network::Connection::ADDED_BYTES + Crypto::Session::ADDED_BYTES;
+
+    /* A frame into an idle path leaves no standing queue, so only
+       spread out the datagrams of frames that are arriving back to back. */
+    if ( pacing && rate_limited && ( i - fragments.begin() ) >= int( PACING_BURST ) ) {
+      paced_fragments.push_back( Fragment( i->id, i->fragment_num, i->final, string(), i->compact ) );
+      paced_fragments.back().contents.swap( i->contents );
+    } else {
+      batch.push_back( Datagram( i->header(), i->contents ) );
+      next_paced_send += delivery_rate.pacing_delay( datagram_size, now );
+    }
 
     if ( verbose ) {
-      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
+      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f%s\n",
 	       (unsigned int)(timestamp() % 100000), (int)inst.old_num(), (int)inst.new_num(), (int)i->id, (int)i->fragment_num,
 	       (int)inst.ack_num(), (int)inst.throwaway_num(), (int)i->contents.size(),
 	       1000.0 / (double)send_interval(),
-	       (int)connection->timeout(), connection->get_SRTT() );
+	       (int)connection->timeout(), connection->get_SRTT(),
+	       paced_fragments.empty() ? "" : " (paced)" );
     }
+  }
+
+  /* An ack goes along every path to keep each measured; a frame that
+     fits in one datagram, like a keystroke or its echo, goes along the
+     fastest two in case one drops it; a larger one is spread out, and
+     marked as bulk traffic. */
+  if ( probe_size && batch.size() == 1 ) {
+    connection->send_probe( batch.front(), probe_size );
+  } else if ( diff.empty() ) {
+    connection->send( batch, Network::PATHS_ALL );
+  } else if ( batch.size() == 1 && paced_fragments.empty() ) {
+    connection->send( batch, Network::PATHS_REDUNDANT );
+  } else {
+    connection->send( batch, Network::PATHS_SPREAD, Network::TRAFFIC_BULK );
+  }
 
+  delivery_rate.sent( new_num, now, bytes, rate_limited, connection->get_SRTT() );
+  if ( !diff.empty() ) {
+    last_frame_bytes = bytes;
+    last_frame_rate_limited = rate_limited;
   }
 
   pending_data_ack = false;
+  gap_ack = false;
+  roam_ack = false;
+  unacked_data_states = 0;
+  last_sent = now;
 }
 
+/* Data fragments per parity fragment, aiming for about one loss in ten
+   groups at the counterparty's loss rate, or 0 to send no parity */
 template <class MyState>
-void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num )
+unsigned int TransportSender<MyState>::parity_group( void ) const
+{
+  if ( !fec || remote_fragment_loss < int( FEC_MIN_LOSS ) ) {
+    return 0;
+  }
+
+  unsigned int group = 100 / remote_fragment_loss;
+  if ( group < 1 ) {
+    group = 1;
+  } else if ( group > FEC_MAX_GROUP ) {
+    group = FEC_MAX_GROUP;
+  }
+
+  return group;
+}
+
+template <class MyState>
+void TransportSender<MyState>::send_paced_fragments( void )
+{
+  uint64_t now = timestamp();
+
+  /* everything whose slot has come goes out together */
+  vector<Datagram> batch;
+  for ( typename std::deque< Fragment >::const_iterator i = paced_fragments.begin();
+	i != paced_fragments.end() && next_paced_send <= now;
+	i++ ) {
+    batch.push_back( Datagram( i->header(), i->contents ) );
+    next_paced_send += delivery_rate.pacing_delay( i->header_len() + i->contents.size(), now );
+  }
+
+  connection->send( batch, Network::PATHS_SPREAD, Network::TRAFFIC_BULK ); // Can throw NetworkException
+  paced_fragments.erase( paced_fragments.begin(), paced_fragments.begin() + batch.size() );
+}
+
+template <class MyState>
+void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num, uint64_t ack_delay )
 {
   /* Ignore ack if we have culled the state it's acknowledging */
 
   if ( sent_states.end() !=
        find_if( sent_states.begin(), sent_states.end(),
 		bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_eq ), ack_num ) ) ) {
+    if ( ack_num != sent_states.front().num ) {
+      connection->get_path_mtu().delivered();
+    }
     sent_states.remove_if( bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_lt ), ack_num ) );
+    sent_ids.erase( sent_ids.begin(), sent_ids.lower_bound( ack_num ) );
+    requested_ack_delays.erase( requested_ack_delays.begin(), requested_ack_delays.lower_bound( ack_num ) );
+    if ( report_num != uint64_t( -1 ) && ack_num >= report_num ) {
+      acked_loss = report_loss;
+      report_num = uint64_t( -1 );
+    }
+    delivery_rate.acked( ack_num, timestamp(), ack_delay, connection->get_latest_RTT() );
+    invalidate_timers();
   }
 
   assert( !sent_states.empty() );
 }
 
+/* A state whose instruction the counterparty is missing, though it
+   has one sent after it, is lost: once enough later ones have arrived
+   to rule out reordering, or enough time has passed. Aging it past the
+   timeout has it resent from a state the counterparty holds. */
+template <class MyState>
+void TransportSender<MyState>::remote_received_report( uint64_t id, uint32_t mask )
+{
+  const uint64_t now = timestamp();
+  const double reorder_time = connection->get_SRTT() * 9 / 8;
+
+  for ( typename sent_states_type::iterator i = ++sent_states.begin();
+	i != sent_states.end();
+	i++ ) {
+    typename sent_ids_type::const_iterator sent = sent_ids.find( i->num );
+    if ( sent == sent_ids.end() || sent->second >= id
+	 || id - sent->second > FragmentAssembly::RECEIVED_WINDOW ) {
+      continue;
+    }
+
+    const uint64_t distance = id - sent->second;
+    const uint64_t age = now - i->timestamp;
+    const uint64_t timeout = resend_timeout( i->num );
+    if ( ( mask & ( uint32_t( 1 ) << ( distance - 1 ) ) )
+	 || age >= timeout
+	 || ( distance < LOSS_REORDER_THRESHOLD && age < reorder_time ) ) {
+      continue;
+    }
+
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Instruction %d for state %d lost, %d later ones arrived\n",
+	       (unsigned int)(now % 100000), (int)sent->second, (int)i->num, (int)distance );
+    }
+    i->timestamp = now - timeout;
+    invalidate_timers();
+  }
+}
+
+/* The last fragment of the latest frame again. If it alone was lost,
+   the frame completes and is acked within about a round trip. */
+template <class MyState>
+void TransportSender<MyState>::send_tail_probe( void )
+{
+  tail_probed = true;
+  invalidate_timers();
+
+  if ( verbose ) {
+    fprintf( stderr, "[%u] Tail probe, id %d frag %d for state %d\n",
+	     (unsigned int)(timestamp() % 100000), (int)tail_fragment.id,
+	     (int)tail_fragment.fragment_num, (int)tail_num );
+  }
+
+  /* in the same class as the rest of its frame */
+  const bool single = tail_fragment.fragment_num == 0 && tail_fragment.final;
+  vector<Datagram> batch( 1, Datagram( tail_fragment.header(), tail_fragment.contents ) );
+  connection->send( batch, Network::PATHS_REDUNDANT,
+		    single ? Network::TRAFFIC_INTERACTIVE : Network::TRAFFIC_BULK ); // Can throw NetworkException
+}
+
+/* The heartbeat interval while idle: for the client, once it has
+   heard from the server; for the server, once the client has asked */
+template <class MyState>
+unsigned int TransportSender<MyState>::heartbeat_interval( uint64_t now ) const
+{
+  if ( shutdown_in_progress || !last_heard
+       || now - max( last_data_sent, last_data_heard ) < uint64_t( KEEPALIVE_IDLE ) ) {
+    return 0;
+  }
+
+  const unsigned int interval = keepalive_probing ? keepalive_interval : remote_keepalive;
+  if ( !interval || !(current_state == sent_states.front().state) ) {
+    return 0;
+  }
+
+  return interval;
+}
+
+/* An answer that came after about as long a silence as the probe's
+   interval shows the binding survives it: try longer, or halfway to
+   an interval known to fail. Otherwise fall back to the longest known
+   to work, halving that if it was the one that failed. */
+template <class MyState>
+void TransportSender<MyState>::keepalive_result( void )
+{
+  const unsigned int probe = keepalive_probe;
+  const bool answered = keepalive_answered + 2 * KEEPALIVE_LEAD >= probe;
+
+  if ( answered ) {
+    keepalive_good = max( keepalive_good, probe );
+    if ( !keepalive_bad ) {
+      keepalive_interval = min( probe * 3 / 2, KEEPALIVE_MAX );
+    } else if ( keepalive_bad - probe > KEEPALIVE_PRECISION ) {
+      keepalive_interval = ( probe + keepalive_bad ) / 2;
+    } else {
+      keepalive_interval = probe;
+    }
+  } else {
+    if ( probe <= keepalive_good ) {
+      keepalive_good = max( probe / 2, (unsigned int)ACK_INTERVAL );
+    }
+    keepalive_bad = probe;
+    keepalive_interval = keepalive_good;
+  }
+
+  if ( verbose ) {
+    fprintf( stderr, "[%u] Keepalive probe of %d ms %s, next heartbeat in %d ms\n",
+	     (unsigned int)(timestamp() % 100000), (int)probe,
+	     answered ? "answered" : "unanswered", (int)keepalive_interval );
+  }
+}
+
+/* A new socket meets a new NAT binding, perhaps behind another NAT
+   altogether, so what the old one survived says nothing of it */
+template <class MyState>
+void TransportSender<MyState>::reset_keepalive( void )
+{
+  keepalive_bindings = connection->get_bindings();
+  keepalive_interval = 2 * ACK_INTERVAL;
+  keepalive_good = ACK_INTERVAL;
+  keepalive_bad = 0;
+  keepalive_probe = 0;
+  keepalive_answered = 0;
+  invalidate_timers();
+}
+
+/* The client hears the server's answer to its probe; the server, the
+   interval the client is probing, or 0 once it sends anything else */
+template <class MyState>
+void TransportSender<MyState>::remote_keepalive_report( unsigned int interval )
+{
+  if ( keepalive_probing ) {
+    if ( keepalive_probe && interval == keepalive_probe ) {
+      keepalive_answered = max( keepalive_answered, timestamp() - last_sent );
+    }
+  } else if ( interval != remote_keepalive ) {
+    remote_keepalive = min( interval, KEEPALIVE_MAX );
+    invalidate_timers();
+  }
+}
+
+/* Whatever went to our old address, or the counterparty's, may well
+   have been lost on the way */
+template <class MyState>
+void TransportSender<MyState>::roamed( void )
+{
+  roam_probes = ROAM_PROBES;
+  doubt_before = timestamp();
+  reset_keepalive();
+}
+
+template <class MyState>
+void TransportSender<MyState>::remote_roamed( void )
+{
+  const uint64_t now = timestamp();
+  pending_data_ack = true;
+  roam_ack = true;
+  /* the rest of the burst finds what the first asked for already resent */
+  if ( now - doubt_before > uint64_t( connection->get_SRTT() ) ) {
+    doubt_before = now;
+  }
+  invalidate_timers();
+}
+
 /* give up on getting acknowledgement for shutdown */
 template <class MyState>
 bool TransportSender<MyState>::shutdown_ack_timed_out( void ) const
@@ -389,29 +1150,64 @@ template <class MyState>
 void TransportSender<MyState>::set_ack_num( uint64_t s_ack_num )
 {
   ack_num = s_ack_num;
+  invalidate_timers();
 }
 
-/* Investigate diff against known receiver state instead */
-/* Mutates proposed_diff */
+/* Of the states the receiver might have, pick the reference that
+   minimizes the expected bytes to bring it to current_state: the diff,
+   plus, if the receiver doesn't have the reference, a resend from the
+   known state after a timeout. Only the winner's diff gets built. */
 template <class MyState>
-void TransportSender<MyState>::attempt_prospective_resend_optimization( string &proposed_diff )
+void TransportSender<MyState>::choose_reference_state( void )
 {
   if ( assumed_receiver_state == sent_states.begin() ) {
     return;
   }
 
-  string resend_diff = current_state.diff_from( sent_states.front().state );
+  uint64_t now = timestamp();
+  double loss = ( remote_fragment_loss >= 0 ? remote_fragment_loss : ASSUMED_LOSS ) / 1000.0;
+
+  /* the known state costs only its diff; a failure costs a resend from
+     it, plus whatever we could have delivered while waiting for the timeout */
+  const double known_cost = current_state.diff_size_estimate( sent_states.front().state );
+  double failure_cost = known_cost;
+  if ( delivery_rate.has_estimate() ) {
+    failure_cost += resend_timeout( sent_states.back().num ) * delivery_rate.bandwidth();
+  }
 
-  /* We do a prophylactic resend if it would make the diff shorter,
-     or if it would lengthen it by no more than 100 bytes and still be
-     less than 1000 bytes. */
+  typename sent_states_type::iterator best = sent_states.begin();
+  double best_cost = known_cost;
+  double held = 1;
 
-  if ( (resend_diff.size() <= proposed_diff.size())
-       || ( (resend_diff.size() < 1000)
-	    && (resend_diff.size() - proposed_diff.size() < 100) ) ) {
-    assumed_receiver_state = sent_states.begin();
-    proposed_diff = resend_diff;
+  for ( typename sent_states_type::iterator i = ++sent_states.begin();
+	i != sent_states.end();
+	i++ ) {
+    /* Each state arrived unless lost; the longer it has gone unacknowledged
+       past when we expected the ack, the likelier that it was. A state may
+       have been a diff from the one before, so it's held only if that is. */
+    double age = now - i->timestamp;
+    double ack_expected = connection->get_SRTT() + requested_ack_delay( i->num );
+    double timeout = resend_timeout( i->num );
+    double arrived = 1 - loss;
+    if ( age >= timeout ) {
+      arrived = 0;
+    } else if ( age > ack_expected ) {
+      arrived *= ( timeout - age ) / ( timeout - ack_expected );
+    }
+
+    held *= arrived;
+    if ( held <= 0 ) {
+      break;
+    }
+
+    double cost = current_state.diff_size_estimate( i->state ) + ( 1 - held ) * failure_cost;
+    if ( cost < best_cost ) {
+      best = i;
+      best_cost = cost;
+    }
   }
+
+  assumed_receiver_state = best;
 }
 
 #endif
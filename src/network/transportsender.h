@@ -36,11 +36,14 @@
 
 #include <string>
 #include <list>
+#include <deque>
+#include <map>
 
 #include "network.h"
 #include "transportinstruction.pb.h"
 #include "transportstate.h"
 #include "transportfragment.h"
+#include "deliveryrate.h"
 #include "prng.h"
 
 using std::list;
@@ -53,8 +56,28 @@ namespace Network {
   const int SEND_INTERVAL_MAX = 250; /* ms between frames */
   const int ACK_INTERVAL = 3000; /* ms between empty acks */
   const int ACK_DELAY = 100; /* ms before delayed ack */
+  const int INTERACTIVE_QUIET = 2; /* ms without a change before a lone change goes out */
+  const int OUTPUT_COLLECT_MAX = 20; /* ms to wait for an application to finish drawing */
+  const int INTERACTIVE_ACK_DELAY = 10; /* ms before acking a lone frame that brought no reply */
+  const int STREAM_ACK_DELAY = 250; /* ms the counterparty may hold an ack of a stream of frames */
+  const unsigned int STREAM_ACK_STATES = 8; /* frames of a stream it may hold an ack for */
+  const int MAX_ACK_DELAY = 1000; /* most ms we hold an ack when asked to */
+  const int KEEPALIVE_IDLE = 10000; /* ms without data either way before heartbeats stretch */
+  const unsigned int KEEPALIVE_MAX = 120000; /* longest heartbeat interval to probe */
+  const int KEEPALIVE_LEAD = 1000; /* ms before the client's next heartbeat that the server's answer should arrive */
+  const unsigned int KEEPALIVE_PRECISION = 2000; /* ms between intervals known good and bad not worth probing */
+  const unsigned int ROAM_PROBES = 3; /* instructions sent at once when our network changes */
   const int SHUTDOWN_RETRIES = 16; /* number of shutdown packets to send before giving up */
   const int ACTIVE_RETRY_TIMEOUT = 10000; /* attempt to resend at frame rate */
+  const unsigned int PACING_BURST = 2; /* datagrams sent back-to-back before pacing */
+  const unsigned int FEC_MIN_LOSS = 5; /* thousandths of fragments lost before sending parity */
+  const unsigned int FEC_MAX_GROUP = 16; /* most data fragments covered by one parity fragment */
+  const unsigned int ASSUMED_LOSS = 10; /* thousandths of fragments, until the counterparty reports */
+  const size_t MAX_SENT_STATES = 32; /* limit on state queue */
+  const size_t DEFAULT_STATE_BUDGET = 8 * 1048576; /* bytes the sent states may hold */
+  const int PARTIAL_FRAME_TIME = 100; /* ms of the link a partial frame may take */
+  const size_t PARTIAL_FRAME_MIN = 500; /* bytes a partial frame may take, at least */
+  const unsigned int LOSS_REORDER_THRESHOLD = 3; /* instructions received past a missing one before it's lost */
 
   template <class MyState>
   class TransportSender
@@ -62,12 +85,18 @@ namespace Network {
   private:
     /* helper methods for tick() */
     void update_assumed_receiver_state( void );
-    void attempt_prospective_resend_optimization( string &proposed_diff );
+    void choose_reference_state( void );
     void rationalize_states( void );
-    void send_to_receiver( const string & diff );
+    void send_to_receiver( MyState &state, const string & diff );
+    bool send_partial_frame( size_t diff_size );
     void send_empty_ack( void );
-    void send_in_fragments( const string & diff, uint64_t new_num );
+    void send_in_fragments( const string & diff, uint64_t new_num, bool timed_out = false, int probe_size = 0 );
+    void send_mtu_probe( void );
+    void send_paced_fragments( void );
+    void send_tail_probe( void );
+    unsigned int parity_group( void ) const;
     void add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state );
+    bool evict_sent_state( size_t &usage );
 
     /* state of sender */
     Connection *connection;
@@ -82,14 +111,24 @@ namespace Network {
     /* somewhere in the middle: the assumed state of the receiver */
     typename sent_states_type::iterator assumed_receiver_state;
 
+    size_t state_budget; /* bytes the states may hold apart from what they share */
+    /* what one sent state adds, given its neighbors */
+    size_t memory_usage( typename sent_states_type::const_iterator i ) const;
+
     /* for fragment creation */
     Fragmenter fragmenter;
 
     /* timing state */
     uint64_t next_ack_time;
     uint64_t next_send_time;
+    uint64_t next_probe_time;
 
+    /* The timers are recalculated only once an input has changed or
+       the time has come for one of them, or for a condition they rest
+       on to turn. Until then, the waits in a loop cost nothing. */
+    uint64_t timers_valid_until; /* 0 once an input has changed */
     void calculate_timers( void );
+    void update_timers( void ) { if ( timestamp() >= timers_valid_until ) { calculate_timers(); } }
 
     unsigned int verbose;
     bool shutdown_in_progress;
@@ -105,10 +144,129 @@ namespace Network {
     uint64_t last_heard; /* last time received new state */
 
     /* chaff to disguise instruction length */
+    bool chaff;
     PRNG prng;
     const string make_chaff( void );
+    void pad_to( Instruction &inst, int size );
 
     uint64_t mindelay_clock; /* time of first pending change to current state */
+    bool interval_limited; /* pending change is waiting on send_interval() */
+
+    /* latency mode: changes that come slower than the frame interval,
+       like keystrokes and their echo, skip the batching */
+    bool interactive;
+    uint64_t last_change; /* time of the last set_current_state(), 0 if the state is edited in place */
+    bool output_writing; /* the application is certainly still writing */
+    unsigned int output_quiet; /* ms of silence that probably ends its output */
+    uint64_t last_data_sent;
+    uint64_t last_data_heard;
+    bool quick_ack; /* the frame to ack came alone */
+    bool lone_change( uint64_t now ) const { return interactive && now - last_data_sent >= send_interval(); }
+
+    /* bottleneck bandwidth estimate, for pacing and frame interval */
+    DeliveryRate delivery_rate;
+    bool pacing;
+    std::deque< Fragment > paced_fragments; /* waiting for their pacing slot */
+    double next_paced_send;
+    size_t last_frame_bytes;
+    bool last_frame_rate_limited;
+
+    /* forward error correction */
+    bool fec;
+    unsigned int fragment_loss; /* as measured on our side, to report */
+    int remote_fragment_loss; /* as reported by counterparty, -1 if it doesn't understand parity */
+
+    /* Changes too big for the link go out in partial frames, the rows
+       about the cursor first, so the user sees where they are typing
+       within a round trip and the rest of the screen follows. */
+    bool partial_frames;
+    size_t partial_frame_budget( void ) const;
+
+    /* compression against the acknowledged receiver state */
+    bool state_dictionary;
+    uint64_t dictionary_num; /* state the cached dictionary renders, -1 if none */
+    string dictionary;
+
+    /* microsecond timestamp to echo, and when its instruction arrived */
+    uint32_t saved_timestamp_us;
+    uint64_t saved_timestamp_received_at;
+
+    /* Compact headers, when both ends offer them. Then our capabilities
+       and loss report go only until the counterparty has acknowledged a
+       state sent with the latest of them. */
+    bool compact_header;
+    uint64_t report_num; /* state last sent with them, -1 if none is outstanding */
+    unsigned int report_loss; /* the loss reported with it */
+    int acked_loss; /* the loss in the last report acknowledged, -1 before one is */
+
+    /* path MTU discovery */
+    unsigned int mtu_probe_ack; /* size of the last probe received, to report */
+    uint64_t probe_timeout( void ) const { return resend_timeout( sent_states.back().num ); }
+
+    /* Fast loss recovery. While an instruction from the counterparty is
+       missing, we report which of the ones around it arrived, and from
+       its report we give up on a state whose instruction didn't without
+       waiting out the timeout. */
+    uint64_t received_id;
+    uint32_t received_mask;
+    bool gap_ack; /* the pending ack reports a new gap */
+    typedef std::map< uint64_t, uint64_t > sent_ids_type;
+    sent_ids_type sent_ids; /* state number to the id of the instruction that last carried it */
+
+    /* A frame whose tail is lost has no later instruction to show it, so
+       its last fragment goes again once an ack is overdue, if that comes
+       well before the timeout. */
+    Fragment tail_fragment;
+    uint64_t tail_num; /* state it carries */
+    bool tail_probed;
+    uint64_t next_tail_probe_time;
+
+    /* Ack frequency. While frames stream out back to back, we ask the
+       counterparty to ack every few of them rather than each within
+       ACK_DELAY; a gap still has it ack at once. Each state's resend
+       timeout allows for the delay we asked for when we last sent it,
+       since a stream's states may still be held after a lone frame. */
+    bool ack_frequency;
+    typedef std::map< uint64_t, unsigned int > ack_delays_type;
+    ack_delays_type requested_ack_delays; /* state number to ms we asked it to hold an ack */
+    unsigned int requested_ack_delay( uint64_t num ) const
+    {
+      ack_delays_type::const_iterator i = requested_ack_delays.find( num );
+      return i == requested_ack_delays.end() ? ACK_DELAY : i->second;
+    }
+    uint64_t resend_timeout( uint64_t num ) const { return connection->timeout() + requested_ack_delay( num ); }
+    unsigned int data_ack_delay; /* ms it asked us to hold an ack of its data */
+    unsigned int data_ack_states; /* frames it asked us to ack after, 0 for no limit */
+    unsigned int unacked_data_states; /* frames received since our last ack */
+
+    /* Idle keepalive. Once no data has gone either way for a while, the
+       client stretches its heartbeat, and the server answers each one
+       just before the next is due. An answer that arrives shows the
+       client's NAT binding outlived the silence, so the next heartbeat
+       waits longer; one that doesn't sends it back to the longest
+       interval known to work. */
+    bool keepalive_probing; /* we're the client, which learns the interval */
+    unsigned int keepalive_interval; /* ms our idle heartbeats are apart */
+    unsigned int keepalive_good; /* longest interval the binding is known to survive */
+    unsigned int keepalive_bad; /* shortest it is known not to, 0 if none */
+    unsigned int keepalive_probe; /* interval our last heartbeat announced, 0 if it wasn't one */
+    uint64_t keepalive_answered; /* longest silence of ours an answer to it came after */
+    unsigned int remote_keepalive; /* interval the counterparty announced, 0 if none */
+    unsigned int keepalive_bindings; /* the connection's count of bindings when we started learning */
+    uint64_t last_sent;
+    uint64_t last_idle; /* last time the session was idle */
+    unsigned int heartbeat_interval( uint64_t now ) const; /* 0 unless idle */
+    void keepalive_result( void );
+    void reset_keepalive( void );
+
+    /* Roaming. When the client's network changes, it sends a few
+       instructions at once from its new socket, and the server answers
+       at once. Neither side then counts on states sent before the
+       change having arrived unless they were acked, so each resends
+       from the last state acked rather than waiting out the timeout. */
+    unsigned int roam_probes; /* instructions left to mark as roaming probes */
+    bool roam_ack; /* the pending ack answers a roaming probe */
+    uint64_t doubt_before; /* unacked states sent before this are assumed lost */
 
   public:
     /* constructor */
@@ -121,28 +279,75 @@ namespace Network {
     int wait_time( void );
 
     /* Executed upon receipt of ack */
-    void process_acknowledgment_through( uint64_t ack_num );
+    void process_acknowledgment_through( uint64_t ack_num, uint64_t ack_delay );
 
     /* Executed upon entry to new receiver state */
     void set_ack_num( uint64_t s_ack_num );
 
-    /* Accelerate reply ack */
-    void set_data_ack( void ) { pending_data_ack = true; }
+    /* Something the timers rest on has changed, like the RTT */
+    void invalidate_timers( void ) { timers_valid_until = 0; }
+
+    /* Accelerate reply ack, as often as the counterparty asked: within
+       delay ms or after states frames, 0 for the default */
+    void set_data_ack( unsigned int states, unsigned int delay );
 
     /* Received something */
-    void remote_heard( uint64_t ts ) { last_heard = ts; }
+    void remote_heard( uint64_t ts ) { last_heard = ts; invalidate_timers(); }
+
+    /* Loss of fragments sent to us, and to the counterparty */
+    void set_fragment_loss( unsigned int loss ) { fragment_loss = loss; }
+    /* Instructions received whole, from the FragmentAssembly. A new gap
+       is acked at once so the counterparty can resend. */
+    void set_received( uint64_t id, uint32_t mask )
+    {
+      if ( id != received_id && !( mask & 1 ) ) {
+	pending_data_ack = true;
+	gap_ack = true;
+	invalidate_timers();
+      }
+      received_id = id;
+      received_mask = mask;
+    }
+    void remote_received_report( uint64_t id, uint32_t mask );
+    void remote_fragment_loss_report( unsigned int loss ) { remote_fragment_loss = loss; }
+    void remote_codecs_report( unsigned int codecs ) { fragmenter.set_remote_codecs( codecs ); }
+    void remote_keepalive_report( unsigned int interval );
+
+    /* Counterparty's microsecond timestamp, to echo with how long we held it */
+    void remote_timestamp( uint32_t ts, uint64_t received_at ) { saved_timestamp_us = ts; saved_timestamp_received_at = received_at; }
+
+    /* Path MTU probes: one from the counterparty to answer promptly,
+       its answer to ours, and how large a probe it can take */
+    void mtu_probe_received( unsigned int size ) { mtu_probe_ack = size; pending_data_ack = true; invalidate_timers(); }
+    void mtu_probe_ack_report( unsigned int size ) { connection->get_path_mtu().probe_acked( size ); invalidate_timers(); }
+    void remote_max_datagram_report( unsigned int size ) { connection->get_path_mtu().set_remote_max( size ); invalidate_timers(); }
+
+    /* Newest protocol version the counterparty can receive */
+    void remote_protocol_report( unsigned int version )
+    {
+      fragmenter.set_compact( compact_header && version >= MOSH_COMPACT_PROTOCOL_VERSION );
+    }
+
+    /* Our network has changed, or the counterparty's has */
+    void roamed( void );
+    void remote_roamed( void );
+
+    /* Counterparty's running count of ECN congestion marks */
+    void remote_congestion( unsigned int ce_count ) { delivery_rate.congestion( ce_count, timestamp() ); invalidate_timers(); }
 
     /* Starts shutdown sequence */
-    void start_shutdown( void ) { if ( !shutdown_in_progress ) { shutdown_start = timestamp(); shutdown_in_progress = true; } }
+    void start_shutdown( void ) { if ( !shutdown_in_progress ) { shutdown_start = timestamp(); shutdown_in_progress = true; invalidate_timers(); } }
 
     /* Misc. getters and setters */
     /* Cannot modify current_state while shutdown in progress */
-    MyState &get_current_state( void ) { assert( !shutdown_in_progress ); return current_state; }
+    MyState &get_current_state( void ) { assert( !shutdown_in_progress ); invalidate_timers(); return current_state; }
     void set_current_state( const MyState &x )
     {
       assert( !shutdown_in_progress );
       current_state = x;
       current_state.reset_input();
+      last_change = timestamp();
+      invalidate_timers();
     }
     void set_verbose( unsigned int s_verbose ) { verbose = s_verbose; }
 
@@ -153,9 +358,35 @@ namespace Network {
     uint64_t get_sent_state_acked( void ) const { return sent_states.front().num; }
     uint64_t get_sent_state_last( void ) const { return sent_states.back().num; }
 
+    /* bytes held by the sent states, counting what neighbors share once */
+    size_t memory_usage( void ) const;
+    void set_state_budget( size_t budget ) { state_budget = budget; }
+
     bool shutdown_ack_timed_out( void ) const;
 
-    void set_send_delay( int new_delay ) { SEND_MINDELAY = new_delay; }
+    void set_send_delay( int new_delay ) { SEND_MINDELAY = new_delay; invalidate_timers(); }
+    void set_interactive( bool s_interactive ) { interactive = s_interactive; invalidate_timers(); }
+
+    /* From the cadence of the application's output, before each
+       set_current_state(): whether it is still writing, and how long a
+       silence would mean it has finished */
+    void set_output_cadence( bool writing, unsigned int quiet ) { output_writing = writing; output_quiet = quiet; invalidate_timers(); }
+
+    void set_pacing( bool s_pacing ) { pacing = s_pacing; invalidate_timers(); }
+    void set_fec( bool s_fec ) { fec = s_fec; }
+    void set_partial_frames( bool s_partial_frames ) { partial_frames = s_partial_frames; }
+    void set_ack_frequency( bool s_ack_frequency ) { ack_frequency = s_ack_frequency; }
+    void set_keepalive_probing( bool s_keepalive_probing ) { keepalive_probing = s_keepalive_probing; invalidate_timers(); }
+    void set_state_dictionary( bool s_state_dictionary ) { state_dictionary = s_state_dictionary; }
+    void set_compact_header( bool s_compact_header )
+    {
+      compact_header = s_compact_header;
+      if ( !compact_header ) {
+	fragmenter.set_compact( false );
+      }
+    }
+    void set_chaff( bool s_chaff ) { chaff = s_chaff; }
+    const DeliveryRate & get_delivery_rate( void ) const { return delivery_rate; }
 
     unsigned int send_interval( void ) const;
 
@@ -36,6 +36,7 @@
 #include "hostinput.pb.h"
 
 #include <limits.h>
+#include <vector>
 
 using namespace std;
 using namespace Parser;
@@ -97,6 +98,96 @@ string Complete::diff_from( const Complete &existing ) const
   return output.SerializeAsString();
 }
 
+/* Roughly diff_from( existing ).size(), without running the display
+   code. Rows shared between the framebuffers are skipped by pointer. */
+size_t Complete::diff_size_estimate( const Complete &existing ) const
+{
+  const Framebuffer &fb = get_fb();
+  const Framebuffer &existing_fb = existing.get_fb();
+
+  if ( fb == existing_fb ) {
+    if ( existing.get_echo_ack() != get_echo_ack() ) {
+      return ESTIMATED_FRAME_OVERHEAD;
+    }
+    return 0;
+  }
+
+  const int width = fb.ds.get_width();
+  const int height = fb.ds.get_height();
+  if ( ( width != existing_fb.ds.get_width() ) || ( height != existing_fb.ds.get_height() ) ) {
+    return ESTIMATED_FRAME_OVERHEAD + height * ( ESTIMATED_ROW_OVERHEAD + width * ESTIMATED_CELL_SIZE );
+  }
+
+  size_t size = ESTIMATED_FRAME_OVERHEAD;
+  for ( int y = 0; y < height; y++ ) {
+    size += row_diff_size( fb.get_rows()[ y ], existing_fb.get_rows()[ y ] );
+  }
+
+  return size;
+}
+
+size_t Complete::row_diff_size( const Framebuffer::row_pointer &row,
+				const Framebuffer::row_pointer &existing )
+{
+  if ( row == existing ) {
+    return 0;
+  }
+
+  size_t cells = 0;
+  for ( size_t x = 0; x < row->cells.size(); x++ ) {
+    if ( row->cells[ x ] != existing->cells[ x ] ) {
+      cells++;
+    }
+  }
+
+  return cells ? ESTIMATED_ROW_OVERHEAD + cells * ESTIMATED_CELL_SIZE : 0;
+}
+
+/* For a frame too big for the link: the cursor row and those about it,
+   nearest first, as far as the budget goes. At least one changed row
+   stays, so each partial frame makes headway. */
+bool Complete::limit_diff( const Complete &existing, size_t budget )
+{
+  const Framebuffer &fb = get_fb();
+  const Framebuffer &existing_fb = existing.get_fb();
+
+  const int height = fb.ds.get_height();
+  if ( ( fb.ds.get_width() != existing_fb.ds.get_width() )
+       || ( height != existing_fb.ds.get_height() ) ) {
+    return false;
+  }
+
+  std::vector<size_t> costs( height );
+  size_t total = ESTIMATED_FRAME_OVERHEAD;
+  for ( int y = 0; y < height; y++ ) {
+    costs[ y ] = row_diff_size( fb.get_rows()[ y ], existing_fb.get_rows()[ y ] );
+    total += costs[ y ];
+  }
+  if ( total <= budget ) {
+    return false;
+  }
+
+  /* cursor row, then one above, one below, two above... */
+  const int cursor = fb.ds.get_cursor_row();
+  size_t size = ESTIMATED_FRAME_OVERHEAD;
+  bool full = false, reverted = false;
+  for ( int i = 0; i < 2 * height; i++ ) {
+    const int y = cursor + ( i % 2 ? -( i + 1 ) / 2 : i / 2 );
+    if ( y < 0 || y >= height || !costs[ y ] ) {
+      continue;
+    }
+    if ( !full && ( size == ESTIMATED_FRAME_OVERHEAD || size + costs[ y ] <= budget ) ) {
+      size += costs[ y ];
+      continue;
+    }
+    full = true;
+    terminal.share_row( y, existing_fb );
+    reverted = true;
+  }
+
+  return reverted;
+}
+
 string Complete::init_diff( void ) const
 {
   return diff_from( Complete( get_fb().ds.get_width(), get_fb().ds.get_height() ));
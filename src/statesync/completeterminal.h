@@ -59,6 +59,13 @@ namespace Terminal {
 
     static const int ECHO_TIMEOUT = 50; /* for late ack */
 
+    /* for diff_size_estimate(), in bytes */
+    static const size_t ESTIMATED_CELL_SIZE = 2;
+    static const size_t ESTIMATED_ROW_OVERHEAD = 8; /* cursor motion to the changed row */
+    static const size_t ESTIMATED_FRAME_OVERHEAD = 16; /* echo ack, final cursor position */
+    static size_t row_diff_size( const Framebuffer::row_pointer &row,
+				 const Framebuffer::row_pointer &existing );
+
   public:
     Complete( size_t width, size_t height ) : parser(), terminal( width, height ), display( false ),
 					      actions(), input_history(), echo_ack( 0 ) {}
@@ -76,7 +83,20 @@ namespace Terminal {
     /* interface for Network::Transport */
     void subtract( const Complete * ) const {}
     std::string diff_from( const Complete &existing ) const;
+    size_t diff_size_estimate( const Complete &existing ) const;
+    /* Put back existing's rows, farthest from the cursor first, until
+       diff_from( existing ) is about budget bytes. False, leaving this
+       state as it was, if the diff fits already or can't be split. */
+    bool limit_diff( const Complete &existing, size_t budget );
     std::string init_diff( void ) const;
+    /* the screen as rendered, which both ends can prime a compressor with */
+    std::string compression_dictionary( void ) const { return init_diff(); }
+    /* bytes held apart from what the states either side share with it */
+    size_t memory_usage( const Complete *prev, const Complete *next ) const
+    {
+      return sizeof( *this ) + get_fb().memory_usage( prev ? &prev->get_fb() : NULL,
+						       next ? &next->get_fb() : NULL );
+    }
     void apply_string( const std::string & diff );
     bool operator==( const Complete &x ) const;
 
@@ -105,6 +105,22 @@ string UserStream::diff_from( const UserStream &existing ) const
   return output.SerializeAsString();
 }
 
+/* roughly diff_from( existing ).size(), without building the diff */
+size_t UserStream::diff_size_estimate( const UserStream &existing ) const
+{
+  assert( actions.size() >= existing.actions.size() );
+
+  size_t size = 0;
+  for ( deque<UserEvent>::const_iterator i = actions.begin() + existing.actions.size();
+	i != actions.end();
+	i++ ) {
+    /* keystrokes are combined into one instruction */
+    size += ( i->type == ResizeType ) ? 12 : 1;
+  }
+
+  return size ? size + 4 : 0;
+}
+
 void UserStream::apply_string( const string &diff )
 {
   ClientBuffers::UserMessage input;
@@ -89,7 +89,11 @@ namespace Network {
     /* interface for Network::Transport */
     void subtract( const UserStream *prefix );
     string diff_from( const UserStream &existing ) const;
+    size_t diff_size_estimate( const UserStream &existing ) const;
+    bool limit_diff( const UserStream &, size_t ) { return false; } /* keystrokes go whole */
     string init_diff( void ) const { assert( false ); return string(); };
+    string compression_dictionary( void ) const { return string(); } /* keystrokes don't repeat usefully */
+    size_t memory_usage( const UserStream *, const UserStream * ) const { return sizeof( *this ) + actions.size() * sizeof( UserEvent ); }
     void apply_string( const string &diff );
     bool operator==( const UserStream &x ) const { return actions == x.actions; }
 
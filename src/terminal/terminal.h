@@ -79,6 +79,7 @@ namespace Terminal {
     std::string read_octets_to_host( void );
 
     const Framebuffer & get_fb( void ) const { return fb; }
+    void share_row( int row, const Framebuffer &other ) { fb.share_row( row, other ); }
 
     bool operator==( Emulator const &x ) const;
   };
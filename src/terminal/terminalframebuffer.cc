@@ -34,6 +34,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "terminalframebuffer.h"
 
 using namespace Terminal;
@@ -662,3 +664,27 @@ bool Cell::compare( const Cell &other ) const
 
   return ret;
 }
+
+size_t Framebuffer::memory_usage( const Framebuffer *a, const Framebuffer *b ) const
+{
+  std::vector<const Row *> shared_rows;
+  const Framebuffer *others[] = { a, b };
+  for ( int i = 0; i < 2; i++ ) {
+    if ( others[ i ] ) {
+      for ( rows_type::const_iterator j = others[ i ]->rows.begin(); j != others[ i ]->rows.end(); j++ ) {
+	shared_rows.push_back( j->get() );
+      }
+    }
+  }
+  std::sort( shared_rows.begin(), shared_rows.end() );
+
+  size_t bytes = rows.capacity() * sizeof( row_pointer )
+    + ( icon_name.capacity() + window_title.capacity() ) * sizeof( title_type::value_type );
+  for ( rows_type::const_iterator i = rows.begin(); i != rows.end(); i++ ) {
+    if ( !std::binary_search( shared_rows.begin(), shared_rows.end(), i->get() ) ) {
+      bytes += sizeof( Row ) + (*i)->cells.capacity() * sizeof( Cell );
+    }
+  }
+
+  return bytes;
+}
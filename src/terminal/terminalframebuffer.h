@@ -420,6 +420,9 @@ namespace Terminal {
       return &get_mutable_row( row )->cells.at( col );
     }
 
+    /* Take the row from another framebuffer of the same width */
+    void share_row( int row, const Framebuffer &other ) { rows.at( row ) = other.rows.at( row ); }
+
     Cell *get_combining_cell( void );
 
     void apply_renditions_to_cell( Cell *cell );
@@ -450,6 +453,9 @@ namespace Terminal {
     void ring_bell( void ) { bell_count++; }
     unsigned int get_bell_count( void ) const { return bell_count; }
 
+    /* bytes held on the heap, less the rows shared with either of the others */
+    size_t memory_usage( const Framebuffer *a, const Framebuffer *b ) const;
+
     bool operator==( const Framebuffer &x ) const
     {
       return ( rows == x.rows ) && ( window_title == x.window_title ) && ( bell_count == x.bell_count ) && ( ds == x.ds );
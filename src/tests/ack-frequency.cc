@@ -0,0 +1,120 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Ack frequency over loopback, through a relay that delays each
+   datagram. While the server streams frames back to back, the client
+   should send markedly fewer acks when asked to, without falling
+   behind the stream. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const uint64_t DELAY = 50; /* ms each way */
+static const uint64_t WARMUP = 1000; /* ms before counting */
+static const uint64_t DURATION = 3000; /* ms of the flood counted */
+
+/* counts the client's datagrams once the warmup is over */
+class CountingRelay : public Relay {
+public:
+  uint64_t counting_from;
+  int acks;
+
+  CountingRelay( const std::string &server_port, uint64_t s_counting_from )
+    : Relay( server_port, DELAY ), counting_from( s_counting_from ), acks( 0 )
+  {}
+
+protected:
+  bool pass( const struct sockaddr_in &, bool to_client )
+  {
+    if ( !to_client && timestamp() >= counting_from ) {
+      acks++;
+    }
+    return true;
+  }
+};
+
+/* The server repaints every 5 ms, faster than it sends frames. Returns
+   how many datagrams the client sent while the flood was counted, or
+   -1 if the client fell behind. */
+static int run( bool ack_frequency )
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  server.set_ack_frequency( ack_frequency );
+
+  freeze_timestamp();
+  const uint64_t start = timestamp();
+  CountingRelay relay( server.port(), start + WARMUP );
+
+  ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay.port() );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  uint64_t next_frame = start;
+  unsigned int frames = 0;
+
+  while ( timestamp() - start < WARMUP + DURATION ) {
+    if ( timestamp() >= next_frame ) {
+      char output[ 32 ];
+      snprintf( output, sizeof( output ), "\033]0;%u\007", ++frames );
+      terminal.act( output + std::string( 70, 'a' + frames % 26 ) + "\r\n" );
+      server.set_current_state( terminal );
+      next_frame = timestamp() + 5;
+    }
+
+    relay.turn( server, client, next_frame );
+  }
+
+  /* the client should be no more than a round trip and a frame behind */
+  const unsigned int behind = frames - title_count( client.get_latest_remote_state().state );
+  printf( "ack frequency %s: client %u frames behind, sent %d datagrams in %d ms\n",
+	  ack_frequency ? "on" : "off", behind, relay.acks, int( DURATION ) );
+  return behind * 5 <= 2 * DELAY + SEND_INTERVAL_MAX ? relay.acks : -1;
+}
+
+int main()
+{
+  int every = run( false );
+  int fewer = run( true );
+
+  return ( every > 0 && fewer > 0 && fewer * 3 < every * 2 ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
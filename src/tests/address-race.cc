@@ -0,0 +1,127 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Racing the server's addresses, over loopback. The server listens on
+   127.0.0.1 alone, and the client is given that address along with
+   127.0.0.2, where nothing answers. Whichever of the two comes first,
+   the client should reach the server within one turn of the race, and
+   keep to 127.0.0.1 from then on. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const uint64_t TURN = 250; /* ms between the client's tries of each address */
+
+/* Returns the ms until the client has the server's first frame, or -1
+   if it never does or ends up anywhere but the server's address. */
+static int run( const char *first, const char *second )
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  freeze_timestamp();
+  const uint64_t start = timestamp(); /* when the race begins */
+  ClientTransport client( blank, terminal, server.get_key().c_str(), first, server.port().c_str() );
+  client.add_candidate( second, server.port().c_str() );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+  terminal.act( "hello\r\n" );
+  server.set_current_state( terminal );
+
+  uint64_t connected_at = 0;
+
+  while ( timestamp() - start < 4 * TURN + 1000 ) {
+    if ( client.get_remote_state_num() > 0 ) {
+      connected_at = timestamp();
+      break;
+    }
+
+    client.tick();
+    server.tick();
+
+    std::vector<struct pollfd> pollfds;
+    add_fds( pollfds, server.fds() );
+    const size_t server_fds = pollfds.size();
+    add_fds( pollfds, client.fds() );
+    fatal_assert( poll( &pollfds[ 0 ], pollfds.size(), std::min( client.wait_time(), server.wait_time() ) ) >= 0 );
+    freeze_timestamp();
+
+    bool server_ready = false, client_ready = false;
+    for ( size_t i = 0; i < pollfds.size(); i++ ) {
+      if ( pollfds[ i ].revents & POLLIN ) {
+	( i < server_fds ? server_ready : client_ready ) = true;
+      }
+    }
+    if ( server_ready ) {
+      server.recv();
+    }
+    if ( client_ready ) {
+      client.recv();
+    }
+  }
+
+  const Addr &remote = client.get_remote_addr();
+  if ( !connected_at
+       || remote.sa.sa_family != AF_INET
+       || remote.sin.sin_addr.s_addr != htonl( INADDR_LOOPBACK ) ) {
+    return -1;
+  }
+  return int( connected_at - start );
+}
+
+int main()
+{
+  int late = run( "127.0.0.2", "127.0.0.1" );
+  printf( "server's address second: first frame after %d ms\n", late );
+  int early = run( "127.0.0.1", "127.0.0.2" );
+  printf( "server's address first: first frame after %d ms\n", early );
+
+  return ( late >= int( TURN ) && late < int( 2 * TURN )
+	   && early >= 0 && early < int( TURN ) ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that compact fragment headers carry instructions intact, in
+   fewer bytes than the full ones, alongside full ones from before the
+   switch and across the wrap of their short ids */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "network.h"
+#include "transportfragment.h"
+
+using namespace Network;
+
+static Instruction make_instruction( uint64_t num, const std::string &diff )
+{
+  Instruction inst;
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( num - 1 );
+  inst.set_new_num( num );
+  inst.set_ack_num( num + 7 );
+  inst.set_throwaway_num( num - 3 );
+  inst.set_diff( diff );
+  return inst;
+}
+
+/* incompressible, so it takes several fragments */
+static std::string noise( size_t len )
+{
+  std::string ret;
+  unsigned int x = len;
+  for ( size_t i = 0; i < len; i++ ) {
+    x = x * 1103515245 + 12345;
+    ret += char( x >> 16 );
+  }
+  return ret;
+}
+
+/* Pass the fragments through the assembly, leaving out one if asked,
+   and check that what comes out is inst */
+static bool round_trip( FragmentAssembly &assembly, const std::vector<Fragment> &fragments,
+			Instruction inst, bool compact, int drop = -1 )
+{
+  bool complete = false;
+  for ( size_t i = 0; i < fragments.size(); i++ ) {
+    if ( int( i ) == drop ) {
+      continue;
+    }
+    Fragment frag( fragments[ i ].tostring() );
+    if ( frag.compact != compact ) {
+      fprintf( stderr, "Fragment has the wrong kind of header.\n" );
+      return false;
+    }
+    if ( assembly.add_fragment( frag ) ) {
+      complete = true;
+    }
+  }
+  if ( !complete ) {
+    fprintf( stderr, "Instruction %d did not complete.\n", int( inst.new_num() ) );
+    return false;
+  }
+
+  if ( compact ) {
+    inst.set_protocol_version( MOSH_COMPACT_PROTOCOL_VERSION );
+  }
+  if ( assembly.get_assembly().SerializeAsString() != inst.SerializeAsString() ) {
+    fprintf( stderr, "Instruction %d reassembled wrongly.\n", int( inst.new_num() ) );
+    return false;
+  }
+  return true;
+}
+
+int main()
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  /* a keystroke, late in a session, first with the full header */
+  Instruction keystroke = make_instruction( 123456, "x" );
+  std::vector<Fragment> full = fragmenter.make_fragments( keystroke, 1300 );
+  if ( full.size() != 1 || !round_trip( assembly, full, keystroke, false ) ) {
+    return EXIT_FAILURE;
+  }
+
+  fragmenter.set_compact( true );
+  keystroke.set_new_num( keystroke.new_num() + 1 );
+  std::vector<Fragment> compact = fragmenter.make_fragments( keystroke, 1300 );
+  if ( compact.size() != 1 || !round_trip( assembly, compact, keystroke, true ) ) {
+    return EXIT_FAILURE;
+  }
+  size_t full_len = full[ 0 ].tostring().size(), compact_len = compact[ 0 ].tostring().size();
+  if ( compact[ 0 ].header_len() != Fragment::single_header_len || compact_len + 16 > full_len ) {
+    fprintf( stderr, "Compact keystroke takes %d bytes, against %d in full.\n",
+	     int( compact_len ), int( full_len ) );
+    return EXIT_FAILURE;
+  }
+
+  /* the odd numbers of shutdown */
+  Instruction shutdown = make_instruction( 5, "" );
+  shutdown.set_new_num( -1 );
+  shutdown.set_ack_num( -1 );
+  if ( !round_trip( assembly, fragmenter.make_fragments( shutdown, 1300 ), shutdown, true ) ) {
+    return EXIT_FAILURE;
+  }
+
+  /* several fragments, one of them rebuilt from parity */
+  Instruction large = make_instruction( 200000, noise( 5000 ) );
+  std::vector<Fragment> fragments = fragmenter.make_fragments( large, 1300, 4 );
+  if ( fragments.size() < 3 || fragments[ 0 ].header_len() != Fragment::compact_header_len
+       || !round_trip( assembly, fragments, large, true, 1 ) ) {
+    fprintf( stderr, "Large compact instruction failed.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* ids well past what the compact header holds */
+  for ( uint64_t num = 1; num < 3 * ( uint64_t( Fragment::compact_id_mask ) + 1 ); num++ ) {
+    Instruction inst = make_instruction( num, "y" );
+    if ( !round_trip( assembly, fragmenter.make_fragments( inst, 1300 ), inst, true ) ) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
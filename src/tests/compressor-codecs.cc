@@ -0,0 +1,216 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that every codec Compressor offers round-trips, that small
+   and incompressible payloads are stored, that plain zlib from older
+   peers still decodes, that compression against a state refuses
+   a dictionary other than the one it was made with, and that the
+   streaming Decompressor agrees and enforces its cap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include <zlib.h>
+
+#include "compressor.h"
+#include "crypto.h"
+
+using namespace Network;
+
+static std::string terminal_output( void )
+{
+  std::string out;
+  char tmp[ 64 ];
+  for ( int row = 1; row <= 24; row++ ) {
+    snprintf( tmp, sizeof( tmp ), "\033[%d;1H\033[0;1;3%dm", row, row % 8 );
+    out += tmp;
+    out += "\xe2\x94\x82 mosh-server  ";
+    out += std::string( 20 + row, ' ' );
+    out += "\033[0m\033[K";
+  }
+  return out;
+}
+
+static std::string noise( size_t len )
+{
+  std::string out;
+  unsigned int x = 12345;
+  for ( size_t i = 0; i < len; i++ ) {
+    x = x * 1103515245 + 12345;
+    out += char( x >> 16 );
+  }
+  return out;
+}
+
+static bool round_trip( const char *name, const std::string &input, Codec codec, int level, int expected_tag )
+{
+  Compressor &compressor = get_compressor();
+  std::string encoded = compressor.compress_str( input, codec, level );
+  std::string decoded = compressor.uncompress_str( encoded );
+
+  if ( decoded != input ) {
+    fprintf( stderr, "%s: codec %d level %d did not round-trip.\n", name, codec, level );
+    return false;
+  }
+  if ( expected_tag >= 0 && (unsigned char)encoded[ 0 ] != expected_tag ) {
+    fprintf( stderr, "%s: codec %d tagged %d, expected %d.\n", name, codec, (unsigned char)encoded[ 0 ], expected_tag );
+    return false;
+  }
+  return true;
+}
+
+/* fed in pieces as fragments would be */
+static bool stream_trip( const char *name, const std::string &encoded, const std::string &expected,
+			 const std::string *dictionary, size_t piece_size )
+{
+  Decompressor decompressor;
+  decompressor.set_dictionary( dictionary );
+  for ( size_t offset = 0; offset < encoded.size(); offset += piece_size ) {
+    if ( !decompressor.feed( encoded.substr( offset, piece_size ), 1 << 20 ) ) {
+      fprintf( stderr, "%s: piece refused.\n", name );
+      return false;
+    }
+  }
+  if ( decompressor.finish( 1 << 20 ) != expected ) {
+    fprintf( stderr, "%s: streamed in %d-byte pieces, did not round-trip.\n", name, int( piece_size ) );
+    return false;
+  }
+  return true;
+}
+
+int main()
+{
+  const std::string text = terminal_output();
+  const std::string random = noise( 4000 );
+  bool ok = true;
+
+  for ( int c = CODEC_DEFLATE; c < 8; c++ ) {
+    Codec codec = Codec( c );
+    if ( codec == CODEC_STATE || !( Compressor::supported_codecs() & ( 1 << codec ) ) ) {
+      continue;
+    }
+    ok &= round_trip( "terminal", text, codec, 1, codec );
+    ok &= round_trip( "terminal", text, codec, Compressor::default_level( codec ), codec );
+    ok &= round_trip( "terminal", text, codec, Compressor::max_level( codec ), codec );
+    ok &= round_trip( "small", "\033[K", codec, Compressor::default_level( codec ), CODEC_NONE );
+    ok &= round_trip( "incompressible", random, codec, Compressor::default_level( codec ), CODEC_NONE );
+  }
+
+  /* untagged zlib, at any level, as older peers send it */
+  ok &= round_trip( "terminal", text, CODEC_ZLIB, Z_DEFAULT_COMPRESSION, -1 );
+  ok &= round_trip( "incompressible", random, CODEC_ZLIB, 9, -1 );
+
+  std::string deflated = get_compressor().compress_str( text, CODEC_DEFLATE, 6 );
+  std::string zlibbed = get_compressor().compress_str( text, CODEC_ZLIB, 6 );
+  if ( deflated.size() >= zlibbed.size() ) {
+    fprintf( stderr, "Preset dictionary did not help: %d bytes vs. %d.\n",
+	     int( deflated.size() ), int( zlibbed.size() ) );
+    ok = false;
+  }
+
+  /* against a state: the previous screen, which differs in one row */
+  std::string previous = text;
+  previous.replace( previous.find( "mosh-server" ), 4, "MOSH" );
+  size_t len;
+  const char *output = get_compressor().compress_with_state( text, &len, 42, previous );
+  std::string against_state( output, len );
+  if ( Compressor::reference_state( against_state ) != 42
+       || !Compressor::dictionary_matches( against_state, previous )
+       || Compressor::dictionary_matches( against_state, text )
+       || get_compressor().uncompress_str( against_state, previous ) != text ) {
+    fprintf( stderr, "Compression against a state failed.\n" );
+    ok = false;
+  }
+  if ( Compressor::reference_state( deflated ) != uint64_t( -1 ) ) {
+    fprintf( stderr, "Ordinary payload claims a reference state.\n" );
+    ok = false;
+  }
+  if ( against_state.size() >= deflated.size() / 2 ) {
+    fprintf( stderr, "Reference state did not help: %d bytes vs. %d.\n",
+	     int( against_state.size() ), int( deflated.size() ) );
+    ok = false;
+  }
+
+  std::string big( 100000, 'x' );
+  std::string big_zlib = get_compressor().compress_str( big );
+  std::string zstd, big_zstd;
+  if ( Compressor::supported_codecs() & ( 1 << CODEC_ZSTD ) ) {
+    zstd = get_compressor().compress_str( text, CODEC_ZSTD, Compressor::default_level( CODEC_ZSTD ) );
+    big_zstd = get_compressor().compress_str( big, CODEC_ZSTD, Compressor::default_level( CODEC_ZSTD ) );
+  }
+  for ( size_t piece = 1; piece <= 1000; piece *= 10 ) {
+    ok &= stream_trip( "deflate", deflated, text, NULL, piece );
+    ok &= stream_trip( "zlib", zlibbed, text, NULL, piece );
+    ok &= stream_trip( "state", against_state, text, &previous, piece );
+    ok &= stream_trip( "large", big_zlib, big, NULL, piece );
+    if ( Compressor::supported_codecs() & ( 1 << CODEC_ZSTD ) ) {
+      ok &= stream_trip( "zstd", zstd, text, NULL, piece );
+      ok &= stream_trip( "large zstd", big_zstd, big, NULL, piece );
+    }
+  }
+
+  /* a payload inflating past the cap is refused */
+  bool refused = false;
+  try {
+    Decompressor decompressor;
+    decompressor.feed( big_zlib, 50000 );
+    decompressor.finish( 50000 );
+  } catch ( const Crypto::CryptoException & ) {
+    refused = true;
+  }
+  if ( !refused ) {
+    fprintf( stderr, "Decompressor exceeded its cap.\n" );
+    ok = false;
+  }
+  if ( !big_zstd.empty() ) {
+    refused = false;
+    try {
+      Decompressor decompressor;
+      decompressor.feed( big_zstd, 50000 );
+      decompressor.finish( 50000 );
+    } catch ( const Crypto::CryptoException & ) {
+      refused = true;
+    }
+    if ( !refused ) {
+      fprintf( stderr, "Decompressor exceeded its cap on zstd.\n" );
+      ok = false;
+    }
+  }
+
+  if ( !ok ) {
+    return EXIT_FAILURE;
+  }
+  printf( "Codecs 0x%x round-trip; terminal text deflates to %d bytes (plain zlib %d, against a state %d).\n",
+	  Compressor::supported_codecs(), int( deflated.size() ), int( zlibbed.size() ), int( against_state.size() ) );
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests that parity fragments let FragmentAssembly rebuild an
+   instruction with one fragment lost from each parity group */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "transportfragment.h"
+
+using namespace Network;
+
+static Instruction make_instruction( void )
+{
+  /* incompressible, so it takes many fragments */
+  std::string diff;
+  unsigned int x = 12345;
+  for ( int i = 0; i < 20000; i++ ) {
+    x = x * 1103515245 + 12345;
+    diff += char( x >> 16 );
+  }
+
+  Instruction inst;
+  inst.set_protocol_version( 2 );
+  inst.set_old_num( 1 );
+  inst.set_new_num( 2 );
+  inst.set_ack_num( 3 );
+  inst.set_throwaway_num( 0 );
+  inst.set_diff( diff );
+  return inst;
+}
+
+/* Deliver the fragments in order, except those for which drop() is
+   true; returns whether the instruction was reassembled intact. */
+static bool deliver( FragmentAssembly &assembly, const Instruction &inst,
+		     std::vector<Fragment> fragments, bool reverse, int drop_every, int drop_offset )
+{
+  if ( reverse ) {
+    std::vector<Fragment> reversed( fragments.rbegin(), fragments.rend() );
+    fragments = reversed;
+  }
+
+  for ( size_t i = 0; i < fragments.size(); i++ ) {
+    if ( drop_every && int( i ) % drop_every == drop_offset ) {
+      continue;
+    }
+
+    Fragment frag( fragments[ i ].tostring() );
+    if ( assembly.add_fragment( frag ) ) {
+      return assembly.get_assembly().SerializeAsString() == inst.SerializeAsString();
+    }
+  }
+
+  return false;
+}
+
+int main()
+{
+  const unsigned int group = 4;
+  Instruction inst = make_instruction();
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  std::vector<Fragment> fragments = fragmenter.make_fragments( inst, 1300, group );
+  if ( fragments.size() < 3 * ( group + 1 ) ) {
+    fprintf( stderr, "Expected at least three parity groups, got %d fragments.\n", int( fragments.size() ) );
+    return EXIT_FAILURE;
+  }
+
+  /* each group is sent as its data fragments and then its parity, so dropping
+     one of every group + 1 loses exactly one fragment from each group */
+  for ( int reverse = 0; reverse < 2; reverse++ ) {
+    for ( unsigned int offset = 0; offset <= group; offset++ ) {
+      /* a new id for each attempt */
+      inst.set_ack_num( inst.ack_num() + 1 );
+      fragments = fragmenter.make_fragments( inst, 1300, group );
+
+      if ( !deliver( assembly, inst, fragments, reverse, group + 1, offset ) ) {
+	fprintf( stderr, "Failed to rebuild with fragment %d of each group lost%s.\n",
+		 offset, reverse ? " (reversed)" : "" );
+	return EXIT_FAILURE;
+      }
+    }
+  }
+
+  if ( assembly.get_loss() == 0 ) {
+    fprintf( stderr, "Rebuilt fragments were not counted as lost.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* two losses in one group can't be rebuilt */
+  inst.set_ack_num( inst.ack_num() + 1 );
+  fragments = fragmenter.make_fragments( inst, 1300, group );
+  fragments.erase( fragments.begin(), fragments.begin() + 2 );
+  if ( deliver( assembly, inst, fragments, false, 0, 0 ) ) {
+    fprintf( stderr, "Rebuilt a group with two fragments lost.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* and without parity, any loss is fatal */
+  inst.set_ack_num( inst.ack_num() + 1 );
+  fragments = fragmenter.make_fragments( inst, 1300 );
+  if ( deliver( assembly, inst, fragments, false, 3, 1 ) ) {
+    fprintf( stderr, "Rebuilt an instruction sent without parity.\n" );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
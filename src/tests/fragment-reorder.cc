@@ -0,0 +1,180 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests that FragmentAssembly completes instructions whose fragments
+   arrive interleaved, gives up on ones left incomplete too long, and
+   refuses one too large to hold */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "transportfragment.h"
+#include "crypto.h"
+
+using namespace Network;
+
+static Instruction make_instruction( uint64_t num, size_t size = 5000 )
+{
+  /* incompressible, so it takes several fragments */
+  std::string diff;
+  unsigned int x = num;
+  for ( size_t i = 0; i < size; i++ ) {
+    x = x * 1103515245 + 12345;
+    diff += char( x >> 16 );
+  }
+
+  Instruction inst;
+  inst.set_protocol_version( 2 );
+  inst.set_old_num( num - 1 );
+  inst.set_new_num( num );
+  inst.set_ack_num( 0 );
+  inst.set_throwaway_num( 0 );
+  inst.set_diff( diff );
+  return inst;
+}
+
+int main()
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  Instruction first = make_instruction( 1 ), second = make_instruction( 2 );
+  std::vector<Fragment> first_fragments = fragmenter.make_fragments( first, 1300 );
+  std::vector<Fragment> second_fragments = fragmenter.make_fragments( second, 1300 );
+  if ( first_fragments.size() < 2 || first_fragments.size() != second_fragments.size() ) {
+    fprintf( stderr, "Expected two instructions with the same number of fragments.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* the second instruction's fragments overtake the first's */
+  int completed = 0;
+  for ( size_t i = 0; i < first_fragments.size(); i++ ) {
+    Fragment second_frag( second_fragments[ i ].tostring() );
+    if ( assembly.add_fragment( second_frag ) ) {
+      completed++;
+      if ( assembly.get_assembly().SerializeAsString() != second.SerializeAsString() ) {
+	fprintf( stderr, "Second instruction reassembled wrongly.\n" );
+	return EXIT_FAILURE;
+      }
+    }
+
+    Fragment first_frag( first_fragments[ i ].tostring() );
+    if ( assembly.add_fragment( first_frag ) ) {
+      completed++;
+      if ( assembly.get_assembly().SerializeAsString() != first.SerializeAsString() ) {
+	fprintf( stderr, "First instruction reassembled wrongly.\n" );
+	return EXIT_FAILURE;
+      }
+    }
+  }
+
+  if ( completed != 2 ) {
+    fprintf( stderr, "Completed %d of 2 interleaved instructions.\n", completed );
+    return EXIT_FAILURE;
+  }
+
+  /* a late duplicate of a completed instruction is ignored */
+  Fragment duplicate( first_fragments.back().tostring() );
+  if ( assembly.add_fragment( duplicate ) ) {
+    fprintf( stderr, "Duplicate fragment completed an instruction again.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* an instruction left incomplete while many others arrive is given up */
+  std::vector<Fragment> abandoned = fragmenter.make_fragments( make_instruction( 3 ), 1300 );
+  Fragment abandoned_frag( abandoned[ 0 ].tostring() );
+  assembly.add_fragment( abandoned_frag );
+
+  for ( uint64_t num = 4; num < 64; num++ ) {
+    std::vector<Fragment> fragments = fragmenter.make_fragments( make_instruction( num ), 1300 );
+    Fragment frag( fragments[ 0 ].tostring() );
+    assembly.add_fragment( frag );
+  }
+
+  for ( size_t i = 1; i < abandoned.size(); i++ ) {
+    Fragment frag( abandoned[ i ].tostring() );
+    if ( assembly.add_fragment( frag ) ) {
+      fprintf( stderr, "Abandoned instruction was still held.\n" );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( assembly.get_loss() == 0 ) {
+    fprintf( stderr, "Abandoned fragments were not counted as lost.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* an instruction larger than everything held together is refused,
+     rather than evicting itself fragment by fragment; no sender of
+     ours could make one, so its fragments are made up */
+  const int huge_fragments = 4000;
+  bool refused = false;
+  for ( int i = 0; i < huge_fragments && !refused; i++ ) {
+    Fragment frag( 1000, i, i == huge_fragments - 1, std::string( 1300, 'x' ) );
+    try {
+      if ( assembly.add_fragment( frag ) ) {
+	fprintf( stderr, "Instruction over the budget was completed.\n" );
+	return EXIT_FAILURE;
+      }
+    } catch ( const Crypto::CryptoException & ) {
+      refused = true;
+    }
+  }
+  if ( !refused ) {
+    fprintf( stderr, "Instruction over the budget was not refused.\n" );
+    return EXIT_FAILURE;
+  }
+
+  /* and one that fills most of the budget still completes */
+  Instruction large = make_instruction( 64, 3 * 1048576 );
+  std::vector<Fragment> large_fragments = fragmenter.make_fragments( large, 1300 );
+  completed = 0;
+  for ( size_t i = 0; i < large_fragments.size(); i++ ) {
+    Fragment frag( large_fragments[ i ].tostring() );
+    if ( assembly.add_fragment( frag ) ) {
+      completed++;
+      if ( assembly.get_assembly().SerializeAsString() != large.SerializeAsString() ) {
+	fprintf( stderr, "Large instruction reassembled wrongly.\n" );
+	return EXIT_FAILURE;
+      }
+    }
+  }
+  if ( completed != 1 ) {
+    fprintf( stderr, "Large instruction was not completed.\n" );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Idle keepalive over loopback, through a relay that delays each
+   datagram and, like a NAT, stops passing the server's to the client
+   once the client has been quiet for a while. The client should learn
+   how long its heartbeats can be apart before the binding gives out. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const uint64_t DELAY = 50; /* ms each way */
+static const uint64_t BINDING = 7000; /* ms the relay's binding outlives the client's last datagram */
+static const uint64_t DURATION = 45000; /* ms to watch for, at most */
+
+/* like a NAT, forgets the client once it has been quiet too long */
+class NatRelay : public Relay {
+private:
+  uint64_t from_client;
+
+public:
+  NatRelay( const std::string &server_port )
+    : Relay( server_port, DELAY ), from_client( timestamp() )
+  {}
+
+protected:
+  bool pass( const struct sockaddr_in &, bool to_client )
+  {
+    if ( !to_client ) {
+      from_client = timestamp();
+    }
+    return !to_client || timestamp() - from_client <= BINDING;
+  }
+};
+
+int main()
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  freeze_timestamp();
+  NatRelay relay( server.port() );
+
+  ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay.port() );
+  client.set_keepalive_probing( true );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  /* Once idle, the client should stretch its heartbeat, find where the
+     binding gives out, and settle below it, with the server following */
+  const uint64_t expected[] = { 0, 2 * ACK_INTERVAL, 3 * ACK_INTERVAL, 2 * ACK_INTERVAL };
+  const size_t count = sizeof( expected ) / sizeof( expected[ 0 ] );
+
+  const uint64_t start = timestamp();
+  std::vector< uint64_t > intervals( 1, 0 );
+  uint64_t server_followed = 0;
+
+  while ( timestamp() - start < DURATION && intervals.size() <= count ) {
+    relay.turn( server, client );
+
+    /* the heartbeat intervals the client settles on */
+    if ( client.get_keepalive_interval() != intervals.back() ) {
+      intervals.push_back( client.get_keepalive_interval() );
+      printf( "%5d ms: heartbeats %d ms apart\n", int( timestamp() - start ), int( intervals.back() ) );
+    }
+    server_followed = std::max( server_followed, server.get_keepalive_interval() );
+  }
+
+  bool ok = intervals.size() >= count && std::equal( expected, expected + count, intervals.begin() );
+  for ( size_t i = count; ok && i < intervals.size(); i++ ) {
+    ok = intervals[ i ] > 2 * ACK_INTERVAL && intervals[ i ] < BINDING + KEEPALIVE_LEAD;
+  }
+  printf( "server followed up to %d ms\n", int( server_followed ) );
+
+  return ( ok && server_followed == 3 * ACK_INTERVAL ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
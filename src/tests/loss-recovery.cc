@@ -0,0 +1,131 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tail loss recovery over loopback, through a relay that delays each
+   datagram and drops one of the server's. A lone frame, like a
+   keystroke's echo, has no later instruction to show the client it
+   was lost; the tail probe should bring it back well before a resend
+   after the timeout could arrive. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const uint64_t DELAY = 50; /* ms each way */
+static const uint64_t WARMUP = 3000; /* ms before the drop */
+
+/* drops the first datagram to the client once armed */
+class DroppingRelay : public Relay {
+public:
+  bool armed;
+  uint64_t dropped_at;
+
+  DroppingRelay( const std::string &server_port )
+    : Relay( server_port, DELAY ), armed( false ), dropped_at( 0 )
+  {}
+
+protected:
+  bool pass( const struct sockaddr_in &, bool to_client )
+  {
+    if ( to_client && armed && !dropped_at ) {
+      dropped_at = timestamp();
+      return false;
+    }
+    return true;
+  }
+};
+
+/* Frames come every interval ms, each adding a line of text and
+   counting itself in the title. Returns the ms from the drop until
+   the client has the dropped frame, or -1 if it never does. */
+static int run( uint64_t interval, bool interactive )
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  DroppingRelay relay( server.port() );
+
+  ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay.port() );
+  client.set_interactive( interactive );
+  server.set_interactive( interactive );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  freeze_timestamp();
+  const uint64_t start = timestamp();
+  uint64_t next_frame = start;
+  unsigned int frames = 0;
+  unsigned int drop_frame = 0; /* frame whose first datagram to drop */
+  uint64_t recovered_at = 0;
+
+  while ( timestamp() - start < WARMUP + 2000 && !recovered_at ) {
+    if ( timestamp() >= next_frame ) {
+      char output[ 32 ];
+      snprintf( output, sizeof( output ), "\033]0;%u\007", ++frames );
+      terminal.act( output + std::string( 70, 'a' + frames % 26 ) + "\r\n" );
+      server.set_current_state( terminal );
+      next_frame = timestamp() + interval;
+      if ( !drop_frame && timestamp() - start >= WARMUP ) {
+	drop_frame = frames;
+	relay.armed = true;
+      }
+    }
+
+    if ( relay.dropped_at && title_count( client.get_latest_remote_state().state ) >= drop_frame ) {
+      recovered_at = timestamp();
+      break;
+    }
+
+    relay.turn( server, client, next_frame );
+  }
+
+  return recovered_at ? int( recovered_at - relay.dropped_at ) : -1;
+}
+
+int main()
+{
+  /* a resend after the timeout leaves at least a round trip, four
+     deviations and the ack delay after the frame, and arrives in half
+     a round trip more; the probe waits half a round trip less */
+  int recovered = run( 500, true );
+  printf( "lone frame recovered %d ms after the loss\n", recovered );
+
+  return ( recovered >= 0 && recovered < int( 3 * DELAY + ACK_DELAY ) ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,349 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Multipath over loopback: the client reaches the server both from its
+   usual address and from 127.0.0.2, through a relay that passes the
+   first straight on and holds the second's datagrams for DELAY ms each
+   way. Each end should measure the two paths apart, keep large frames
+   off the slow one, and keystrokes should still arrive along it once
+   the fast path fails. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+typedef Transport<UserStream, UserStream> UserTransport;
+
+static const uint64_t DELAY = 50; /* ms each way on the slow path */
+static const uint64_t MEASURE = 3000; /* ms of traffic before the fast path fails */
+static const uint64_t DEADLINE = 2000; /* ms for a keystroke to arrive after that */
+
+static int bound_socket( const char *ip )
+{
+  int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+  fatal_assert( fd >= 0 );
+
+  struct sockaddr_in addr;
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0;
+  fatal_assert( inet_pton( AF_INET, ip, &addr.sin_addr ) == 1 );
+  if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+static int local_port( int fd )
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof( addr );
+  fatal_assert( getsockname( fd, (struct sockaddr *)&addr, &len ) == 0 );
+  return ntohs( addr.sin_port );
+}
+
+/* Forwards each client address's datagrams to the server from a socket
+   of its own, so the server sees one address per path, and the replies
+   back, holding those of the slow client address for DELAY ms */
+class PathRelay {
+private:
+  struct Mapping {
+    struct sockaddr_in client;
+    int upstream;
+    bool slow;
+  };
+
+  struct Held {
+    uint64_t due;
+    int fd;
+    struct sockaddr_in to;
+    std::string data;
+
+    Held( uint64_t s_due, int s_fd, const struct sockaddr_in &s_to, const std::string &s_data )
+      : due( s_due ), fd( s_fd ), to( s_to ), data( s_data )
+    {}
+  };
+
+  int downstream;
+  struct sockaddr_in server;
+  in_addr_t slow_client;
+  std::vector< Mapping > mappings;
+  std::deque< Held > held;
+
+  void forward( int fd, const struct sockaddr_in &to, const std::string &data, bool slow )
+  {
+    if ( !slow ) {
+      sendto( fd, data.data(), data.size(), 0, (const struct sockaddr *)&to, sizeof( to ) );
+      return;
+    }
+    held.push_back( Held( timestamp() + DELAY, fd, to, data ) );
+  }
+
+public:
+  bool fast_failed;
+
+  PathRelay( int server_port, const char *slow_ip )
+    : downstream( bound_socket( "127.0.0.1" ) ), server(), slow_client(), mappings(), held(), fast_failed( false )
+  {
+    fatal_assert( downstream >= 0 );
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    server.sin_port = htons( server_port );
+    server.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    slow_client = inet_addr( slow_ip );
+  }
+
+  ~PathRelay()
+  {
+    close( downstream );
+    for ( size_t i = 0; i < mappings.size(); i++ ) {
+      close( mappings[ i ].upstream );
+    }
+  }
+
+  int port( void ) const { return local_port( downstream ); }
+
+  std::vector< int > fds( void ) const
+  {
+    std::vector< int > ret( 1, downstream );
+    for ( size_t i = 0; i < mappings.size(); i++ ) {
+      ret.push_back( mappings[ i ].upstream );
+    }
+    return ret;
+  }
+
+  int wait_time( void ) const
+  {
+    if ( held.empty() ) {
+      return INT_MAX;
+    }
+    return held.front().due > timestamp() ? held.front().due - timestamp() : 0;
+  }
+
+  void recv( int fd )
+  {
+    char buf[ 65536 ];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof( from );
+    ssize_t len = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr *)&from, &from_len );
+    if ( len < 0 ) {
+      return;
+    }
+    const std::string data( buf, len );
+
+    if ( fd == downstream ) {
+      size_t i = 0;
+      while ( i < mappings.size()
+	      && ( mappings[ i ].client.sin_addr.s_addr != from.sin_addr.s_addr
+		   || mappings[ i ].client.sin_port != from.sin_port ) ) {
+	i++;
+      }
+      if ( i == mappings.size() ) {
+	Mapping m;
+	m.client = from;
+	m.upstream = bound_socket( "127.0.0.1" );
+	fatal_assert( m.upstream >= 0 );
+	m.slow = from.sin_addr.s_addr == slow_client;
+	mappings.push_back( m );
+      }
+      if ( mappings[ i ].slow || !fast_failed ) {
+	forward( mappings[ i ].upstream, server, data, mappings[ i ].slow );
+      }
+      return;
+    }
+
+    for ( size_t i = 0; i < mappings.size(); i++ ) {
+      if ( mappings[ i ].upstream == fd && ( mappings[ i ].slow || !fast_failed ) ) {
+	forward( downstream, mappings[ i ].client, data, mappings[ i ].slow );
+      }
+    }
+  }
+
+  void tick( void )
+  {
+    while ( !held.empty() && held.front().due <= timestamp() ) {
+      const Held &h = held.front();
+      sendto( h.fd, h.data.data(), h.data.size(), 0, (const struct sockaddr *)&h.to, sizeof( h.to ) );
+      held.pop_front();
+    }
+  }
+};
+
+static bool check( bool ok, const char *what )
+{
+  printf( "%s%s\n", what, ok ? "" : " (FAIL)" );
+  return ok;
+}
+
+int main( void )
+{
+  int probe = bound_socket( "127.0.0.2" );
+  if ( probe < 0 ) {
+    fprintf( stderr, "Can't bind to 127.0.0.2 (%s), skipping\n", strerror( errno ) );
+    return 77;
+  }
+  close( probe );
+
+  try {
+    UserStream server_state, client_state;
+    UserTransport server( server_state, client_state, "127.0.0.1", NULL );
+    PathRelay relay( atoi( server.port().c_str() ), "127.0.0.2" );
+    char relay_port[ 16 ];
+    snprintf( relay_port, sizeof( relay_port ), "%d", relay.port() );
+    UserTransport client( client_state, server_state, server.get_key().c_str(),
+			  "127.0.0.1", relay_port );
+    client.add_path( "127.0.0.2" );
+
+    freeze_timestamp();
+    const uint64_t start = timestamp();
+    uint64_t next_keystroke = start;
+    uint64_t next_screen = start;
+    size_t keystrokes = 0;
+    size_t fail_keystrokes = 0;
+
+    while ( timestamp() - start < MEASURE + DEADLINE ) {
+      if ( !relay.fast_failed && timestamp() - start >= MEASURE ) {
+	relay.fast_failed = true;
+	fail_keystrokes = keystrokes;
+      }
+
+      if ( timestamp() >= next_keystroke ) {
+	client.get_current_state().push_back( Parser::UserByte( 'a' + keystrokes % 26 ) );
+	keystrokes++;
+	next_keystroke += 100;
+      }
+      if ( !relay.fast_failed && timestamp() >= next_screen ) { /* a frame of several datagrams, even compressed */
+	for ( int i = 0; i < 15000; i++ ) {
+	  server.get_current_state().push_back( Parser::UserByte( 'A' + rand() % 26 ) );
+	}
+	next_screen += 250;
+      }
+
+      if ( relay.fast_failed && server.get_latest_remote_state().state.size() > fail_keystrokes ) {
+	break; /* a keystroke made it along the slow path alone */
+      }
+
+      client.tick();
+      server.tick();
+      relay.tick();
+
+      int wait = std::min( client.wait_time(), server.wait_time() );
+      wait = std::min( wait, relay.wait_time() );
+      wait = std::min( wait, int( next_keystroke - timestamp() ) );
+      wait = std::max( wait, 0 );
+
+      std::vector<struct pollfd> pollfds;
+      add_fds( pollfds, server.fds() );
+      const size_t server_fds = pollfds.size();
+      add_fds( pollfds, client.fds() );
+      const size_t client_fds = pollfds.size();
+      add_fds( pollfds, relay.fds() );
+
+      if ( poll( &pollfds[ 0 ], pollfds.size(), wait ) < 0 ) {
+	perror( "poll" );
+	return 1;
+      }
+      freeze_timestamp();
+
+      bool server_ready = false, client_ready = false;
+      for ( size_t i = 0; i < pollfds.size(); i++ ) {
+	if ( pollfds[ i ].revents & POLLIN ) {
+	  if ( i < server_fds ) {
+	    server_ready = true;
+	  } else if ( i < client_fds ) {
+	    client_ready = true;
+	  } else {
+	    relay.recv( pollfds[ i ].fd );
+	  }
+	}
+      }
+      if ( server_ready ) {
+	server.recv();
+      }
+      if ( client_ready ) {
+	client.recv();
+      }
+    }
+
+    const std::vector< Path > &client_paths = client.get_paths();
+    const std::vector< Path > &server_paths = server.get_paths();
+
+    for ( size_t i = 0; i < client_paths.size(); i++ ) {
+      printf( "client path %d: SRTT %.1f ms, loss %.2f, %d datagrams sent\n", int( i ),
+	      client_paths[ i ].SRTT, client_paths[ i ].loss, int( client_paths[ i ].datagrams_sent ) );
+    }
+    for ( size_t i = 0; i < server_paths.size(); i++ ) {
+      printf( "server path %d: SRTT %.1f ms, loss %.2f, %d datagrams sent\n", int( i ),
+	      server_paths[ i ].SRTT, server_paths[ i ].loss, int( server_paths[ i ].datagrams_sent ) );
+    }
+
+    bool ok = check( client_paths.size() == 2 && server_paths.size() == 2, "both ends have two paths" );
+    if ( !ok ) {
+      return 1;
+    }
+    /* the server's paths are in the order it heard them, so find the slow one by its delay */
+    const Path &server_fast = server_paths[ 0 ].SRTT < server_paths[ 1 ].SRTT ? server_paths[ 0 ] : server_paths[ 1 ];
+    const Path &server_slow = server_paths[ 0 ].SRTT < server_paths[ 1 ].SRTT ? server_paths[ 1 ] : server_paths[ 0 ];
+    /* On a loaded machine the estimates may still be coming down from
+       their initial 1000 ms, so check the gap, not where they stand */
+    ok = check( client_paths[ 1 ].SRTT - client_paths[ 0 ].SRTT >= DELAY,
+		"client measures the paths apart" ) && ok;
+    ok = check( server_slow.SRTT - server_fast.SRTT >= DELAY,
+		"server measures the paths apart" ) && ok;
+    ok = check( server_fast.datagrams_sent > 2 * server_slow.datagrams_sent && server_slow.datagrams_sent > 0,
+		"server keeps large frames off the slow path" ) && ok;
+    ok = check( server.get_latest_remote_state().state.size() > fail_keystrokes,
+		"keystrokes arrive along the slow path alone" ) && ok;
+    return ok ? 0 : 1;
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+}
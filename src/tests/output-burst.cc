@@ -0,0 +1,105 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that OutputBurst waits out a silence a little longer than the
+   gaps between an application's writes, whatever their pace, ignores
+   the pauses between bursts, and knows a read that filled the buffer
+   means more is waiting */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "outputburst.h"
+
+using namespace Network;
+
+static const size_t CAPACITY = 16384;
+
+/* bursts of reads gap_us apart, separated by pauses of pause_us */
+static unsigned int quiet_after( unsigned int bursts, unsigned int reads, uint64_t gap_us, uint64_t pause_us )
+{
+  OutputBurst burst;
+  uint64_t now = 1000000;
+
+  for ( unsigned int b = 0; b < bursts; b++ ) {
+    for ( unsigned int r = 0; r < reads; r++ ) {
+      burst.read( now, 100, CAPACITY );
+      now += gap_us;
+    }
+    now += pause_us;
+  }
+
+  return burst.quiet();
+}
+
+static bool check_quiet( const char *name, unsigned int quiet, unsigned int low, unsigned int high )
+{
+  if ( quiet < low || quiet > high ) {
+    fprintf( stderr, "%s: quiet %u ms, expected %u to %u.\n", name, quiet, low, high );
+    return false;
+  }
+  return true;
+}
+
+int main()
+{
+  bool ok = true;
+
+  /* nothing measured yet */
+  ok &= check_quiet( "fresh", OutputBurst().quiet(), 1, 5 );
+
+  /* a fast redraw: no need to wait long after it */
+  ok &= check_quiet( "fast", quiet_after( 10, 8, 200, 150000 ), 1, 2 );
+
+  /* a slow one: wait longer than its gaps, so as not to tear it */
+  ok &= check_quiet( "slow", quiet_after( 10, 8, 6000, 150000 ), 7, 12 );
+
+  /* and never so long that output seems to stall */
+  ok &= check_quiet( "sluggish", quiet_after( 10, 8, 19000, 150000 ), 20, 20 );
+
+  /* the pauses between bursts, like a user's typing, don't count */
+  ok &= check_quiet( "typing", quiet_after( 50, 1, 0, 150000 ), 1, 5 );
+
+  OutputBurst burst;
+  burst.read( 1000000, CAPACITY, CAPACITY );
+  if ( !burst.still_writing() ) {
+    fprintf( stderr, "A full read did not mean more was waiting.\n" );
+    ok = false;
+  }
+  burst.read( 1000100, 10, CAPACITY );
+  if ( burst.still_writing() ) {
+    fprintf( stderr, "A short read still meant more was waiting.\n" );
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
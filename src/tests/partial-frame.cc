@@ -0,0 +1,133 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Partial frames: a full-screen redraw limited to a budget should come
+   apart into frames no bigger than it, the first bringing the cursor
+   row up to date; each should leave the receiver with a screen made of
+   old rows and new ones; and together they should reach the new screen. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "completeterminal.h"
+
+using namespace Terminal;
+
+static const size_t BUDGET = 600;
+
+/* a screenful of text, cursor left on the middle row */
+static std::string screen( unsigned int n )
+{
+  std::string ret = "\033[H";
+  for ( int row = 0; row < 24; row++ ) {
+    for ( int col = 0; col < 79; col++ ) {
+      n = n * 1103515245 + 12345;
+      ret += char( 'a' + ( n >> 16 ) % 26 );
+    }
+    ret += row < 23 ? "\r\n" : "";
+  }
+  return ret + "\033[13;5H";
+}
+
+static bool same_row( const Framebuffer &a, const Framebuffer &b, int y )
+{
+  return a.get_rows()[ y ]->cells == b.get_rows()[ y ]->cells;
+}
+
+int main()
+{
+  Complete old_screen( 80, 24 );
+  old_screen.act( screen( 1 ) );
+  Complete current( old_screen );
+  current.act( screen( 2 ) );
+
+  Complete sent( old_screen ); /* the sender's idea of the receiver */
+  Complete receiver( 80, 24 );
+  receiver.apply_string( old_screen.init_diff() );
+
+  const int cursor = current.get_fb().ds.get_cursor_row();
+  unsigned int frames = 0;
+
+  while ( true ) {
+    Complete partial( current );
+    const bool split = partial.limit_diff( sent, BUDGET );
+    const std::string diff = partial.diff_from( sent );
+    receiver.apply_string( diff );
+    sent = partial;
+    frames++;
+
+    printf( "frame %u: %d bytes%s\n", frames, int( diff.size() ), split ? "" : ", the rest" );
+    if ( !split ) {
+      break;
+    }
+
+    if ( diff.size() > BUDGET ) {
+      fprintf( stderr, "A partial frame overran its budget.\n" );
+      return EXIT_FAILURE;
+    }
+    if ( !same_row( receiver.get_fb(), current.get_fb(), cursor ) ) {
+      fprintf( stderr, "The cursor row didn't come first.\n" );
+      return EXIT_FAILURE;
+    }
+    for ( int y = 0; y < 24; y++ ) {
+      if ( !same_row( receiver.get_fb(), partial.get_fb(), y )
+	   || !( same_row( partial.get_fb(), current.get_fb(), y )
+		 || same_row( partial.get_fb(), old_screen.get_fb(), y ) ) ) {
+	fprintf( stderr, "Row %d is neither old nor new.\n", y );
+	return EXIT_FAILURE;
+      }
+    }
+    if ( frames > 24 ) {
+      fprintf( stderr, "The partial frames made no headway.\n" );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( frames < 3 ) {
+    fprintf( stderr, "The redraw wasn't split.\n" );
+    return EXIT_FAILURE;
+  }
+  for ( int y = 0; y < 24; y++ ) {
+    if ( !same_row( receiver.get_fb(), current.get_fb(), y ) ) {
+      fprintf( stderr, "Row %d never arrived.\n", y );
+      return EXIT_FAILURE;
+    }
+  }
+  if ( receiver.get_fb().ds.get_cursor_row() != cursor ) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Path MTU discovery over loopback: a server and client transport idle
+   until their probes settle, and each must find an MTU just short of
+   the loopback interface's, given on the command line, or of the
+   receive limit when the interface allows more. Run by path-mtu.test,
+   which configures the interface in a network namespace. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <vector>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+typedef Transport<UserStream, UserStream> UserTransport;
+
+static const int SEARCH_GRANULARITY = 16; /* as in PathMTU */
+static const uint64_t DEADLINE = 10000; /* ms */
+static const uint64_t SETTLE = 1000; /* ms to keep going after both are in range */
+
+static bool in_range( int mtu, int expected )
+{
+  return mtu <= expected && mtu > expected - SEARCH_GRANULARITY;
+}
+
+static bool check( const char *name, int mtu, int expected )
+{
+  bool ok = in_range( mtu, expected );
+  printf( "%s MTU %d, expected %d%s\n", name, mtu, expected, ok ? "" : " (FAIL)" );
+  return ok;
+}
+
+int main( int argc, char *argv[] )
+{
+  /* UDP payload the interface takes: its MTU less the IPv4 and UDP headers */
+  int expected = Crypto::Session::RECEIVE_MTU;
+  if ( argc > 1 ) {
+    expected = std::min( expected, atoi( argv[ 1 ] ) - 28 );
+  }
+
+  try {
+    UserStream server_state, client_state;
+    UserTransport server( server_state, client_state, "127.0.0.1", NULL );
+    UserTransport client( client_state, server_state, server.get_key().c_str(),
+			  "127.0.0.1", server.port().c_str() );
+
+    freeze_timestamp();
+    uint64_t start = timestamp();
+    uint64_t end = start + DEADLINE;
+
+    while ( timestamp() < end ) {
+      if ( end == start + DEADLINE
+	   && in_range( client.get_MTU(), expected ) && in_range( server.get_MTU(), expected ) ) {
+	end = timestamp() + SETTLE; /* in case either overshoots */
+      }
+
+      client.tick();
+      server.tick();
+
+      int wait = std::min( client.wait_time(), server.wait_time() );
+      wait = std::min( wait, int( end - timestamp() ) );
+
+      std::vector<struct pollfd> pollfds;
+      add_fds( pollfds, server.fds() );
+      const size_t server_fds = pollfds.size();
+      add_fds( pollfds, client.fds() );
+
+      if ( poll( &pollfds[ 0 ], pollfds.size(), wait ) < 0 ) {
+	perror( "poll" );
+	return 1;
+      }
+      freeze_timestamp();
+
+      for ( size_t i = 0; i < pollfds.size(); i++ ) {
+	if ( pollfds[ i ].revents & POLLIN ) {
+	  if ( i < server_fds ) {
+	    server.recv();
+	  } else {
+	    client.recv();
+	  }
+	  break;
+	}
+      }
+    }
+
+    bool ok = check( "client", client.get_MTU(), expected );
+    ok = check( "server", server.get_MTU(), expected ) && ok;
+    return ok ? 0 : 1;
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    return 1;
+  }
+}
@@ -0,0 +1,141 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Roaming on a network change, over loopback, through a relay that
+   delays each datagram and stands in for the client's NAT. Partway
+   through a stream of frames the client's binding dies, as in a
+   handover from Wi-Fi to a mobile network, and everything to or from
+   its port is dropped; the last frames are lost and the server falls
+   quiet. When the new network comes up, the client is told, as the
+   netlink monitor would tell it. It should have the server's newest
+   frame again within a round trip or so, rather than after the
+   server's backed-off resend, or the silence that makes the client
+   hop ports on its own. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const uint64_t DELAY = 50; /* ms each way */
+static const uint64_t INTERVAL = 200; /* ms between frames */
+static const uint64_t HANDOVER = 3000; /* ms until the old binding dies */
+static const uint64_t OUTAGE = 1000; /* ms until the new network comes up */
+static const uint64_t LAST_FRAME = HANDOVER + OUTAGE / 2; /* ms until the server falls quiet */
+/* About a round trip with the probes; left to the backed-off resend
+   timer, it takes seconds. The gap is wide enough to hold on a loaded
+   machine, where each turn of the relay runs late. */
+static const uint64_t RECOVERY = 10 * DELAY;
+
+/* stands in for the client's NAT, whose binding can die */
+class HandoverRelay : public Relay {
+public:
+  in_port_t dead_port; /* the old binding's, once it has died */
+
+  HandoverRelay( const std::string &server_port )
+    : Relay( server_port, DELAY ), dead_port( 0 )
+  {}
+
+  void handover( void ) { dead_port = client_addr.sin_port; }
+
+protected:
+  bool pass( const struct sockaddr_in &from, bool to_client )
+  {
+    return to_client ? client_addr.sin_port != dead_port : from.sin_port != dead_port;
+  }
+};
+
+/* Returns the ms from the new network coming up until the client has
+   the server's newest frame, or -1 if it doesn't within a few seconds. */
+static int run( void )
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  HandoverRelay relay( server.port() );
+
+  ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay.port() );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  freeze_timestamp();
+  const uint64_t start = timestamp();
+  uint64_t next_frame = start;
+  unsigned int frames = 0;
+  bool roamed = false;
+  unsigned int newest = 0; /* frame the server had when the new network came up */
+  uint64_t recovered_at = 0;
+
+  while ( timestamp() - start < HANDOVER + OUTAGE + 3000 ) {
+    if ( timestamp() >= next_frame && timestamp() - start < LAST_FRAME ) {
+      char output[ 32 ];
+      snprintf( output, sizeof( output ), "\033]0;%u\007", ++frames );
+      terminal.act( output + std::string( 70, 'a' + frames % 26 ) + "\r\n" );
+      server.set_current_state( terminal );
+      next_frame = timestamp() + INTERVAL;
+    }
+
+    if ( !relay.dead_port && timestamp() - start >= HANDOVER ) {
+      relay.handover();
+    }
+    if ( !roamed && timestamp() - start >= HANDOVER + OUTAGE ) {
+      roamed = true;
+      newest = frames;
+      client.local_network_changed();
+    }
+
+    if ( roamed && title_count( client.get_latest_remote_state().state ) >= newest ) {
+      recovered_at = timestamp();
+      break;
+    }
+
+    relay.turn( server, client, roamed ? next_frame : std::min( next_frame, start + HANDOVER + OUTAGE ) );
+  }
+
+  return recovered_at ? int( recovered_at - ( start + HANDOVER + OUTAGE ) ) : -1;
+}
+
+int main()
+{
+  int recovered = run();
+  printf( "newest frame %d ms after the new network came up\n", recovered );
+
+  return ( recovered >= 0 && recovered < int( RECOVERY ) ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,171 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Sent-state budget over loopback: the server redraws the whole screen
+   again and again while the client stops listening, so its unacknowledged
+   states pile up holding private rows. Without a budget they should
+   outgrow the one given; with it, stay within it; and once the client
+   listens again, it should still reach the latest screen. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const size_t BUDGET = 512 * 1024;
+static const uint64_t REDRAW = 20; /* ms between screens */
+static const uint64_t DEAF = 2000; /* ms the client stops listening */
+
+/* a screenful of text that shares no row with the last */
+static std::string screen( unsigned int n )
+{
+  std::string ret = "\033[H";
+  for ( int row = 0; row < 24; row++ ) {
+    for ( int col = 0; col < 79; col++ ) {
+      n = n * 1103515245 + 12345;
+      ret += char( 'a' + ( n >> 16 ) % 26 );
+    }
+    ret += row < 23 ? "\r\n" : "";
+  }
+  return ret;
+}
+
+static bool same_text( const Terminal::Framebuffer &a, const Terminal::Framebuffer &b )
+{
+  const Terminal::Framebuffer::rows_type &a_rows = a.get_rows(), &b_rows = b.get_rows();
+  if ( a_rows.size() != b_rows.size() ) {
+    return false;
+  }
+  for ( size_t i = 0; i < a_rows.size(); i++ ) {
+    if ( a_rows[ i ]->cells != b_rows[ i ]->cells ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Returns the most the server's sent states held */
+static size_t run( size_t budget, bool *caught_up )
+{
+  Terminal::Complete terminal( 80, 24 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  ClientTransport client( blank, terminal, server.get_key().c_str(),
+			  "127.0.0.1", server.port().c_str() );
+  if ( budget ) {
+    server.set_state_budget( budget );
+  }
+
+  freeze_timestamp();
+  const uint64_t start = timestamp();
+  uint64_t next_redraw = start + 300; /* after the handshake */
+  unsigned int screens = 0;
+  size_t peak = 0;
+
+  while ( timestamp() - start < 300 + DEAF + 2000 ) {
+    const bool deaf = timestamp() - start >= 300 && timestamp() - start < 300 + DEAF;
+
+    if ( timestamp() >= next_redraw && timestamp() - start < 300 + DEAF ) {
+      terminal.act( screen( ++screens ) );
+      server.set_current_state( terminal );
+      next_redraw = timestamp() + REDRAW;
+    }
+
+    client.tick();
+    server.tick();
+    peak = std::max( peak, server.get_memory_usage() );
+
+    int wait = std::min( std::min( client.wait_time(), server.wait_time() ),
+			 int( std::max( next_redraw, timestamp() ) - timestamp() ) );
+    std::vector<struct pollfd> pollfds;
+    add_fds( pollfds, server.fds() );
+    const size_t server_fds = pollfds.size();
+    add_fds( pollfds, client.fds() );
+    fatal_assert( poll( &pollfds[ 0 ], pollfds.size(), wait ) >= 0 );
+    freeze_timestamp();
+
+    bool server_ready = false, client_ready = false;
+    for ( size_t i = 0; i < pollfds.size(); i++ ) {
+      if ( pollfds[ i ].revents & POLLIN ) {
+	( i < server_fds ? server_ready : client_ready ) = true;
+      }
+    }
+    if ( server_ready ) {
+      server.recv();
+    }
+    if ( client_ready ) {
+      if ( deaf ) {
+	/* read and drop what arrived */
+	char buf[ 65536 ];
+	for ( size_t i = server_fds; i < pollfds.size(); i++ ) {
+	  if ( pollfds[ i ].revents & POLLIN ) {
+	    fatal_assert( read( pollfds[ i ].fd, buf, sizeof( buf ) ) >= 0 );
+	  }
+	}
+      } else {
+	client.recv();
+      }
+    }
+  }
+
+  *caught_up = same_text( client.get_latest_remote_state().state.get_fb(), terminal.get_fb() );
+  return peak;
+}
+
+int main()
+{
+  bool caught_up;
+  size_t unlimited = run( 0, &caught_up );
+  printf( "without a budget, the sent states held up to %d bytes\n", int( unlimited ) );
+  if ( unlimited <= BUDGET ) {
+    fprintf( stderr, "The states never outgrew the budget to be tested.\n" );
+    return EXIT_FAILURE;
+  }
+
+  size_t limited = run( BUDGET, &caught_up );
+  printf( "with a budget of %d, up to %d bytes; client %s\n", int( BUDGET ), int( limited ),
+	  caught_up ? "caught up" : "left behind" );
+  if ( limited > BUDGET || !caught_up ) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
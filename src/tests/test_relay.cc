@@ -0,0 +1,128 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "test_relay.h"
+
+size_t title_count( const Terminal::Complete &terminal )
+{
+  const Terminal::Framebuffer::title_type &title = terminal.get_fb().get_window_title();
+  return strtoul( std::string( title.begin(), title.end() ).c_str(), NULL, 10 );
+}
+
+void add_fds( std::vector<struct pollfd> &pollfds, const std::vector<int> &fds )
+{
+  for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    struct pollfd pfd;
+    pfd.fd = *i;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pollfds.push_back( pfd );
+  }
+}
+
+Relay::Relay( const std::string &server_port, uint64_t s_delay )
+  : delay( s_delay ), fd( socket( AF_INET, SOCK_DGRAM, 0 ) ), server_addr(), relay_port(),
+    in_flight(), client_addr()
+{
+  fatal_assert( fd >= 0 );
+  struct sockaddr_in relay_addr;
+  memset( &relay_addr, 0, sizeof( relay_addr ) );
+  relay_addr.sin_family = AF_INET;
+  relay_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  socklen_t relay_len = sizeof( relay_addr );
+  fatal_assert( bind( fd, (struct sockaddr *)&relay_addr, sizeof( relay_addr ) ) == 0 );
+  fatal_assert( getsockname( fd, (struct sockaddr *)&relay_addr, &relay_len ) == 0 );
+
+  server_addr = relay_addr;
+  server_addr.sin_port = htons( atoi( server_port.c_str() ) );
+
+  char port_str[ 16 ];
+  snprintf( port_str, sizeof( port_str ), "%d", ntohs( relay_addr.sin_port ) );
+  relay_port = port_str;
+}
+
+Relay::~Relay()
+{
+  close( fd );
+}
+
+bool Relay::pass( const struct sockaddr_in &, bool )
+{
+  return true;
+}
+
+void Relay::pump( bool readable )
+{
+  if ( readable ) {
+    char buf[ 65536 ];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof( from );
+    ssize_t len = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr *)&from, &from_len );
+    fatal_assert( len >= 0 );
+    const bool to_client = from.sin_port == server_addr.sin_port;
+    if ( pass( from, to_client ) ) {
+      if ( !to_client ) {
+	client_addr = from;
+      }
+      in_flight.push_back( Delayed( timestamp() + delay, to_client, std::string( buf, len ) ) );
+    }
+  }
+
+  while ( !in_flight.empty() && in_flight.front().at <= timestamp() ) {
+    const Delayed &d = in_flight.front();
+    const struct sockaddr_in &to = d.to_client ? client_addr : server_addr;
+    sendto( fd, d.payload.data(), d.payload.size(), 0, (const struct sockaddr *)&to, sizeof( to ) );
+    in_flight.pop_front();
+  }
+}
+
+int Relay::wait_time( int wait, uint64_t until ) const
+{
+  if ( until != uint64_t( -1 ) ) {
+    wait = std::min( wait, int( std::max( until, timestamp() ) - timestamp() ) );
+  }
+  if ( !in_flight.empty() ) {
+    wait = std::min( wait, int( std::max( in_flight.front().at, timestamp() ) - timestamp() ) );
+  }
+  return wait;
+}
@@ -0,0 +1,142 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef TEST_RELAY_HPP
+#define TEST_RELAY_HPP
+
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "user.h"
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "networktransport-impl.h"
+#include "timestamp.h"
+
+typedef Network::Transport<Terminal::Complete, Network::UserStream> ServerTransport;
+typedef Network::Transport<Network::UserStream, Terminal::Complete> ClientTransport;
+
+/* the frame count a test's server writes into the window title */
+size_t title_count( const Terminal::Complete &terminal );
+
+/* appends an entry waiting for input on each of fds */
+void add_fds( std::vector<struct pollfd> &pollfds, const std::vector<int> &fds );
+
+/* A relay on loopback, which the client takes for the server, passing
+   each datagram along after a fixed delay. A test subclasses it to
+   drop datagrams or to watch them go by. */
+class Relay {
+private:
+  class Delayed {
+  public:
+    uint64_t at;
+    bool to_client;
+    std::string payload;
+
+    Delayed( uint64_t s_at, bool s_to_client, const std::string &s_payload )
+      : at( s_at ), to_client( s_to_client ), payload( s_payload )
+    {}
+  };
+
+  uint64_t delay; /* ms each way */
+  int fd;
+  struct sockaddr_in server_addr;
+  std::string relay_port;
+  std::deque< Delayed > in_flight;
+
+  /* reads a datagram if readable, then sends on those due */
+  void pump( bool readable );
+  /* wait, cut short by until and by the next datagram due */
+  int wait_time( int wait, uint64_t until ) const;
+
+  /* unused */
+  Relay( const Relay & );
+  Relay & operator=( const Relay & );
+
+protected:
+  struct sockaddr_in client_addr; /* where the client's last passed datagram came from */
+
+  /* Whether to pass along a datagram, received now; the client's
+     address is learned only from those passed. */
+  virtual bool pass( const struct sockaddr_in &from, bool to_client );
+
+public:
+  Relay( const std::string &server_port, uint64_t s_delay );
+  virtual ~Relay();
+
+  /* for the client to connect to */
+  const char *port( void ) const { return relay_port.c_str(); }
+
+  /* Ticks both transports, waits for a datagram until the first of
+     their timers, the next delayed datagram or until (a timestamp),
+     then relays what came in and what is due and has the transports
+     read theirs. */
+  template <class Server, class Client>
+  void turn( Server &server, Client &client, uint64_t until = uint64_t( -1 ) )
+  {
+    client.tick();
+    server.tick();
+
+    const int wait = wait_time( std::min( client.wait_time(), server.wait_time() ), until );
+
+    std::vector<struct pollfd> pollfds;
+    add_fds( pollfds, server.fds() );
+    const size_t server_fds = pollfds.size();
+    add_fds( pollfds, client.fds() );
+    const size_t client_fds = pollfds.size();
+    add_fds( pollfds, std::vector<int>( 1, fd ) );
+    fatal_assert( poll( &pollfds[ 0 ], pollfds.size(), wait ) >= 0 );
+    freeze_timestamp();
+
+    pump( pollfds.back().revents & POLLIN );
+
+    bool server_ready = false, client_ready = false;
+    for ( size_t i = 0; i < client_fds; i++ ) {
+      if ( pollfds[ i ].revents & POLLIN ) {
+	( i < server_fds ? server_ready : client_ready ) = true;
+      }
+    }
+    if ( server_ready ) {
+      server.recv();
+    }
+    if ( client_ready ) {
+      client.recv();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Traffic classes, over loopback, through a relay that reads the mark
+   on each datagram. The server is configured with its own DSCPs and
+   the client keeps the defaults. Acks and frames of one datagram
+   should carry the interactive class, the fragments of a larger frame
+   and path MTU probes the bulk class, and all of them the ECN-capable
+   bit. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "test_relay.h"
+#include "timestamp.h"
+
+using namespace Network;
+
+static const int SERVER_INTERACTIVE = 46; /* EF */
+static const int SERVER_BULK = 8; /* CS1 */
+static const int CLIENT_INTERACTIVE = 0x24; /* AF42, the default */
+static const int CLIENT_BULK = 0x0a; /* AF11, the default */
+static const size_t FULL = 1000; /* bytes; no ack or lone keystroke's echo comes near */
+static const size_t PATH_MTU = 1472; /* an Ethernet path, not loopback's, so screens fragment */
+
+#ifdef HAVE_IP_RECVTOS
+/* a screenful of text that doesn't compress into one datagram */
+static std::string noise( unsigned int &seed, size_t length )
+{
+  std::string text;
+  for ( size_t i = 0; i < length; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    text.push_back( 'a' + ( seed >> 16 ) % 26 );
+  }
+  return text;
+}
+#endif
+
+int main()
+{
+#ifndef HAVE_IP_RECVTOS
+  return 77; /* skip: can't read the marks */
+#else
+  Terminal::Complete terminal( 200, 60 );
+  UserStream blank;
+  ServerTransport server( terminal, blank, "127.0.0.1", NULL );
+  server.set_traffic_class( TRAFFIC_INTERACTIVE, SERVER_INTERACTIVE );
+  server.set_traffic_class( TRAFFIC_BULK, SERVER_BULK );
+
+  /* the relay, which the client takes for the server */
+  int relay = socket( AF_INET, SOCK_DGRAM, 0 );
+  struct sockaddr_in relay_addr, server_addr, client_addr;
+  memset( &relay_addr, 0, sizeof( relay_addr ) );
+  relay_addr.sin_family = AF_INET;
+  relay_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  socklen_t relay_len = sizeof( relay_addr );
+  fatal_assert( relay >= 0 );
+  fatal_assert( bind( relay, (struct sockaddr *)&relay_addr, sizeof( relay_addr ) ) == 0 );
+  fatal_assert( getsockname( relay, (struct sockaddr *)&relay_addr, &relay_len ) == 0 );
+  int on = 1;
+  fatal_assert( setsockopt( relay, IPPROTO_IP, IP_RECVTOS, &on, sizeof( on ) ) == 0 );
+  server_addr = relay_addr;
+  server_addr.sin_port = htons( atoi( server.port().c_str() ) );
+  memset( &client_addr, 0, sizeof( client_addr ) );
+  char relay_port[ 16 ];
+  snprintf( relay_port, sizeof( relay_port ), "%d", ntohs( relay_addr.sin_port ) );
+
+  ClientTransport client( blank, terminal, server.get_key().c_str(), "127.0.0.1", relay_port );
+
+  /* poke the server so it learns our address */
+  client.get_current_state().push_back( Parser::UserByte( 'x' ) );
+
+  freeze_timestamp();
+  const uint64_t start = timestamp();
+  unsigned int seed = 1;
+  unsigned int frames = 0;
+  uint64_t next_frame = start + 500;
+  unsigned int client_interactive = 0, server_interactive = 0, server_bulk = 0, wrong = 0;
+
+  while ( timestamp() - start < 4000 ) {
+    /* a lone line, then a screenful, by turns */
+    if ( timestamp() >= next_frame ) {
+      frames++;
+      terminal.act( frames % 2 ? std::string( "hi\r\n" ) : noise( seed, 200 * 59 ) );
+      server.set_current_state( terminal );
+      next_frame = timestamp() + 500;
+    }
+
+    client.tick();
+    server.tick();
+
+    int wait = std::min( std::min( client.wait_time(), server.wait_time() ),
+			 int( std::max( next_frame, timestamp() ) - timestamp() ) );
+
+    std::vector<struct pollfd> pollfds;
+    add_fds( pollfds, server.fds() );
+    const size_t server_fds = pollfds.size();
+    add_fds( pollfds, client.fds() );
+    const size_t client_fds = pollfds.size();
+    add_fds( pollfds, std::vector<int>( 1, relay ) );
+    fatal_assert( poll( &pollfds[ 0 ], pollfds.size(), wait ) >= 0 );
+    freeze_timestamp();
+
+    if ( pollfds.back().revents & POLLIN ) {
+      char buf[ 65536 ];
+      char control[ 256 ];
+      struct sockaddr_in from;
+      struct iovec iov = { buf, sizeof( buf ) };
+      struct msghdr header;
+      memset( &header, 0, sizeof( header ) );
+      header.msg_name = &from;
+      header.msg_namelen = sizeof( from );
+      header.msg_iov = &iov;
+      header.msg_iovlen = 1;
+      header.msg_control = control;
+      header.msg_controllen = sizeof( control );
+      ssize_t len = recvmsg( relay, &header, 0 );
+      fatal_assert( len >= 0 );
+      if ( size_t( len ) > PATH_MTU ) {
+	continue;
+      }
+
+      int tos = -1;
+      for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &header ); cmsg != NULL; cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+	if ( cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS ) {
+	  tos = *(unsigned char *)CMSG_DATA( cmsg );
+	}
+      }
+
+      const bool to_client = from.sin_port == server_addr.sin_port;
+      const int dscp = tos >> 2;
+      if ( tos < 0 || ( tos & 0x03 ) != 0x02 ) {
+	wrong++;
+      } else if ( !to_client ) {
+	client_addr = from;
+	if ( dscp == CLIENT_INTERACTIVE && size_t( len ) < FULL ) {
+	  client_interactive++;
+	} else if ( dscp != CLIENT_BULK ) {
+	  wrong++;
+	}
+      } else if ( dscp == SERVER_BULK ) {
+	server_bulk++;
+      } else if ( dscp == SERVER_INTERACTIVE && size_t( len ) < FULL ) {
+	server_interactive++;
+      } else {
+	wrong++;
+      }
+
+      if ( to_client ) {
+	sendto( relay, buf, len, 0, (struct sockaddr *)&client_addr, sizeof( client_addr ) );
+      } else {
+	sendto( relay, buf, len, 0, (struct sockaddr *)&server_addr, sizeof( server_addr ) );
+      }
+    }
+
+    bool server_ready = false, client_ready = false;
+    for ( size_t i = 0; i < client_fds; i++ ) {
+      if ( pollfds[ i ].revents & POLLIN ) {
+	( i < server_fds ? server_ready : client_ready ) = true;
+      }
+    }
+    if ( server_ready ) {
+      server.recv();
+    }
+    if ( client_ready ) {
+      client.recv();
+    }
+  }
+
+  close( relay );
+  printf( "client: %u interactive; server: %u interactive, %u bulk; %u marked wrongly\n",
+	  client_interactive, server_interactive, server_bulk, wrong );
+
+  return ( client_interactive > 0 && server_interactive > 0 && server_bulk > 2 && wrong == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+}
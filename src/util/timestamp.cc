@@ -118,3 +118,39 @@ void freeze_timestamp( void )
 # error "gettimeofday() unavailable-- required as timer of last resort"
 #endif
 }
+
+uint64_t timestamp_us( void )
+{
+#if HAVE_CLOCK_GETTIME
+  struct timespec tp;
+
+  if (
+#if defined(__APPLE__) && defined(__MACH__)
+      &clock_gettime != NULL &&
+#endif
+      clock_gettime( CLOCK_MONOTONIC, &tp ) == 0 ) {
+    return uint64_t( tp.tv_sec ) * 1000000 + tp.tv_nsec / 1000;
+  }
+#endif
+#if HAVE_MACH_ABSOLUTE_TIME
+  static double absolute_to_micros = 0.0;
+
+  if (absolute_to_micros == 0.0) {
+    mach_timebase_info_data_t timebase_info;
+    if (ERR_SUCCESS == mach_timebase_info(&timebase_info)) {
+      absolute_to_micros = 1e-3 * timebase_info.numer / timebase_info.denom;
+    } else
+      absolute_to_micros = -1.0;
+  }
+
+  if (absolute_to_micros > 0.0) {
+    return mach_absolute_time() * absolute_to_micros;
+  }
+#endif
+  struct timeval tv;
+  if ( gettimeofday(&tv, NULL) ) {
+    perror( "gettimeofday" );
+    return frozen_timestamp() * 1000;
+  }
+  return uint64_t( tv.tv_sec ) * 1000000 + tv.tv_usec;
+}
@@ -38,4 +38,8 @@
 void freeze_timestamp( void );
 uint64_t frozen_timestamp( void );
 
+/* Microseconds on the same clock, read afresh on every call, for
+   measuring round trips finer than the event loop's frozen time */
+uint64_t timestamp_us( void );
+
 #endif